@@ -11,7 +11,7 @@ int main(int argc, char* argv[])
 {
     if (argc < 4 || argc > 7) {
         cerr << "Usage: " << argv[0] << " <Server Address> <Server Port> "
-            << "[<Passwd1> <Passwd2> <Passwd3>] <Output File>" << endl;
+            << "[<Passwd1> <Passwd2> <Passwd3>] <Output File or Directory>" << endl;
     }
 
     string serverAddress = argv[1];
@@ -8,13 +8,24 @@
 
 int main(int argc, char* argv[])
 {
-    if (argc != 4) {
-        cerr << "Usage: " << argv[0] << " <Server Port> <Password> <input file>" << endl;
+    if (argc < 4 || argc > 6) {
+        cerr << "Usage: " << argv[0] << " <Server Port> <Password> <input file or directory> "
+            << "[<Sessions> [<Config File>]]" << endl;
         exit(1);
     }
     int serverPort = atoi(argv[1]);
     int pwLen = strlen(argv[2]);
-    AppSocket s("127.0.0.1", serverPort, "/media/data/program/git/TlsUdpProtocol/config.json");
-    s.startListen();
-    s.connectToClient(argv[2], pwLen, argv[3]);
+    // one client at a time, sessions one after another on the same port; 0 serves forever
+    int sessions = argc >= 5 ? atoi(argv[4]) : 1;
+    const char* configPath = argc == 6 ? argv[5] : "/media/data/program/git/TlsUdpProtocol/config.json";
+    for (int i = 0; sessions == 0 || i < sessions; ++i) {
+        AppSocket s("127.0.0.1", serverPort, configPath);
+        // TODO: a failed session mustn't stop the following ones
+        try {
+            s.startListen();
+            s.connectToClient(argv[2], pwLen, argv[3]);
+        } catch (SocketException &e) {
+            cerr << e.what() << endl;
+        }
+    }
 }
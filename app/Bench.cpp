@@ -0,0 +1,325 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+#include "../include/AppSocket.h"
+#include <iostream>             // For cerr
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <random>               // incompressible benchmark payloads
+#include <cstdlib>              // For atoi() and mkstemp()
+#include <unistd.h>             // For close() and unlink()
+#include "json/json.h"
+
+#define BENCH_ADDRESS "127.0.0.1"
+
+// raw datagram sizes, and the ReliableSocket packetSize × message size matrix
+static const int udpSizes[] = {64, 512, 1024, 1472};
+static const unsigned int packetSizes[] = {256, 1024, 4096};
+static const unsigned int messageSizes[] = {1024, 65536, 1048576};
+static const unsigned int secureMessageSizes[] = {65536, 1048576};
+// bytes moved by each throughput run, and how many handshakes of each kind
+#define BENCH_RUN_BYTES (8u << 20u)
+#define BENCH_MAX_MESSAGES 512u
+#define BENCH_UDP_DATAGRAMS 200000
+#define BENCH_HANDSHAKES 8
+#define BENCH_FILE_SIZE (16u << 20u)
+
+static unsigned short nextPort;
+static Json::Value baseConfig;
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static string randomPayload(size_t size) {
+    mt19937_64 random(size);
+    string payload(size, '\0');
+    for (auto &c: payload) c = (char)random();
+    return payload;
+}
+
+/**
+ * Temporary config file: the benchmarked config with some keys replaced, removed by its destructor.
+ */
+struct derivedConfig {
+    string path;
+    explicit derivedConfig(const Json::Value &overrides) {
+        Json::Value config = baseConfig;
+        for (auto &key: overrides.getMemberNames()) config[key] = overrides[key];
+        char name[] = "/tmp/tlsudp-bench-XXXXXX";
+        int fd = mkstemp(name);
+        if (fd < 0) throw SocketException("Can't create temporary config file", true);
+        close(fd);
+        path = name;
+        Json::StreamWriterBuilder writer;
+        ofstream(path) << Json::writeString(writer, config);
+    }
+    ~derivedConfig() {unlink(path.c_str());}
+};
+
+/**
+ * The peer of a benchmark, run on its own thread; a failure is kept and rethrown by join.
+ * If the benchmark side throws before join, the destructor unblocks the peer with stop and joins it.
+ */
+struct peerThread {
+    thread worker;
+    string error;
+    function<void()> stop;
+    peerThread(function<void()> body, function<void()> stop): stop(move(stop)) {
+        worker = thread([this, body]{
+            try {body();}
+            catch (exception &e) {error = e.what();}
+        });
+    }
+    void join() {
+        worker.join();
+        if (!error.empty()) throw SocketException("Peer failed: " + error);
+    }
+    ~peerThread() {
+        if (!worker.joinable()) return;
+        // TODO: destroying a joinable thread would terminate the whole bench, not only this benchmark
+        try {stop();}
+        catch (exception &e) {cerr << "bench: can't stop the peer: " << e.what() << endl;}
+        worker.join();
+    }
+};
+
+static Json::Value latencyValue(const LatencyHistogram &histogram) {
+    Json::Value value;
+    value["count"] = (Json::UInt64)histogram.count();
+    value["meanNs"] = histogram.mean();
+    value["p50Ns"] = (Json::UInt64)histogram.quantile(0.5);
+    value["p99Ns"] = (Json::UInt64)histogram.quantile(0.99);
+    value["maxNs"] = (Json::UInt64)histogram.max();
+    return value;
+}
+
+static Json::Value statsValue(const ReliableSocket::transportStats &stats) {
+    Json::Value value;
+    value["packetsSent"] = (Json::UInt64)stats.packetsSent;
+    value["packetsReceived"] = (Json::UInt64)stats.packetsReceived;
+    value["timeoutRetransmits"] = (Json::UInt64)stats.timeoutRetransmits;
+    value["singleRetransmits"] = (Json::UInt64)stats.singleRetransmits;
+    value["duplicatePackets"] = (Json::UInt64)stats.duplicatePackets;
+    value["droppedPackets"] = (Json::UInt64)stats.droppedPackets;
+    return value;
+}
+
+/**
+ * Raw datagrams through UdpSocket::sendTo, received by a bound socket until an end marker.
+ */
+static Json::Value benchUdp(int datagramSize) {
+    unsigned short port = nextPort++;
+    UdpSocket receiver(BENCH_ADDRESS, port);
+    atomic<bool> finished{false};
+    unsigned long long received = 0;
+    double elapsed = 0;
+    peerThread peer([&]{
+        char *buffer = new char [datagramSize];
+        chrono::steady_clock::time_point first;
+        string source; unsigned short sourcePort;
+        while (true) {
+            int size = receiver.recvFrom(buffer, datagramSize, source, sourcePort);
+            if (size > 0 && buffer[0] == 1) break;
+            if (received++ == 0) first = chrono::steady_clock::now();
+        }
+        elapsed = secondsSince(first);
+        finished = true;
+        delete []buffer;
+    }, [port]{
+        char marker = 1;
+        UdpSocket().sendTo(&marker, 1, BENCH_ADDRESS, port);
+    });
+
+    UdpSocket sender;
+    string datagram(datagramSize, '\0');
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_UDP_DATAGRAMS; ++i) sender.sendTo(datagram.c_str(), datagramSize, BENCH_ADDRESS, port);
+    double sendElapsed = secondsSince(start);
+    // TODO: datagrams may be lost on loopback too, repeat the end marker until the receiver saw it
+    datagram[0] = 1;
+    while (!finished) {
+        sender.sendTo(datagram.c_str(), datagramSize, BENCH_ADDRESS, port);
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    peer.join();
+
+    Json::Value value;
+    value["datagramSize"] = datagramSize;
+    value["sent"] = BENCH_UDP_DATAGRAMS;
+    value["received"] = (Json::UInt64)received;
+    value["sendPps"] = BENCH_UDP_DATAGRAMS / sendElapsed;
+    value["receivePps"] = elapsed > 0 ? received / elapsed : 0;
+    value["receiveMBps"] = elapsed > 0 ? received * (double)datagramSize / elapsed / 1e6 : 0;
+    return value;
+}
+
+/**
+ * Send count messages of messageSize from a client to a listening server socket of the same type,
+ *  the time runs from the first setPackets to the return of the last sendMessage.
+ */
+template <typename Socket>
+static Json::Value benchMessages(const char *configPath, unsigned int messageSize) {
+    unsigned int count = max(4u, min(BENCH_MAX_MESSAGES, BENCH_RUN_BYTES / messageSize));
+    unsigned short port = nextPort++;
+    Socket server(configPath);
+    server.bindLocalAddressPort(BENCH_ADDRESS, port);
+    peerThread peer([&]{
+        server.startListen();
+        for (unsigned int i = 0; i < count; ++i) server.receiveMessage();
+    }, [&]{server.cancel();});
+
+    Socket client(configPath);
+    client.connectForeignAddressPort(BENCH_ADDRESS, port);
+    string message = randomPayload(messageSize);
+    auto start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < count; ++i) {
+        client.setPackets(message.c_str(), messageSize);
+        client.sendMessage();
+    }
+    double elapsed = secondsSince(start);
+    peer.join();
+
+    Json::Value value;
+    value["messageSize"] = messageSize;
+    value["messages"] = count;
+    value["seconds"] = elapsed;
+    value["goodputMBps"] = (double)count * messageSize / elapsed / 1e6;
+    value["messagesPerSecond"] = count / elapsed;
+    value["sendMessage"] = latencyValue(client.getLatency().sendMessage);
+    value["transport"] = statsValue(client.getStats());
+    return value;
+}
+
+/**
+ * Full key exchanges each to a new server port, then resumed ones presenting the ticket of the last port.
+ *  Only connectForeignAddressPort is timed, not the prime generation of the socket constructors.
+ */
+static Json::Value benchHandshakes(const char *configPath) {
+    LatencyHistogram full, resumed;
+    unsigned short port = 0;
+    for (int i = 0; i < 2 * BENCH_HANDSHAKES; ++i) {
+        if (i < BENCH_HANDSHAKES) port = nextPort++;
+        SecureSocket server(configPath);
+        server.bindLocalAddressPort(BENCH_ADDRESS, port);
+        peerThread peer([&]{server.startListen();}, [&]{server.cancel();});
+        SecureSocket client(configPath);
+        auto start = chrono::steady_clock::now();
+        client.connectForeignAddressPort(BENCH_ADDRESS, port);
+        (client.isResumed() ? resumed : full).recordSince(start);
+        peer.join();
+    }
+
+    Json::Value value;
+    value["full"] = latencyValue(full);
+    value["fullPerSecond"] = full.count() > 0 ? 1e9 / full.mean() : 0;
+    value["resumed"] = latencyValue(resumed);
+    value["resumedPerSecond"] = resumed.count() > 0 ? 1e9 / resumed.mean() : 0;
+    return value;
+}
+
+/**
+ * A whole AppSocket session: password exchange, Merkle leaves, chunks and the final digest check.
+ */
+static Json::Value benchFile(const char *configPath) {
+    char name[] = "/tmp/tlsudp-bench-file-XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) throw SocketException("Can't create temporary input file", true);
+    close(fd);
+    string input = name, output = input + ".out";
+    ofstream(input, ios::binary) << randomPayload(BENCH_FILE_SIZE);
+
+    unsigned short port = nextPort++;
+    AppSocket server(BENCH_ADDRESS, port, configPath);
+    peerThread peer([&]{
+        server.startListen();
+        server.connectToClient("bench", 5, input.c_str());
+    }, [&]{server.cancel();});
+    AppSocket client(configPath);
+    auto start = chrono::steady_clock::now();
+    client.connectForeignAddressPort(BENCH_ADDRESS, port);
+    int result = client.connectToServer("bench,bench,bench", 17, output.c_str());
+    double elapsed = secondsSince(start);
+    peer.join();
+
+    ifstream check(output, ios::binary | ios::ate);
+    bool complete = result == CONNECT_OK && check.is_open() && (unsigned long long)check.tellg() == BENCH_FILE_SIZE;
+    unlink(input.c_str()); unlink(output.c_str());
+
+    Json::Value value;
+    value["fileSize"] = BENCH_FILE_SIZE;
+    value["seconds"] = elapsed;
+    value["MBps"] = BENCH_FILE_SIZE / elapsed / 1e6;
+    value["complete"] = complete;
+    value["transport"] = statsValue(client.getStats());
+    return value;
+}
+
+/**
+ * Run one benchmark, a failure is reported in its entry instead of stopping the others.
+ */
+static Json::Value run(const string &name, function<Json::Value()> benchmark) {
+    cerr << "bench: " << name << endl;
+    try {
+        return benchmark();
+    } catch (exception &e) {
+        Json::Value value;
+        value["error"] = e.what();
+        return value;
+    }
+}
+
+int main(int argc, char *argv[]){
+    if (argc != 3 && argc != 4) {     // Test for correct number of parameters
+        cerr << "Usage: " << argv[0] << " <Config File> <Output JSON File> [Base Port]" << endl;
+        exit(1);
+    }
+
+    const char *configPath = argv[1];
+    // TODO: not stdout, AppSocket prints the result of the transfer there
+    ofstream output(argv[2]);
+    if (!output.is_open()) {
+        cerr << "Can't create output file " << argv[2] << endl;
+        exit(1);
+    }
+    nextPort = argc == 4 ? atoi(argv[3]) : 40000;
+    try {
+        baseConfig = ReliableSocket::readConfigFile(configPath);
+    } catch (SocketException &e) {
+        cerr << e.what() << endl;
+        exit(1);
+    }
+
+    Json::Value result;
+    result["config"] = configPath;
+    result["hardwareThreads"] = thread::hardware_concurrency();
+
+    for (int size: udpSizes)
+        result["udp"].append(run("udp " + to_string(size), [&]{return benchUdp(size);}));
+
+    // TODO: the receive buffer has to hold a whole packet of every packetSize
+    for (unsigned int packetSize: packetSizes) {
+        Json::Value overrides;
+        overrides["packetSize"] = packetSize;
+        overrides["bufferSize"] = max(baseConfig.get("bufferSize", 1200).asUInt(), packetSize + 6);
+        derivedConfig config(overrides);
+        for (unsigned int messageSize: messageSizes) {
+            auto value = run("reliable " + to_string(packetSize) + " " + to_string(messageSize),
+                    [&]{return benchMessages<ReliableSocket>(config.path.c_str(), messageSize);});
+            value["packetSize"] = packetSize;
+            result["reliable"].append(value);
+        }
+    }
+
+    result["handshake"] = run("secure handshake", [&]{return benchHandshakes(configPath);});
+    for (unsigned int messageSize: secureMessageSizes)
+        result["secure"].append(run("secure " + to_string(messageSize),
+                [&]{return benchMessages<SecureSocket>(configPath, messageSize);}));
+
+    result["app"] = run("app file", [&]{return benchFile(configPath);});
+
+    Json::StreamWriterBuilder writer;
+    output << Json::writeString(writer, result) << endl;
+    return 0;
+}
@@ -0,0 +1,174 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+#include "../include/PacketCapture.h"
+#include <iostream>             // For cout and cerr
+#include <sstream>
+#include <map>
+#include <algorithm>            // For max()
+#include <cstdlib>              // For strtoul()
+#include <arpa/inet.h>          // For inet_ntoa() and ntohs()
+
+// ReliableSocket header flags
+#define HAN_FLAG 0x80u
+#define LEN_FLAG 0x40u
+#define FIN_FLAG 0x20u
+#define ACK_FLAG 0x10u
+#define MSG_FLAG 0x8u
+// flags of the SecureSocket key exchange messages
+#define PUB_FLAG 0x80u
+#define SEC_FLAG 0x40u
+
+/**
+ * Messages of one direction of one socket being put back together, and what happened to its packets.
+ */
+struct flowState {
+    string name;
+    unsigned int messageLength = 0, receivedBytes = 0, messageRetransmits = 0;
+    map<unsigned short, string> pieces;
+    unsigned long long messageStart = 0, lastPacket = 0, messageStall = 0;
+    // totals
+    unsigned long long packets = 0, bytes = 0, messages = 0, msgPackets = 0, retransmits = 0;
+    unsigned long long acks = 0, duplicateAcks = 0, controlPackets = 0, maxStall = 0;
+    map<unsigned short, unsigned int> ackSeen;
+};
+
+static string address(unsigned int ip, unsigned short port) {
+    in_addr addr; addr.s_addr = ip;
+    return string(inet_ntoa(addr)) + ":" + to_string(ntohs(port));
+}
+
+static string flagNames(unsigned short flag) {
+    string names;
+    if ((flag & HAN_FLAG) != 0u) names += "HAN ";
+    if ((flag & LEN_FLAG) != 0u) names += "LEN ";
+    if ((flag & FIN_FLAG) != 0u) names += "FIN ";
+    if ((flag & ACK_FLAG) != 0u) names += "ACK ";
+    if ((flag & MSG_FLAG) != 0u) names += "MSG ";
+    if (!names.empty()) names.pop_back();
+    return names;
+}
+
+/**
+ * What a complete reliable message is: a SecureSocket key exchange message, or encrypted data.
+ */
+static string describeMessage(const string &message) {
+    if (message.size() >= 4) {
+        unsigned short bodySize = *(const unsigned short *)message.c_str();
+        unsigned short flag = *((const unsigned short *)message.c_str() + 1);
+        if (flag == PUB_FLAG && bodySize % 2 == 0 && bodySize + 4u == message.size())
+            return "PUB public g & p of " + to_string(bodySize / 2 * 8) + " bits";
+        if (flag == SEC_FLAG && bodySize + 4u == message.size())
+            return "SEC g^x mod p of " + to_string(bodySize * 8) + " bits";
+    }
+    if (message.size() == 32) return "encrypted length message";
+    return "encrypted data";
+}
+
+static void finishMessage(flowState &flow, unsigned long long timestamp, unsigned long long start, bool verbose) {
+    flow.messages++;
+    if (verbose) {
+        string message;
+        for (auto &piece: flow.pieces) message += piece.second;
+        cout << (timestamp - start) / 1000.0 << "us " << flow.name << " message " << flow.messageLength << " bytes: "
+            << describeMessage(message) << ", " << flow.messageRetransmits << " retransmits, took "
+            << (timestamp - flow.messageStart) / 1000.0 << "us, longest gap " << flow.messageStall / 1000.0 << "us" << endl;
+    }
+    flow.messageLength = 0; flow.receivedBytes = 0; flow.messageRetransmits = 0; flow.messageStall = 0;
+    flow.pieces.clear();
+}
+
+int main(int argc, char *argv[]){
+    if (argc != 2 && argc != 3) {     // Test for correct number of parameters
+        cerr << "Usage: " << argv[0] << " <Capture File> [packets|messages|summary]" << endl;
+        exit(1);
+    }
+
+    string mode = argc == 3 ? argv[2] : "packets";
+    if (mode != "packets" && mode != "messages" && mode != "summary") {
+        cerr << "Unknown output mode " << mode << endl;
+        exit(1);
+    }
+    vector<PacketCapture::capturedPacket> packets;
+    if (!PacketCapture::load(argv[1], packets)) {
+        cerr << "Can't read capture file " << argv[1] << endl;
+        exit(1);
+    }
+
+    // TODO: a flow is one direction of one capturing socket, both ends of a local transfer show up twice
+    map<pair<unsigned int, bool>, flowState> flows;
+    unsigned long long start = packets.empty() ? 0 : packets.front().timestamp;
+    cout << fixed;
+    cout.precision(3);
+    for (auto &packet: packets) {
+        auto &flow = flows[{packet.interface, packet.outbound}];
+        string source = address(packet.outbound ? packet.ends.localAddress : packet.ends.foreignAddress,
+                packet.outbound ? packet.ends.localPort : packet.ends.foreignPort);
+        string destination = address(packet.outbound ? packet.ends.foreignAddress : packet.ends.localAddress,
+                packet.outbound ? packet.ends.foreignPort : packet.ends.localPort);
+        if (flow.name.empty())
+            flow.name = "if" + to_string(packet.interface) + (packet.outbound ? " out " : " in ") + source + " > " + destination;
+        flow.packets++; flow.bytes += packet.payload.size();
+        if (flow.lastPacket != 0 && flow.messageLength != 0 && !flow.pieces.empty()) {
+            flow.messageStall = max(flow.messageStall, packet.timestamp - flow.lastPacket);
+            flow.maxStall = max(flow.maxStall, packet.timestamp - flow.lastPacket);
+        }
+        flow.lastPacket = packet.timestamp;
+
+        if (packet.payload.size() < 6) {
+            if (mode == "packets")
+                cout << (packet.timestamp - start) / 1000.0 << "us " << flow.name << " short datagram "
+                    << packet.payload.size() << " bytes" << endl;
+            continue;
+        }
+        auto header = (const unsigned short *)packet.payload.c_str();
+        unsigned short bodySize = header[0], seqNumber = header[1], flag = header[2];
+        string body = packet.payload.substr(6);
+
+        stringstream line;
+        line << "[" << flagNames(flag) << "] seq=" << seqNumber << " body=" << bodySize;
+        bool complete = false;
+        if (flag == MSG_FLAG) {
+            flow.msgPackets++;
+            if (flow.pieces.count(seqNumber) != 0) {
+                flow.retransmits++; flow.messageRetransmits++;
+                line << " retransmit";
+            } else if (flow.messageLength != 0) {
+                flow.pieces[seqNumber] = body;
+                flow.receivedBytes += body.size();
+                complete = flow.receivedBytes >= flow.messageLength;
+            } else {
+                flow.retransmits++;
+                line << " retransmit after its message";
+            }
+        } else if (flag == (MSG_FLAG | ACK_FLAG)) {
+            flow.acks++;
+            // TODO: a second ack of a packet in the same message means its sender resent the packet
+            if (flow.ackSeen[seqNumber]++ != 0) {flow.duplicateAcks++; line << " duplicate";}
+        } else {
+            flow.controlPackets++;
+            if (flag == LEN_FLAG) {
+                line << " length=" << body;
+                // the length packet is resent until the first message packet or its ack comes back
+                if (flow.messageLength != 0 && flow.pieces.empty()) line << " resent";
+                else {
+                    if (flow.messageLength != 0) finishMessage(flow, packet.timestamp, start, mode != "summary");
+                    flow.messageLength = strtoul(body.c_str(), nullptr, 10);
+                    flow.messageStart = packet.timestamp;
+                }
+            } else if (flag == (LEN_FLAG | ACK_FLAG)) flow.ackSeen.clear();
+        }
+        if (mode == "packets") cout << (packet.timestamp - start) / 1000.0 << "us " << flow.name << " " << line.str() << endl;
+        if (complete) finishMessage(flow, packet.timestamp, start, mode != "summary");
+    }
+
+    for (auto &entry: flows) {
+        auto &flow = entry.second;
+        cout << flow.name << ": " << flow.packets << " packets " << flow.bytes << " bytes, "
+            << flow.msgPackets << " MSG (" << flow.retransmits << " retransmitted), "
+            << flow.acks << " ACK (" << flow.duplicateAcks << " duplicate), "
+            << flow.controlPackets << " HAN/LEN/FIN, " << flow.messages << " messages, longest gap inside a message "
+            << flow.maxStall / 1000.0 << "us" << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,212 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+#include "../include/AppSocket.h"
+#include "../include/ThreadPool.h"
+#include <iostream>             // For cerr
+#include <fstream>
+#include <random>               // exponential inter-arrival times
+#include <atomic>
+#include <unistd.h>             // For unlink() and getpid()
+#include "json/json.h"
+
+// a session presenting this password is rejected by the server right after the key exchange
+#define HANDSHAKE_PASSWORD "-,-,-"
+// a rate saturates the servers when less than this fraction of its sessions per second complete
+#define SATURATION_FRACTION 0.9
+
+/**
+ * Sessions of one kind, each workload has its own appserver ports and one worker per port:
+ *  a worker always finds a free port, sessions arriving while all ports are busy queue for a worker.
+ */
+struct workload {
+    string name;
+    bool handshakeOnly = false;
+    double weight = 1;
+    vector<unsigned short> ports;
+
+    ThreadPool *pool = nullptr;
+    mutex portsMutex;
+    vector<unsigned short> freePorts;
+    // arrival to the end of the session, and the session alone once it got a port
+    LatencyHistogram latency, service;
+    atomic<unsigned long long> completed{0}, failed{0};
+    chrono::steady_clock::time_point lastCompletion;
+};
+
+static string serverAddress, passCat;
+static const char *configPath;
+static atomic<unsigned long long> sessionCount{0};
+
+/**
+ * One AppClient session on a free port of the workload, timed from its scheduled arrival.
+ */
+static void runSession(workload &kind, chrono::steady_clock::time_point arrival) {
+    unsigned short port;
+    {
+        lock_guard<mutex> lock(kind.portsMutex);
+        port = kind.freePorts.back();
+        kind.freePorts.pop_back();
+    }
+    auto start = chrono::steady_clock::now();
+    string output = "/tmp/tlsudp-loadgen-" + to_string(getpid()) + "-" + to_string(sessionCount++);
+    bool success;
+    try {
+        AppSocket client(configPath);
+        client.connectForeignAddressPort(serverAddress, port);
+        // TODO: receiveFile creates the output before any data, only the result tells a whole transfer
+        if (kind.handshakeOnly)
+            success = client.connectToServer(HANDSHAKE_PASSWORD, 5, output.c_str()) == CONNECT_REJECTED;
+        else success = client.connectToServer(passCat.c_str(), passCat.size(), output.c_str()) == CONNECT_OK;
+    } catch (SocketException &e) {
+        success = false;
+    } catch (exception &e) {
+        // TODO: bad_alloc or system_error of a session fail only that session, not the whole worker
+        success = false;
+    }
+    unlink(output.c_str()); unlink((output + ".ckpt").c_str());
+
+    auto end = chrono::steady_clock::now();
+    {
+        lock_guard<mutex> lock(kind.portsMutex);
+        kind.freePorts.push_back(port);
+        if (end > kind.lastCompletion) kind.lastCompletion = end;
+    }
+    if (success) {
+        kind.latency.record(end - arrival);
+        kind.service.record(end - start);
+        kind.completed++;
+    } else kind.failed++;
+}
+
+static Json::Value latencyValue(const LatencyHistogram &histogram) {
+    Json::Value value;
+    value["meanMs"] = histogram.mean() / 1e6;
+    value["p50Ms"] = histogram.quantile(0.5) / 1e6;
+    value["p90Ms"] = histogram.quantile(0.9) / 1e6;
+    value["p99Ms"] = histogram.quantile(0.99) / 1e6;
+    value["maxMs"] = histogram.max() / 1e6;
+    return value;
+}
+
+/**
+ * Open loop: sessions arrive as a Poisson process of the given rate for duration seconds, whether the
+ *  earlier ones completed or not, then every session that arrived is run to its end.
+ */
+static Json::Value runRate(vector<workload *> &kinds, double rate, double duration, mt19937_64 &random) {
+    vector<double> weights;
+    for (auto kind: kinds) {
+        kind->latency.reset(); kind->service.reset();
+        kind->completed = 0; kind->failed = 0;
+        weights.push_back(kind->weight);
+    }
+    exponential_distribution<double> interArrival(rate);
+    discrete_distribution<size_t> pick(weights.begin(), weights.end());
+
+    // TODO: the dispatcher is the only event loop here, sessions block on their sockets in the pools
+    unsigned long long arrivals = 0;
+    auto start = chrono::steady_clock::now();
+    auto stop = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(duration));
+    auto arrival = start;
+    vector<future<void>> sessions;
+    while (true) {
+        arrival += chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(interArrival(random)));
+        if (arrival >= stop) break;
+        this_thread::sleep_until(arrival);
+        auto kind = kinds[pick(random)];
+        sessions.push_back(kind->pool->submit([kind, arrival]{runSession(*kind, arrival);}));
+        arrivals++;
+    }
+    for (auto &session: sessions) session.get();
+
+    Json::Value value;
+    value["offeredRate"] = rate;
+    value["arrivals"] = (Json::UInt64)arrivals;
+    unsigned long long completed = 0, failed = 0;
+    auto lastCompletion = start;
+    LatencyHistogram latency;
+    for (auto kind: kinds) {
+        Json::Value kindValue;
+        kindValue["completed"] = (Json::UInt64)kind->completed.load();
+        kindValue["failed"] = (Json::UInt64)kind->failed.load();
+        kindValue["latency"] = latencyValue(kind->latency);
+        kindValue["service"] = latencyValue(kind->service);
+        value["workloads"][kind->name] = kindValue;
+        completed += kind->completed; failed += kind->failed;
+        latency.merge(kind->latency);
+        if (kind->lastCompletion > lastCompletion) lastCompletion = kind->lastCompletion;
+    }
+    // TODO: throughput over the time it took to finish what arrived, a backlog stretches it past duration
+    double elapsed = max(duration, chrono::duration<double>(lastCompletion - start).count());
+    value["completed"] = (Json::UInt64)completed;
+    value["failed"] = (Json::UInt64)failed;
+    value["throughput"] = completed / elapsed;
+    value["latency"] = latencyValue(latency);
+    value["saturated"] = arrivals > 0 && completed / elapsed < SATURATION_FRACTION * arrivals / duration;
+    return value;
+}
+
+int main(int argc, char *argv[]){
+    if (argc != 4) {     // Test for correct number of parameters
+        cerr << "Usage: " << argv[0] << " <Config File> <Load File> <Output JSON File>" << endl;
+        exit(1);
+    }
+
+    configPath = argv[1];
+    Json::Value load = ReliableSocket::readConfigFile(argv[2]);
+    // TODO: not stdout, AppSocket prints the result of every session there
+    ofstream output(argv[3]);
+    if (!output.is_open()) {
+        cerr << "Can't create output file " << argv[3] << endl;
+        exit(1);
+    }
+
+    serverAddress = load.get("server", "127.0.0.1").asString();
+    string password = load.get("password", "").asString();
+    passCat = password + "," + password + "," + password;
+    double duration = load.get("duration", 10).asDouble();
+    mt19937_64 random(load.get("seed", 1).asUInt64());
+
+    vector<workload *> kinds;
+    for (auto &kindValue: load["workloads"]) {
+        auto kind = new workload;
+        kind->name = kindValue.get("name", "").asString();
+        kind->handshakeOnly = kindValue.get("session", "file").asString() == "handshake";
+        kind->weight = kindValue.get("weight", 1).asDouble();
+        for (auto &port: kindValue["ports"]) kind->ports.push_back((unsigned short)port.asUInt());
+        if (kind->ports.empty() || kind->weight <= 0) {
+            cerr << "Workload " << kind->name << " needs a positive weight and server ports" << endl;
+            exit(1);
+        }
+        kind->freePorts = kind->ports;
+        kind->pool = new ThreadPool(kind->ports.size());
+        kinds.push_back(kind);
+    }
+    if (kinds.empty() || load["rates"].empty()) {
+        cerr << "The load file needs workloads and rates" << endl;
+        exit(1);
+    }
+
+    // TODO: raise the rate until the servers saturate, a saturated rate would only grow the backlog further
+    Json::Value result;
+    result["duration"] = duration;
+    result["saturationRate"] = Json::Value::null;
+    for (auto &rateValue: load["rates"]) {
+        double rate = rateValue.asDouble();
+        cerr << "loadgen: " << rate << " sessions/s" << endl;
+        auto step = runRate(kinds, rate, duration, random);
+        result["steps"].append(step);
+        if (step["saturated"].asBool()) {
+            result["saturationRate"] = rate;
+            break;
+        }
+    }
+
+    Json::StreamWriterBuilder writer;
+    output << Json::writeString(writer, result) << endl;
+    for (auto kind: kinds) {
+        delete kind->pool;
+        delete kind;
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+#include "../include/AppSocket.h"
+#include <iostream>             // For cout and cerr
+#include <fstream>
+#include <atomic>
+#include <new>                  // replaced operator new & delete
+#include <cstdlib>              // For malloc() and free()
+#include <cstring>
+#include "json/json.h"
+
+// message packet flag of ReliableSocket.cpp, packet type of a file chunk of AppSocket.cpp
+#define MSG_FLAG 0x8u
+#define APP_DATA 0x010
+// each benchmark repeats its operation until it ran for this long
+#define MICROBENCH_MIN_SECONDS 0.2
+
+/**
+ * Allocations of the process: operator new of the sockets, and the mpz limbs of GMP.
+ */
+static atomic<unsigned long long> allocations{0}, allocatedBytes{0};
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    allocatedBytes.fetch_add(size, memory_order_relaxed);
+    if (void *memory = malloc(size == 0 ? 1 : size)) return memory;
+    throw bad_alloc();
+}
+void *operator new[](size_t size) {return operator new(size);}
+void operator delete(void *memory) noexcept {free(memory);}
+void operator delete[](void *memory) noexcept {free(memory);}
+void operator delete(void *memory, size_t) noexcept {free(memory);}
+void operator delete[](void *memory, size_t) noexcept {free(memory);}
+
+static void *countedMalloc(size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    allocatedBytes.fetch_add(size, memory_order_relaxed);
+    return malloc(size);
+}
+static void *countedRealloc(void *memory, size_t, size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    allocatedBytes.fetch_add(size, memory_order_relaxed);
+    return realloc(memory, size);
+}
+static void countedFree(void *memory, size_t) {free(memory);}
+
+/**
+ * Times the private codecs of the socket layers, it's their friend.
+ */
+class MicroBench {
+public:
+    explicit MicroBench(const char *configPath): secure(configPath), app(configPath) {}
+
+    /**
+     * Repeat an operation for at least MICROBENCH_MIN_SECONDS, in rounds doubling the iterations.
+     * @param name benchmark name
+     * @param operation one op, it has to release what it allocates
+     */
+    template <typename Operation>
+    void measure(const string &name, Operation operation) {
+        operation();    // warm up
+        unsigned long long iterations = 1;
+        while (true) {
+            unsigned long long startAllocations = allocations.load(), startBytes = allocatedBytes.load();
+            auto start = chrono::steady_clock::now();
+            for (unsigned long long i = 0; i < iterations; ++i) operation();
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            if (elapsed < MICROBENCH_MIN_SECONDS && iterations < (1ull << 40u)) {
+                iterations *= 2;
+                continue;
+            }
+            Json::Value value;
+            value["name"] = name;
+            value["iterations"] = (Json::UInt64)iterations;
+            value["nsPerOp"] = elapsed * 1e9 / iterations;
+            value["bytesPerOp"] = (double)(allocatedBytes.load() - startBytes) / iterations;
+            value["allocationsPerOp"] = (double)(allocations.load() - startAllocations) / iterations;
+            cout << name << "\t" << iterations << "\t" << value["nsPerOp"].asDouble() << " ns/op\t"
+                << value["bytesPerOp"].asDouble() << " B/op\t" << value["allocationsPerOp"].asDouble() << " allocs/op" << endl;
+            results.append(value);
+            return;
+        }
+    }
+
+    void run() {
+        unsigned int packetSize = secure.packetSize;
+        string body(packetSize, 'x');
+
+        // TODO: the reliable header codec, with a full packet body
+        ReliableSocket::formatPacket fpacket;
+        fpacket.bodySize = packetSize; fpacket.seqNumber = 7; fpacket.flag = MSG_FLAG;
+        fpacket.packetBody = &body[0];
+        char *packet = ReliableSocket::deparsePacket(fpacket);
+        measure("ReliableSocket::parsePacket/" + to_string(packetSize), [&]{
+            auto parsed = ReliableSocket::parsePacket(packet);
+            delete []parsed.packetBody;
+        });
+        measure("ReliableSocket::deparsePacket/" + to_string(packetSize), [&]{
+            delete []ReliableSocket::deparsePacket(fpacket);
+        });
+        delete []packet;
+
+        // TODO: splitting a message into packets and joining them back
+        for (unsigned int messageSize: {1024u, 65536u, 1048576u}) {
+            string message(messageSize, 'm');
+            char *destination = new char [messageSize + 1];
+            measure("ReliableSocket::setPackets/" + to_string(messageSize), [&]{
+                secure.setPackets(message.c_str(), messageSize);
+            });
+            measure("ReliableSocket::readMessage/" + to_string(messageSize), [&]{
+                secure.readMessage(destination, messageSize + 1);
+            });
+            delete []destination;
+        }
+        secure.releasePackets();
+
+        // TODO: the application codec of a DATA packet
+        AppSocket::formatPacket apacket;
+        apacket.header = APP_DATA; apacket.payloadLength = packetSize; apacket.packetID = 3;
+        apacket.body = &body[0];
+        char *appPacket = AppSocket::deparsePacket(apacket);
+        measure("AppSocket::parsePacket/" + to_string(packetSize), [&]{
+            auto parsed = AppSocket::parsePacket(appPacket);
+            delete []parsed.body;
+        });
+        measure("AppSocket::deparsePacket/" + to_string(packetSize), [&]{
+            delete []AppSocket::deparsePacket(apacket);
+        });
+        delete []appPacket;
+
+        string password(64, 'p');
+        measure("AppSocket::sha1/64", [&]{
+            delete []app.sha1(&password[0]);
+        });
+
+        // TODO: the DH key exchange, g^X mod p then (g^Y)^X mod p
+        string bits = to_string(secure.primeBitsLength);
+        unsigned int privateSize = secure.primeBitsLength / 8 + 4;
+        char *privatePacket = new char [privateSize];
+        measure("SecureSocket::prepareEphemeralKey/" + bits, [&]{
+            secure.prepareEphemeralKey();
+        });
+        measure("SecureSocket::getPrivatePacket/" + bits, [&]{
+            secure.getPrivatePacket(privatePacket, privateSize);
+        });
+        measure("SecureSocket::parsePrivatePacket/" + bits, [&]{
+            secure.parsePrivatePacket(privatePacket);
+        });
+        delete []privatePacket;
+    }
+
+    Json::Value results{Json::arrayValue};
+
+private:
+    SecureSocket secure;
+    AppSocket app;
+};
+
+int main(int argc, char *argv[]){
+    if (argc != 2 && argc != 3) {     // Test for correct number of parameters
+        cerr << "Usage: " << argv[0] << " <Config File> [Output JSON File]" << endl;
+        exit(1);
+    }
+
+    mp_set_memory_functions(countedMalloc, countedRealloc, countedFree);
+    try {
+        MicroBench bench(argv[1]);
+        cout << fixed;
+        cout.precision(1);
+        bench.run();
+        if (argc == 3) {
+            ofstream output(argv[2]);
+            Json::StreamWriterBuilder writer;
+            output << Json::writeString(writer, bench.results) << endl;
+        }
+    } catch (SocketException &e) {
+        cerr << e.what() << endl;
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+#include "../include/EventTrace.h"
+#include <iostream>             // For cout and cerr
+
+int main(int argc, char *argv[]){
+    if (argc != 2 && argc != 3) {     // Test for correct number of parameters
+        cerr << "Usage: " << argv[0] << " <Trace File> [text|chrome]" << endl;
+        exit(1);
+    }
+
+    string format = argc == 3 ? argv[2] : "text";
+    if (format != "text" && format != "chrome") {
+        cerr << "Unknown output format " << format << endl;
+        exit(1);
+    }
+    vector<EventTrace::traceEvent> events;
+    if (!EventTrace::load(argv[1], events)) {
+        cerr << "Can't read trace file " << argv[1] << endl;
+        exit(1);
+    }
+    if (format == "chrome") EventTrace::writeChromeJson(events, cout);
+    else EventTrace::writeText(events, cout);
+    return 0;
+}
@@ -6,11 +6,19 @@
 #define TLSUDPPROTOCOL_APPSOCKET_H
 
 #include "SecureSocket.h"
+#include "DeltaSync.h"
+#include <openssl/evp.h>
+#include <deque>     // deque of chunks being verified
+#include <future>    // future<bool> of a verified chunk
 
 #define DATA_SIZE 1000
 #define READ_BUF_SIZE 1010
 
-#define STRING_MAX 30000
+// results of connectToServer
+#define CONNECT_OK 0
+#define CONNECT_ABORTED -1          // the server didn't ask for the password, or answered it with neither accept nor REJECT
+#define CONNECT_REJECTED -2         // the server rejected the password
+#define CONNECT_TRANSFER_FAILED -3  // accepted, but the server couldn't open its input or it didn't arrive whole
 
 
 /**
@@ -19,6 +27,9 @@
 class AppSocket : public SecureSocket
 {
 private:
+    // app/MicroBench.cpp times the private codecs on their own
+    friend class MicroBench;
+
     /**
      * App socket format, with three header.
      * More specific description about the bits message was list on README.md
@@ -57,6 +68,211 @@ private:
 
     char* getCharPacket(unsigned short type, unsigned int length, unsigned int pID, char* content);
 
+    /**
+     * Load the application keys of the config file, such as digestAlgorithm.
+     * SecureSocket::loadConfig already ran in the parent constructor, so only app keys are read here.
+     * @param configPath configuration file path.
+     */
+    void loadAppConfig(const char *configPath);
+
+    // hash of the Merkle tree leaves and nodes, EVP picks the SHA-NI/AVX2 implementation at runtime
+    const EVP_MD *digestType = nullptr;
+
+    // file bytes per DATA message, all of its reliable packets are kept in flight together
+    unsigned int chunkSize = DATA_SIZE;
+
+    // "mmap": send page-backed views of the mapped input file, "stream": pread it chunk by chunk
+    string fileSource = "mmap";
+
+    // workers hashing leaves, 0 means one per hardware thread
+    unsigned int hashThreads = 0;
+    shared_ptr<ThreadPool> hashPool;
+
+    // receiver side: send signatures of an existing output file so only the differences are sent
+    bool deltaSync = true;
+    unsigned int deltaBlockSize = 2048;
+
+    // zlib compression of DATA chunks, used when both sides have it, level 1 favours speed
+    unsigned int compressCodec = 0;
+    int compressLevel = 1;
+
+    /**
+     * Worker pool hashing chunks into Merkle leaves, created on the first transfer.
+     */
+    shared_ptr<ThreadPool> getHashPool();
+
+    /**
+     * Send a packet of [2 bytes header][4 bytes payload length][payload], the body is not copied.
+     */
+    void sendPacket(unsigned short type, const string& body);
+
+    /**
+     * Receive a whole packet of any length.
+     * @return the packet, empty if its payload length doesn't match the message
+     */
+    string receivePacket();
+
+    /**
+     * Send one DATA message, its header and the chunk are passed as views down to the crypto layer.
+     * @param type DATA, or DATA_Z for a compressed chunk
+     * @param pID packet ID of the chunk
+     * @param chunk file bytes, not copied
+     * @param length chunk length
+     */
+    void sendDataChunk(unsigned short type, unsigned int pID, const char* chunk, unsigned int length);
+
+    /**
+     * Sender side view of the input file: mapped when fileSource is mmap, read with pread otherwise.
+     */
+    struct chunkSource
+    {
+        int fd = -1;
+        unsigned long long fileSize = 0;
+        const char* mapped = nullptr;
+
+        bool open(const char* add, bool useMmap);
+        ~chunkSource();
+
+        /**
+         * @param buffer chunkSize bytes, filled if the file isn't mapped
+         * @return the chunk, nullptr if it can't be read
+         */
+        const char* chunk(unsigned int index, unsigned int chunkSize, char* buffer, unsigned int& length) const;
+    };
+
+    /**
+     * Compress a chunk at compressLevel, run on the hash pool ahead of the chunk being sent.
+     * @return empty if the chunk doesn't shrink or can't be read
+     */
+    string compressChunk(const chunkSource& src, unsigned int index) const;
+
+    /**
+     * Leaf of a chunk: H(0x00 || chunk).
+     */
+    string leafHash(const char* chunk, unsigned int length) const;
+
+    /**
+     * Root of the Merkle tree over the concatenated leaves, inner nodes are H(0x01 || left || right).
+     */
+    string merkleRoot(const string& leaves) const;
+
+    /**
+     * Hash every chunk of the file into its leaf on the hash pool.
+     */
+    string hashLeaves(const chunkSource& src);
+
+    /**
+     * Sender side of a transfer, after PASS_RESP was accepted.
+     * @param peerCodecs compression codecs the receiver announced in JOIN_REQ
+     * @return true if the receiver verified the whole file, false after a REJECT if the file can't be opened
+     */
+    bool transferFile(const char* add, unsigned int peerCodecs);
+
+    /**
+     * Entry of a directory tree, path relative to its root with '/' separators.
+     */
+    struct treeEntry
+    {
+        string path;
+        unsigned char kind = 0;
+        unsigned long long size = 0;
+    };
+
+    /**
+     * Sender side of a directory: a MANIFEST of the tree, the files of at most chunkSize bytes batched together,
+     *  then every larger file as in transferFile, all in the session PASS_RESP opened.
+     * @return true if the receiver verified every file
+     */
+    bool transferTree(const char* add, unsigned int peerCodecs);
+
+    /**
+     * Receiver side of a directory: create the tree of the manifest under add, then receive its files.
+     * @param manifest MANIFEST body
+     * @return true if every file was written and verified
+     */
+    bool receiveTree(const char* add, const string& manifest);
+
+    /**
+     * Append the directories and regular files below root/relative to entries, each directory before its content.
+     * @return false if a directory can't be read
+     */
+    bool listTree(const string& root, const string& relative, vector<treeEntry>& entries) const;
+
+    /**
+     * MANIFEST body: [4 bytes entry count], then [1 byte kind][8 bytes size][2 bytes path length][path] per entry.
+     * Decoding rejects absolute paths and any "." or ".." component.
+     */
+    static string encodeManifest(const vector<treeEntry>& entries);
+    static bool decodeManifest(const string& body, vector<treeEntry>& entries);
+
+    static bool readSmallFile(const string& path, unsigned long long size, string& content);
+
+    /**
+     * Receiver side state of the chunks of one file transfer.
+     */
+    struct receiveState
+    {
+        int fd = -1;
+        int checkpointFd = -1;
+        unsigned long long fileSize = 0;
+        unsigned int chunkSize = 0;
+        unsigned int digestLen = 0;
+        vector<bool> chunksReceived;
+        unsigned int receivedCount = 0;
+        string leaves;
+        int basisFd = -1;
+        unsigned long long basisSize = 0;
+        unsigned long long deltaOffset = 0;
+    };
+
+    /**
+     * Receiver side of a transfer, after PASS_ACCEPT: each chunk is checked against its leaf on the hash pool
+     *  as soon as it lands, the chunks failing it are requested again with RETRANS.
+     * @return true if the whole file was written and verified
+     */
+    bool receiveFile(const char* add, receiveState& st);
+
+    /**
+     * Wait for the oldest chunk being verified, and mark it received if it matched its leaf.
+     */
+    void finishChunk(receiveState& st, deque<pair<unsigned int, future<bool>>>& verifying);
+
+    /**
+     * Mark the chunks written by a delta whose data on disk matches their leaf, on the hash pool.
+     */
+    void verifyOnDisk(receiveState& st);
+
+    /**
+     * Sidecar checkpoint <output>.ckpt: a header identifying the transfer, then one [index][leaf]
+     *  record per verified chunk. Kept on failure, removed once the file is verified.
+     */
+    int startCheckpoint(const string& path, const receiveState& st);
+    void appendCheckpoint(receiveState& st, unsigned int index);
+
+    /**
+     * Load the checkpoint of the same transfer, and mark the chunks whose data on disk still matches it.
+     * @param claim RESUME body: ranges of these chunks followed by their leaves
+     * @return false if there is no checkpoint of this file size, chunk size and digest
+     */
+    bool loadCheckpoint(const string& path, receiveState& st, string& claim);
+
+    /**
+     * Sender side: the claimed chunks whose leaf matches the file being sent.
+     * @param message RESUME packet of the receiver
+     */
+    vector<bool> acceptClaim(const string& message, const string& leaves, unsigned int chunkCount);
+
+    /**
+     * Chunk ranges of RESUME and RETRANS bodies: [4 bytes range count][4 bytes first][4 bytes end, excluded]...
+     */
+    static string encodeRanges(const vector<bool>& chunks);
+    static bool decodeRanges(const string& body, vector<bool>& chunks, size_t& consumed);
+
+    /**
+     * Check the type of a packet and decode the ranges of its body.
+     */
+    static bool parseRanges(const string& message, unsigned short type, vector<bool>& chunks, size_t& consumed);
+
 public:
     /**
      *   Construct a app socket
@@ -79,6 +295,7 @@ public:
     ~AppSocket();
 
     //passCat = 3 * password, connect with ','
+    //return CONNECT_OK, or the CONNECT_ABORTED / CONNECT_REJECTED / CONNECT_TRANSFER_FAILED failure
     int connectToServer(const char* passCat, int passLen, const char* add);
 
     int connectToClient(const char* pass, int passLen, const char* add);
@@ -0,0 +1,94 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#ifndef TLSUDPPROTOCOL_DELTASYNC_H
+#define TLSUDPPROTOCOL_DELTASYNC_H
+
+#include <openssl/evp.h>        // EVP_MD of the strong hash
+#include <string>
+#include <vector>               // vector<blockSignature> blocks
+#include <functional>           // function<void(const string&)> emit
+
+// bytes of the strong hash kept per block, a false match is caught by the Merkle leaves anyway
+#define DELTA_STRONG_SIZE 8
+
+using namespace std;
+
+/**
+ * rsync style delta of a new file against a basis the peer already has:
+ *  the peer sends the signature of every block of its basis, the sender finds these blocks
+ *  at any offset of the new file with a rolling checksum, and sends copy instructions for them
+ *  and literal bytes for everything else.
+ */
+class DeltaSync {
+public:
+    /**
+     * @param strongType hash of the strong signature, truncated to DELTA_STRONG_SIZE bytes
+     * @param blockSize bytes per basis block, replaced by the one of a loaded signature
+     */
+    DeltaSync(const EVP_MD *strongType, unsigned int blockSize);
+
+    /**
+     * Rolling checksum of a whole block: s1 = sum(x_i), s2 = sum((length - i) * x_i), (s2 << 16) | s1 mod 2^16.
+     * Vectorized with SSSE3 where the CPU has it, scalar otherwise.
+     */
+    static unsigned int blockChecksum(const unsigned char *block, unsigned int length);
+
+    /**
+     * Slide the checksum of a block of blockLength bytes one byte forward.
+     * @param out byte leaving the block
+     * @param in byte entering the block
+     */
+    static unsigned int rollChecksum(unsigned int checksum, unsigned char out, unsigned char in, unsigned int blockLength);
+
+    /**
+     * Receiver side: signature of the full blocks of the basis,
+     *  [4 bytes block size][4 bytes block count], then [4 bytes checksum][strong hash] per block.
+     * @return empty if the basis can't be read
+     */
+    string signature(int basisFd, unsigned long long basisSize) const;
+
+    /**
+     * Sender side: load the signature of the peer's basis.
+     * @return false if it is malformed
+     */
+    bool loadSignature(const string &body);
+
+    /**
+     * Sender side: instructions rebuilding data from the loaded basis,
+     *  [0x00][4 bytes first block][4 bytes block count] copies blocks, [0x01][4 bytes length][bytes] is literal.
+     * @param flushSize emit the pending instructions once they reach this size
+     * @param emit called with each batch of instructions, in order
+     */
+    void diff(const char *data, unsigned long long size, unsigned int flushSize,
+            const function<void(const string&)> &emit) const;
+
+    /**
+     * Receiver side: apply a batch of instructions, writing outFd from outOffset on.
+     * @param outOffset advanced past the written bytes
+     * @return false if an instruction is malformed, out of the basis or of outLimit, or IO fails
+     */
+    bool patch(const string &instructions, int basisFd, unsigned long long basisSize,
+            int outFd, unsigned long long &outOffset, unsigned long long outLimit) const;
+
+    unsigned int getBlockSize() const {return blockSize;}
+
+private:
+    struct blockSignature {
+        unsigned int checksum;
+        unsigned int index;
+        unsigned char strong[DELTA_STRONG_SIZE];
+    };
+
+    void strongHash(const char *block, unsigned int length, unsigned char *strong) const;
+
+    const EVP_MD *strongType;
+    unsigned int blockSize;
+    // sorted by checksum, with a bitmap of the 16 bit folded checksums to skip most lookups
+    vector<blockSignature> blocks;
+    vector<bool> checksumFilter;
+};
+
+
+#endif //TLSUDPPROTOCOL_DELTASYNC_H
@@ -0,0 +1,126 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#ifndef TLSUDPPROTOCOL_EVENTTRACE_H
+#define TLSUDPPROTOCOL_EVENTTRACE_H
+
+#include <atomic>       // atomic<bool> enabled
+#include <string>
+#include <vector>       // vector<traceEvent> of a loaded trace
+#include <ostream>      // decoder output
+
+// event types
+#define TRACE_PACKET_SENT 0x01
+#define TRACE_PACKET_RECEIVED 0x02
+#define TRACE_PACKET_DROPPED 0x03
+#define TRACE_ACK_RECEIVED 0x04
+#define TRACE_RETRANSMIT 0x05
+#define TRACE_STATE 0x06
+#define TRACE_RECORD_SEALED 0x07
+#define TRACE_RECORD_OPENED 0x08
+#define TRACE_REKEY 0x09
+#define TRACE_RESUME 0x0a
+
+// values of TRACE_STATE events
+#define TRACE_STATE_CONNECTED 0x01
+#define TRACE_STATE_SEND_START 0x02
+#define TRACE_STATE_LEN_ACKED 0x03
+#define TRACE_STATE_SENT 0x04
+#define TRACE_STATE_SEND_FAILED 0x05
+#define TRACE_STATE_LEN_RECEIVED 0x06
+#define TRACE_STATE_RECEIVED 0x07
+
+// values of TRACE_RESUME events
+#define TRACE_RESUME_REJECTED 0x00
+#define TRACE_RESUME_ACCEPTED 0x01
+#define TRACE_RESUME_EARLY_DATA 0x02
+
+using namespace std;
+
+/**
+ * Binary event tracing of the socket layers, cheap enough to leave on:
+ *  each thread appends fixed size events to its own ring buffer without locking, the oldest ones are overwritten.
+ *  When it's switched off, recording costs one relaxed atomic load.
+ *  dump writes the rings to a file, decoded offline to text or Chrome trace JSON by tracedecode.
+ */
+class EventTrace {
+public:
+    /**
+     * One event, written to the trace file as is.
+     *  - seq, flag & size: sequence number, flag and size of the packet, or of the record / message;
+     *  - value: attempt of a sent packet, round trip in nanoseconds of an ack, state, generation of a rekey...
+     */
+    struct traceEvent {
+        unsigned long long timestamp;   // steady clock, nanoseconds
+        unsigned int thread;
+        unsigned int value;
+        unsigned int size;
+        unsigned short type;
+        unsigned short flag;
+        unsigned short seq;
+        unsigned short socket;
+        unsigned int reserved;
+    };
+
+    static void setEnabled(bool on) {enabled.store(on, memory_order_relaxed);}
+    static bool isEnabled() {return enabled.load(memory_order_relaxed);}
+
+    /**
+     * Switch tracing on for the process, for a config asking for it: a later config without it doesn't switch it off.
+     * The first non empty path is dumped to once, when the process exits.
+     * @param path trace file, empty for none
+     */
+    static void start(const string &path);
+
+    /**
+     * Append an event to the ring of the calling thread, if tracing is on.
+     * @param socket id of the socket from newSocketId
+     */
+    static void record(unsigned short type, unsigned short socket, unsigned short seq, unsigned short flag,
+            unsigned int size, unsigned int value) {
+        if (isEnabled()) recordEvent(type, socket, seq, flag, size, value);
+    }
+
+    /**
+     * Distinct id per socket of the process, to tell their events apart.
+     */
+    static unsigned short newSocketId();
+
+    /**
+     * Write the events of every thread's ring, by timestamp: [8 bytes magic][8 bytes count][events].
+     * Events recorded while dumping may be torn, dump when the sockets are idle or at exit.
+     * @return false if the file can't be written
+     */
+    static bool dump(const string &path);
+
+    /**
+     * Read a file written by dump.
+     * @return false if it isn't a trace file, or it's truncated
+     */
+    static bool load(const string &path, vector<traceEvent> &events);
+
+    /**
+     * One line per event, timestamps in microseconds from the first event.
+     */
+    static void writeText(const vector<traceEvent> &events, ostream &out);
+
+    /**
+     * Chrome trace event format, for chrome://tracing or Perfetto: one process per socket, one track per thread.
+     */
+    static void writeChromeJson(const vector<traceEvent> &events, ostream &out);
+
+private:
+    static void recordEvent(unsigned short type, unsigned short socket, unsigned short seq, unsigned short flag,
+            unsigned int size, unsigned int value);
+
+    static string typeName(unsigned short type);
+    static string describe(const traceEvent &event);
+
+    static void dumpAtExit();
+
+    static atomic<bool> enabled;
+};
+
+
+#endif //TLSUDPPROTOCOL_EVENTTRACE_H
@@ -0,0 +1,161 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#ifndef TLSUDPPROTOCOL_KEYPOOL_H
+#define TLSUDPPROTOCOL_KEYPOOL_H
+
+#include <gmp.h>                // for big integer
+#include <memory>               // shared_ptr<EphemeralKeyPool>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>                // deque<keyPair> readyPairs
+#include <vector>               // vector<shared_ptr<EphemeralKeyPool>> registry
+#include <atomic>               // atomic taken & drained counters
+
+using namespace std;
+
+/**
+ * Precomputed powers of a fixed base g modulo p, split in windows of windowBits:
+ *     table[i][j] = g^(j * 2^(windowBits * i)) mod p
+ * so g^x mod p costs one multiplication per window of x instead of a full mpz_powm.
+ * The entry of a window is selected by reading its whole row, so the timing doesn't depend on the secret x.
+ */
+class FixedBaseTable {
+public:
+    /**
+     * Build the table, this is the expensive part and should be done only once per (g, p).
+     * @param g fixed base
+     * @param p modulus
+     * @param windowBits window width in bits, table size grows with 2^windowBits
+     */
+    FixedBaseTable(const mpz_t g, const mpz_t p, unsigned int windowBits);
+
+    /**
+     * Release the table.
+     */
+    ~FixedBaseTable();
+
+    /**
+     * rop = g^exponent mod p. Fall back to mpz_powm if exponent has more bits than p.
+     */
+    void power(mpz_t rop, const mpz_t exponent) const;
+
+private:
+    // Prevent copying the table, it owns a lot of mpz_t
+    FixedBaseTable(const FixedBaseTable &table);
+    void operator=(const FixedBaseTable &table);
+
+    unsigned int windowBits = 0;
+    unsigned int windowCount = 0;
+    size_t limbCount = 0;
+    mpz_t base, modulus;
+    // windowCount * 2^windowBits entries of limbCount limbs
+    mp_limb_t *table = nullptr;
+};
+
+/**
+ * A background thread keeps a queue of ready ephemeral (x, g^x mod p) pairs,
+ *  so the handshake only pops a pair instead of doing modular exponentiation.
+ * Pools are shared between sockets using the same public g and p, and live as long as the process:
+ *  a server creating a socket per session keeps its table and ready pairs across sessions.
+ */
+class EphemeralKeyPool {
+public:
+    /**
+     * Get the pool of the given public parameters, create it if it doesn't exist yet.
+     * @param poolSize maximum number of ready pairs kept in the queue
+     * @param windowBits window width of the fixed-base table
+     */
+    static shared_ptr<EphemeralKeyPool> acquire(const mpz_t g, const mpz_t p,
+            unsigned int poolSize, unsigned int windowBits);
+
+    /**
+     * Get the pool of the given public parameters only if some socket has already created it.
+     * @return nullptr if there is no such pool
+     */
+    static shared_ptr<EphemeralKeyPool> find(const mpz_t g, const mpz_t p);
+
+    /**
+     * Stop the background thread, wipe and release the queued pairs.
+     */
+    ~EphemeralKeyPool();
+
+    /**
+     * Pop a ready pair. If the queue is drained, compute one in the caller thread.
+     * @param x destination of the secret exponent
+     * @param gx destination of g^x mod p
+     */
+    void take(mpz_t x, mpz_t gx);
+
+    /**
+     * Number of ready pairs in the queue.
+     */
+    size_t readySize();
+
+    /**
+     * Maximum number of ready pairs kept in the queue.
+     */
+    unsigned int getPoolSize() const {return poolSize;}
+
+    /**
+     * Utilization of every live pool of the process, for the metrics exporter.
+     */
+    struct poolUsage {
+        size_t pools = 0, ready = 0, capacity = 0;
+        // pairs taken, and takes that found the queue drained and computed the pair themselves
+        unsigned long long taken = 0, drained = 0;
+    };
+    static poolUsage usage();
+
+    /**
+     * Overwrite the limbs of a secret exponent before it's released, mpz_clear doesn't.
+     */
+    static void wipe(mpz_t secret);
+
+private:
+    EphemeralKeyPool(const mpz_t g, const mpz_t p, unsigned int poolSize, unsigned int windowBits);
+    EphemeralKeyPool(const EphemeralKeyPool &pool);
+    void operator=(const EphemeralKeyPool &pool);
+
+    bool sameParameters(const mpz_t g, const mpz_t p) const;
+
+    /**
+     * Generate one pair with the table if it is ready, or mpz_powm otherwise.
+     * Caller must hold randMutex.
+     */
+    void generatePair(mpz_t x, mpz_t gx);
+
+    /**
+     * Background thread: build the table, then keep the queue filled.
+     */
+    void fillLoop();
+
+    struct keyPair {
+        mpz_t x;
+        mpz_t gx;
+    };
+
+    unsigned int poolSize = 0;
+    unsigned int windowBits = 0;
+    mpz_t publicG, publicP;
+
+    shared_ptr<FixedBaseTable> table;
+    gmp_randstate_t randState;
+    mutex randMutex;
+
+    deque<keyPair *> readyPairs;
+    mutex poolMutex;
+    condition_variable poolChanged;
+    bool stopping = false;
+    thread filler;
+    atomic<unsigned long long> taken{0}, drained{0};
+
+    static mutex registryMutex;
+    // TODO: strong references, a pool outlives the sockets of one session
+    static vector<shared_ptr<EphemeralKeyPool>> registry;
+};
+
+
+#endif //TLSUDPPROTOCOL_KEYPOOL_H
@@ -0,0 +1,97 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#ifndef TLSUDPPROTOCOL_LATENCYHISTOGRAM_H
+#define TLSUDPPROTOCOL_LATENCYHISTOGRAM_H
+
+#include <atomic>       // atomic bucket counts
+#include <chrono>       // chrono::steady_clock::duration samples
+
+// sub-buckets per power of two, the value of a bucket is at most 1/16 above any sample in it
+#define HISTOGRAM_SUB_BITS 4u
+#define HISTOGRAM_SUB_BUCKETS (1u << HISTOGRAM_SUB_BITS)
+// values below HISTOGRAM_SUB_BUCKETS are exact, then HISTOGRAM_SUB_BUCKETS buckets per power of two up to 2^64
+#define HISTOGRAM_BUCKETS ((64u - HISTOGRAM_SUB_BITS + 1u) * HISTOGRAM_SUB_BUCKETS)
+
+using namespace std;
+
+/**
+ * Log bucketed histogram of latencies in nanoseconds, HDR style with 4 bits of precision per power of two.
+ * Recording is a few relaxed atomic adds, so any thread can record into a shared histogram,
+ *  and histograms of several connections or threads can be merged before querying quantiles.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    /**
+     * Histograms hold atomics, copying one copies a snapshot of its counts.
+     */
+    LatencyHistogram(const LatencyHistogram &other);
+    LatencyHistogram &operator=(const LatencyHistogram &other);
+
+    /**
+     * Record one sample.
+     * @param nanoseconds latency of the sample
+     */
+    void record(unsigned long long nanoseconds) {
+        counts[bucketIndex(nanoseconds)].fetch_add(1, memory_order_relaxed);
+        total.fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(nanoseconds, memory_order_relaxed);
+        unsigned long long seen = maximum.load(memory_order_relaxed);
+        while (nanoseconds > seen && !maximum.compare_exchange_weak(seen, nanoseconds, memory_order_relaxed)) {}
+    }
+
+    void record(chrono::steady_clock::duration latency) {
+        record((unsigned long long)chrono::duration_cast<chrono::nanoseconds>(latency).count());
+    }
+
+    /**
+     * Record the time elapsed since start.
+     */
+    void recordSince(chrono::steady_clock::time_point start) {record(chrono::steady_clock::now() - start);}
+
+    /**
+     * Add the samples of another histogram, of another connection or thread, to this one.
+     */
+    void merge(const LatencyHistogram &other);
+
+    void reset();
+
+    unsigned long long count() const {return total.load(memory_order_relaxed);}
+    unsigned long long max() const {return maximum.load(memory_order_relaxed);}
+    unsigned long long sumOfSamples() const {return sum.load(memory_order_relaxed);}
+    double mean() const;
+
+    /**
+     * Samples of the buckets whose upper end is at most a value, for cumulative exporter buckets.
+     * @return at most 1/16 below the exact count of samples not above the value
+     */
+    unsigned long long countAtMost(unsigned long long nanoseconds) const;
+
+    /**
+     * Latency under which a fraction of the samples fall, e.g. 0.5, 0.99 or 0.999.
+     * @return upper end of the bucket holding that sample, at most 1/16 above it, 0 without samples
+     */
+    unsigned long long quantile(double fraction) const;
+
+private:
+    static unsigned int bucketIndex(unsigned long long value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) return (unsigned int)value;
+        unsigned int exponent = 63u - (unsigned int)__builtin_clzll(value);
+        unsigned int shift = exponent - HISTOGRAM_SUB_BITS;
+        return (shift + 1u) * HISTOGRAM_SUB_BUCKETS + (unsigned int)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1u));
+    }
+
+    /**
+     * Largest value falling into a bucket.
+     */
+    static unsigned long long bucketUpper(unsigned int index);
+
+    atomic<unsigned long long> counts[HISTOGRAM_BUCKETS];
+    atomic<unsigned long long> total{0}, sum{0}, maximum{0};
+};
+
+
+#endif //TLSUDPPROTOCOL_LATENCYHISTOGRAM_H
@@ -0,0 +1,81 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#ifndef TLSUDPPROTOCOL_METRICSEXPORTER_H
+#define TLSUDPPROTOCOL_METRICSEXPORTER_H
+
+#include <string>
+#include <map>                  // metric families by name, collectors by id
+#include <functional>           // function<void(sample &)> collector
+#include "LatencyHistogram.h"
+
+using namespace std;
+
+/**
+ * Process wide export of the socket metrics in Prometheus text format, over a local HTTP port
+ *  and/or into a file rewritten periodically.
+ * Every socket layer registers a collector reading its atomic counters and histograms,
+ *  so the data path takes no lock: only scraping and socket creation & destruction lock the registry.
+ * Counters and histograms of closed sockets are kept, so that they never go down.
+ */
+class MetricsExporter {
+public:
+    /**
+     * Metrics of the whole process being summed up during a scrape.
+     */
+    struct sample {
+        void counter(const string &name, const string &help, double value);
+        void gauge(const string &name, const string &help, double value);
+        void histogram(const string &name, const string &help, const LatencyHistogram &histogram);
+
+        struct family {
+            string type, help;
+            double value = 0;
+            LatencyHistogram histogram;
+        };
+        map<string, family> families;
+    };
+
+    typedef function<void(sample &)> collector;
+
+    /**
+     * Start the exporter the first time a config asks for it, later calls are ignored.
+     * A port that can't be bound is reported on cerr: the sockets work without their metrics.
+     * @param port local HTTP port serving /metrics, 0 for none
+     * @param file file rewritten every interval seconds, empty for none
+     * @param interval seconds between two rewrites of the file
+     * @return whether the exporter runs
+     */
+    static bool start(unsigned short port, const string &file, unsigned int interval);
+
+    /**
+     * Register a collector, called with the registry locked on every scrape.
+     * @return id for removeCollector
+     */
+    static unsigned long long addCollector(collector collect);
+
+    /**
+     * Unregister a collector before what it reads is destroyed, its counters and histograms are retired.
+     */
+    static void removeCollector(unsigned long long id);
+
+    /**
+     * All the metrics of the process in Prometheus text exposition format.
+     */
+    static string render();
+
+private:
+    /**
+     * HTTP thread: answer GET /metrics on the listening socket, one connection at a time.
+     */
+    static void serveHttp(int listenDescriptor);
+
+    /**
+     * File thread: write the metrics to a temporary file and rename it over the file, every interval.
+     */
+    static void writeFile(string file, unsigned int interval);
+};
+
+
+#endif //TLSUDPPROTOCOL_METRICSEXPORTER_H
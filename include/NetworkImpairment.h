@@ -0,0 +1,122 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#ifndef TLSUDPPROTOCOL_NETWORKIMPAIRMENT_H
+#define TLSUDPPROTOCOL_NETWORKIMPAIRMENT_H
+
+#include <string>
+#include <vector>
+#include <queue>                // priority_queue<delayedDatagram> scheduled
+#include <functional>           // function<void(const string &)> transmit
+#include <chrono>
+#include <random>               // mt19937_64
+#include <mutex>
+#include <condition_variable>
+#include <thread>               // scheduler thread
+#include <atomic>               // atomic counters
+
+using namespace std;
+
+/**
+ * Emulated lossy link in front of a socket's outgoing datagrams, like netem without root:
+ *  random and burst loss, fixed & jittered delay, reordering, duplication and a bandwidth cap with a bounded queue.
+ * Each end of a connection impairs what it sends, so the two directions are configured independently.
+ * Datagrams that aren't delayed are sent by the caller, the others by a scheduler thread when they are due.
+ */
+class NetworkImpairment {
+public:
+    /**
+     * Link parameters, rates are probabilities between 0 and 1.
+     *  - burst loss is a Gilbert-Elliott channel: burstEnterRate moves it to the bad state,
+     *    burstExitRate back to the good one, where datagrams are lost with burstLossRate instead of lossRate;
+     *  - a reordered datagram is held reorderDelay longer than the others, so the following ones overtake it;
+     *  - bandwidth in bytes per second, 0 is unlimited; datagrams are dropped when more than queueLimit bytes
+     *    are waiting for the link.
+     */
+    struct settings {
+        double lossRate = 0, burstEnterRate = 0, burstExitRate = 0, burstLossRate = 0;
+        chrono::microseconds delay{0}, jitter{0}, reorderDelay{0};
+        double reorderRate = 0, duplicateRate = 0;
+        unsigned long long bandwidth = 0;
+        unsigned int queueLimit = 0;
+        unsigned long long seed = 0;
+    };
+
+    /**
+     * What the link did to the datagrams, since it was created.
+     */
+    struct impairmentCounters {
+        unsigned long long datagrams = 0, lost = 0, burstLost = 0, queueDropped = 0;
+        unsigned long long delayed = 0, reordered = 0, duplicated = 0;
+    };
+
+    /**
+     * @param linkSettings parameters of the link
+     * @param transmit puts one datagram on the real socket, called by the sender or the scheduler thread
+     */
+    NetworkImpairment(const settings &linkSettings, function<void(const string &)> transmit);
+
+    /**
+     * Wait until the delayed datagrams are sent, then stop the scheduler thread.
+     */
+    ~NetworkImpairment();
+
+    /**
+     * Pass a datagram, given as header followed by body, through the link.
+     * @return true if the datagram was consumed: lost, queued, or sent by transmit;
+     *         false if the caller should send it itself right now, saving a copy
+     */
+    bool submit(const void *header, int headerLen, const void *body = nullptr, int bodyLen = 0);
+
+    /**
+     * Snapshot of the counters, exported by ReliableSocket::collectMetrics.
+     */
+    impairmentCounters getCounters() const;
+
+    /**
+     * Whether these settings change anything, a socket needs no impairment otherwise.
+     */
+    static bool isActive(const settings &linkSettings);
+
+private:
+    struct delayedDatagram {
+        chrono::steady_clock::time_point due;
+        unsigned long long order;
+        string datagram;
+        bool operator<(const delayedDatagram &other) const {
+            return due != other.due ? due > other.due : order > other.order;
+        }
+    };
+
+    /**
+     * Scheduler thread: transmit every delayed datagram when it's due.
+     */
+    void transmitDue();
+
+    /**
+     * Draw the fate of a datagram from the loss model, with linkMutex held.
+     */
+    bool lose();
+
+    settings link;
+    function<void(const string &)> transmit;
+
+    mutex linkMutex;
+    condition_variable scheduleChanged;
+    mt19937_64 random;
+    bool burstState = false, stopping = false;
+    // when the emulated link finishes sending what it was given
+    chrono::steady_clock::time_point linkFree;
+    priority_queue<delayedDatagram> scheduled;
+    unsigned long long nextOrder = 0;
+    thread scheduler;
+
+    struct {
+        atomic<unsigned long long> datagrams{0}, lost{0}, burstLost{0}, queueDropped{0};
+        atomic<unsigned long long> delayed{0}, reordered{0}, duplicated{0};
+    } counters;
+};
+
+
+#endif //TLSUDPPROTOCOL_NETWORKIMPAIRMENT_H
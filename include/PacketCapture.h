@@ -0,0 +1,112 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#ifndef TLSUDPPROTOCOL_PACKETCAPTURE_H
+#define TLSUDPPROTOCOL_PACKETCAPTURE_H
+
+#include <string>
+#include <vector>
+#include <deque>                // deque<string> queue of encoded blocks
+#include <memory>               // shared_ptr<PacketCapture>
+#include <mutex>
+#include <condition_variable>
+#include <thread>               // writer thread
+#include <atomic>               // atomic dropped counter
+#include <fstream>
+
+using namespace std;
+
+/**
+ * Copy of the datagrams of one or more sockets in a pcapng file, readable by Wireshark or tcpdump:
+ *  every socket is an interface of the capture, every datagram gets synthesized IPv4 & UDP headers.
+ * Sockets only copy the datagram into a queue, a writer thread does the file writes;
+ *  datagrams are dropped, and counted, when the queue holds more than queueLimit bytes.
+ */
+class PacketCapture {
+public:
+    /**
+     * Both ends of a datagram seen from the capturing socket, addresses and ports in network byte order.
+     */
+    struct endpoints {
+        unsigned int localAddress = 0, foreignAddress = 0;
+        unsigned short localPort = 0, foreignPort = 0;
+    };
+
+    /**
+     * A datagram read back by load.
+     */
+    struct capturedPacket {
+        unsigned long long timestamp = 0;   // nanoseconds since epoch
+        unsigned int interface = 0;
+        bool outbound = false;
+        endpoints ends;
+        string payload;                     // UDP payload
+    };
+
+    /**
+     * Capture of a file, shared by every socket of the process capturing into the same path.
+     * @param path pcapng file, truncated when it's opened
+     * @param queueLimit bytes waiting for the writer thread above which datagrams are dropped
+     * @exception SocketException thrown if the file can't be created
+     */
+    static shared_ptr<PacketCapture> open(const string &path, unsigned int queueLimit);
+
+    /**
+     * Write out whatever is queued and close the file.
+     */
+    ~PacketCapture();
+
+    /**
+     * Declare a capturing socket.
+     * @param name interface name shown by Wireshark
+     * @return interface id passed to record
+     */
+    unsigned int addInterface(const string &name);
+
+    /**
+     * Queue a datagram sent as header followed by body, or received in header only.
+     * @param outbound true if the socket sent it
+     */
+    void record(unsigned int interface, bool outbound, const endpoints &ends,
+            const void *header, int headerLen, const void *body = nullptr, int bodyLen = 0);
+
+    /**
+     * Datagrams dropped because the writer thread was behind.
+     */
+    unsigned long long getDropped() const {return dropped.load(memory_order_relaxed);}
+
+    /**
+     * Read the datagrams of a capture written by PacketCapture.
+     * @return false if it isn't a pcapng file
+     */
+    static bool load(const string &path, vector<capturedPacket> &packets);
+
+private:
+    explicit PacketCapture(const string &path, unsigned int queueLimit);
+
+    /**
+     * Writer thread: write out the queued pcapng blocks, flush the file whenever the queue runs empty.
+     */
+    void writeBlocks();
+
+    /**
+     * Queue an encoded pcapng block, unless the queue is over queueLimit.
+     * @return false if the block was dropped
+     */
+    bool push(string &&block);
+
+    ofstream file;
+    unsigned int queueLimit;
+    size_t queuedBytes = 0;
+    unsigned int interfaces = 0;
+    bool stopping = false;
+    deque<string> queue;
+    mutex queueMutex;
+    condition_variable queueChanged;
+    atomic<unsigned long long> dropped{0};
+    thread writer;
+};
+
+
+#endif //TLSUDPPROTOCOL_PACKETCAPTURE_H
@@ -6,11 +6,20 @@
 #define TLSUDPPROTOCOL_RELIABLESOCKET_H
 
 #include "UdpSocket.h"
+#include "LatencyHistogram.h"
+#include "EventTrace.h"
+#include "MetricsExporter.h"
+#include "ThreadPool.h"
 
 #include <chrono>               // chrono::milliseconds timeoutInterval
 #include <vector>               // vector<char *> packetBuffer & vector<mutex> packetsMutex
 #include <condition_variable>   // condition_variable completeFlag;
 #include <thread>               // vector<mutex> packetsMutex
+#include <atomic>               // atomic counters of statsCounters
+#include <climits>              // ULLONG_MAX
+#include <future>               // future of the async calls
+#include <queue>                // queue<function<void()>> asyncOperations
+#include <memory>               // shared_ptr<ThreadPool> executor
 #include <json/value.h>
 
 using namespace std::chrono_literals;   //  0ms, 1s
@@ -21,6 +30,9 @@ using namespace std::chrono_literals;   //  0ms, 1s
 class ReliableSocket: protected UdpSocket {
 
 private:
+    // app/MicroBench.cpp times the private codecs on their own
+    friend class MicroBench;
+
     /**
      * Reliable socket format, with three header.
      * More specific description about the bits message was list on README.md
@@ -50,7 +62,7 @@ private:
      * Four function that generate a formatted packet struct
      * @return a formatted packet struct
      */
-    formatPacket getHanPacket() const;
+    formatPacket getHanPacket(const string &body = "") const;
     formatPacket getLenPacket() const;
     formatPacket getMsgAckPacket(unsigned short seqNumber) const;
     formatPacket getLenAckPacket() const;
@@ -99,6 +111,12 @@ public:
     string getForeignAddress() const override {return UdpSocket::getForeignAddress();}
     unsigned short getForeignPort() const override {return UdpSocket::getForeignPort();}
 
+    /**
+     * Parse the json config file without applying anything, for layers that can't override loadConfig.
+     * @param configPath configuration file path.
+     */
+    static Json::Value readConfigFile(const char *configPath);
+
     /**
      * Load config from a json file. Such as: timeoutInterval, packetSize.
      * @param configPath configuration file path.
@@ -166,11 +184,217 @@ public:
       */
      virtual void sendMessage();
 
+    /**
+     * Asynchronous sendMessage of a caller-owned buffer, returning at once.
+     * The operations of a socket run one at a time in call order on its executor,
+     *  so several sends and receives can be outstanding; don't call the blocking API while they are.
+     * @param message message buffer, it has to stay valid until the operation completed
+     * @param mLength message length
+     * @return future ready when the peer acknowledged the whole message, get() rethrows its SocketException
+     */
+    future<void> sendMessageAsync(const char *message, unsigned int mLength);
+
+    /**
+     * Asynchronous receiveMessage into a caller-owned buffer.
+     * @param destBuffer buffer of the message and its trailing \0, it has to stay valid until the operation completed
+     * @param destBufferSize buffer size
+     * @return future of the message length
+     */
+    future<unsigned int> receiveMessageAsync(char *destBuffer, unsigned int destBufferSize);
+
+    /**
+     * Completion callback flavours of the async calls, called on the executor thread with the error if any.
+     * The callback may queue the next operation of the socket, or destroy it:
+     *  the operations still queued are then dropped, their futures throw broken_promise and their callbacks aren't called.
+     */
+    void sendMessageAsync(const char *message, unsigned int mLength, function<void(exception_ptr)> completion);
+    void receiveMessageAsync(char *destBuffer, unsigned int destBufferSize,
+            function<void(unsigned int, exception_ptr)> completion);
+
+    /**
+     * Make the operations blocked in this socket fail with a SocketException within timeoutInterval,
+     *  and every later operation fail at once: a silent peer otherwise blocks a receive forever.
+     * Safe to call from any thread, the socket can't be used afterwards. The destructor calls it.
+     */
+    void cancel();
+
+    /**
+     * Run the async calls of this socket on a pool shared with other sockets, instead of its own thread.
+     * A blocked receive holds a worker, so the pool needs a worker for every socket waiting at the same time.
+     * @param pool executor, set before the first async call
+     */
+    void setExecutor(shared_ptr<ThreadPool> pool);
+
+    /**
+     * Transport counters of this socket since it was created, durations in microseconds.
+     */
+    struct transportStats {
+        unsigned long long packetsSent = 0, bytesSent = 0;
+        unsigned long long packetsReceived = 0, bytesReceived = 0;
+        unsigned long long messagesSent = 0, messagesReceived = 0;
+        // message packets resent after timeoutInterval, handshake & length packets resent, messages given up
+        unsigned long long timeoutRetransmits = 0, singleRetransmits = 0, sendFailures = 0;
+        // packets or acks already confirmed, packets whose flag or sequence number wasn't expected
+        unsigned long long duplicatePackets = 0, droppedPackets = 0;
+        // round trips of message packets acked at their first attempt only
+        unsigned long long rttSamples = 0, rttSum = 0, rttMin = 0, rttMax = 0, rttLast = 0;
+        // connectForeignAddressPort handshake, and the length handshakes of sendMessage
+        unsigned long long connectDuration = 0, lenHandshakes = 0, lenHandshakeSum = 0;
+    };
+
+    /**
+     * Snapshot of the transport counters, safe to call from any thread while messages are in flight.
+     */
+    transportStats getStats() const;
+
+    /**
+     * Latency histograms of this socket in nanoseconds, merge them into one LatencyHistogram across connections.
+     */
+    struct latencyHistograms {
+        // handshake packet exchange of connectForeignAddressPort, or of startListen from the first handshake packet
+        LatencyHistogram handshake;
+        // whole sendMessage, and receiveMessage from its length packet on
+        LatencyHistogram sendMessage, receiveMessage;
+        // first send of a message packet to its ack, for packets acked at their first attempt
+        LatencyHistogram packetAck;
+    };
+
+    const latencyHistograms &getLatency() const {return latency;}
+
 private:
-    void sendSinglePacket(unsigned short seqNumber);
     void sendSinglePacket(formatPacket fpk, bool &successCheck);
 
+    /**
+     * Sender thread of sendMessage: keep at most sendWindow unacknowledged packets on the wire,
+     *     resend each one after timeoutInterval, woken up by packetsAckChanged when acks arrive.
+     * Set sendFailed instead of throwing when a packet exhausts retryTimes.
+     */
+    void sendPacketsWindow();
+
+    mutex packetsAckMutex;
+    condition_variable packetsAckChanged;
+    size_t confirmedCount = 0;
+    bool sendFailed = false;
+    size_t failedSeqNumber = 0;
+    // sends of each packet of the message and time of the last one, for retransmits & rtt samples
+    vector<unsigned int> packetsAttempts;
+    vector<chrono::steady_clock::time_point> packetsSentAt;
+
+    /**
+     * Counters behind getStats, relaxed atomics bumped by the receiving, window sender & single packet threads.
+     */
+    struct statsCounters {
+        atomic<unsigned long long> packetsSent{0}, bytesSent{0}, packetsReceived{0}, bytesReceived{0};
+        atomic<unsigned long long> messagesSent{0}, messagesReceived{0};
+        atomic<unsigned long long> timeoutRetransmits{0}, singleRetransmits{0}, sendFailures{0};
+        atomic<unsigned long long> duplicatePackets{0}, droppedPackets{0};
+        atomic<unsigned long long> rttSamples{0}, rttSum{0}, rttMin{ULLONG_MAX}, rttMax{0}, rttLast{0};
+        atomic<unsigned long long> connectDuration{0}, lenHandshakes{0}, lenHandshakeSum{0};
+    } stats;
+    latencyHistograms latency;
+
+    /**
+     * Collector of the metrics exporter: this socket's counters and histograms, read without locking them.
+     */
+    void collectMetrics(MetricsExporter::sample &metrics) const;
+    unsigned long long metricsCollector = 0;
+
+    void countSent(int datagramSize);
+    void countReceived(int datagramSize);
+    void addRttSample(chrono::steady_clock::duration rtt);
+
+    /**
+     * Mark a single packet sender as acknowledged and wake it up before its timeout.
+     * @param successCheck the flag the sender thread is waiting on
+     */
+    void confirmSinglePacket(bool &successCheck);
+
+    /**
+     * Called by the receiving loops when recv timed out while a single packet sender runs,
+     *     they throw singleFailure from the calling thread if it exhausted retryTimes.
+     * @param sender the sendSinglePacket thread, joined if it gave up
+     */
+    bool singlePacketLost(thread &sender);
+
+    mutex singleAckMutex;
+    condition_variable singleAckChanged;
+    // set by sendSinglePacket instead of throwing on its own thread, which would terminate the process
+    string singleFailure;
+
+    /**
+     * Queue an async operation of this socket, a task of the executor runs them one by one:
+     *  it runs the first queued operation then submits itself again, so sockets sharing a pool take turns.
+     */
+    void runAsync(function<void()> operation);
+    void runNextAsync();
+
+    // set by cancel, checked by every loop waiting on recv timeouts
+    atomic<bool> cancelled{false};
+    void throwIfCancelled() const;
+
+    mutex asyncMutex;
+    condition_variable asyncIdle;
+    queue<function<void()>> asyncOperations;
+    bool asyncRunning = false;
+    // thread running an operation of this socket, and cleared when a completion callback destroyed the socket
+    thread::id asyncThread;
+    shared_ptr<bool> asyncAlive = make_shared<bool>(true);
+    // created with one worker by the first async call, unless setExecutor shared one
+    shared_ptr<ThreadPool> executor;
+
+    /**
+     * Handle a packet the current step doesn't expect.
+     * A message packet or, on the server side, a handshake packet is answered again:
+     *     the peer resends it because the ack of an exchange this side already finished was lost.
+     * Anything else is counted as dropped.
+     */
+    void dropPacket(const formatPacket &fpacket, int receiveSize);
+
+    /**
+     * This side accepted the connection in startListen.
+     */
+    bool listened = false;
+
 protected:
+    /**
+     * Cancel the socket and wait until the queued async operations failed,
+     *  or drop them if a completion callback is destroying the socket.
+     * The destructor of a layer overriding sendMessage or receiveMessage calls it first: they run its code.
+     */
+    void waitAsyncOperations();
+
+    /**
+     * Server side hook called by startListen() with the body of the first handshake packet,
+     *     the returned string is sent back as the body of the handshake ack.
+     * @param request handshake packet body from the client
+     * @return handshake ack body, empty by default
+     */
+    virtual string acceptHandshake(const string &request);
+
+    /**
+     * Body of the first handshake packet.
+     *  - Client side: set before connectForeignAddressPort, sent with the handshake packet;
+     *  - Server side: filled by startListen with what the client sent.
+     */
+    string handshakeRequest;
+
+    /**
+     * Body of the handshake ack.
+     *  - Server side: returned by acceptHandshake;
+     *  - Client side: filled by connectForeignAddressPort with what the server sent back.
+     */
+    string handshakeResponse;
+
+    /**
+     * When the handshake began: the client sent its handshake packet, or the server received it.
+     */
+    chrono::steady_clock::time_point handshakeStart;
+
+    /**
+     * Id of this socket in EventTrace events.
+     */
+    unsigned short traceSocket = EventTrace::newSocketId();
+
     /**
      *  Resend timeout duration.
      *  Integer represent, take milliseconds as unit.
@@ -183,6 +407,11 @@ protected:
      */
     unsigned int retryTimes = 0;
 
+    /**
+     * Maximum number of packets of a message sent but not acknowledged yet.
+     */
+    unsigned int sendWindow = 0;
+
     /**
      * Buffer size when receive message from the peer side.
      */
@@ -203,6 +432,24 @@ protected:
     vector<bool> packetsConfirm;
     unsigned int messageLength = 0;
 
+    /**
+     * packetsBuffer points into a buffer owned by the caller of setPacketsView, don't release it.
+     */
+    bool packetsBorrowed = false;
+
+    /**
+     * Set packetsBuffer as views of the message instead of copies, for zero-copy sending.
+     * The message must stay alive and unchanged until sendMessage returns and releasePackets is called.
+     * @param message message char pointer
+     * @param mLength message buffer length
+     */
+    void setPacketsView(const char *message, unsigned int mLength);
+
+    /**
+     * Release packetsBuffer, except when they are views of a borrowed message.
+     */
+    void releasePackets();
+
     /**
      * A list of mutexs created for each packet
      *  - Server side: Used for sending ack packet back;
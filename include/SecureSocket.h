@@ -7,14 +7,42 @@
 
 #include "ReliableSocket.h"
 
+#include "KeyPool.h"
+#include "ThreadPool.h"
+
 #include <gmp.h>    // for big integer
+#include <openssl/aes.h>    // AES_KEY cached in trafficState
+#include <openssl/evp.h>    // EVP_CIPHER of AEAD records
+#include <memory>   // shared_ptr<EphemeralKeyPool> keyPool
+#include <map>      // map<string, sessionTicket> ticketCache
+#include <mutex>    // mutex ticketMutex
+
+/**
+ * Session ticket sizes: resumption secret, handshake nonce,
+ *  and the sealed ticket [iv 12 bytes][issue time 8 bytes + secret, encrypted][GCM tag 16 bytes]
+ */
+#define RESUMPTION_SECRET_SIZE 32
+#define HANDSHAKE_NONCE_SIZE 16
+#define SESSION_TICKET_SIZE (12 + 8 + RESUMPTION_SECRET_SIZE + 16)
 
 /**
  * A public parameter g used in DH-KEY-EXCHANGE
  */
 
 class SecureSocket : public ReliableSocket{
+public:
+    /**
+     * A piece of a message owned by the caller, such as a header or a page-backed file region.
+     */
+    struct messageView {
+        const unsigned char *data;
+        unsigned int size;
+    };
+
 private:
+    // app/MicroBench.cpp times the private codecs on their own
+    friend class MicroBench;
+
     /**
      * Get public packet which is used in agree on public g and p
      * @param destBuffer destination buffer
@@ -29,6 +57,12 @@ private:
      */
     void parsePublicPacket (const char* srcBuffer);
 
+    /**
+     * Pick the ephemeral secret X and g^X mod p for this handshake.
+     * Pop them from the precomputation pool if there is one for the current g and p.
+     */
+    void prepareEphemeralKey ();
+
     /**
      * Get private packet which is used to send (g^X mod p)
      * @param destBuffer destination buffer
@@ -43,6 +77,186 @@ private:
      */
     void parsePrivatePacket (const char* srcBuffer);
 
+    /**
+     * A ticket the client keeps for resuming with a server.
+     */
+    struct sessionTicket {
+        string ticket;
+        string secret;
+        long long received = 0;
+    };
+
+    /**
+     * Export exchangedKey little endian into a zero padded buffer of primeBitsLength/8 bytes.
+     * @param destBuffer destination buffer
+     */
+    void exportKeyMaterial (unsigned char* destBuffer) const;
+
+    /**
+     * Traffic keys of one direction, derived once per handshake and cached for every message.
+     *  - secret: HKDF secret of the current generation, replaced by HKDF(secret) on rekey;
+     *  - key, iv, aesKey: expanded from secret, aesKey is the AES_set_*_key schedule;
+     *  - records, bytes: usage of the current generation, each message uses two records.
+     */
+    struct trafficState {
+        unsigned char secret[32] = {0};
+        unsigned char key[32] = {0};
+        unsigned char iv[AES_BLOCK_SIZE] = {0};
+        AES_KEY aesKey;
+        unsigned long long records = 0;
+        unsigned long long bytes = 0;
+        unsigned int generation = 0;
+        bool ready = false;
+    };
+
+    /**
+     * Feed exchangedKey through HKDF into client-to-server and server-to-client traffic states.
+     *  Called once at the end of every handshake.
+     */
+    void deriveTrafficKeys ();
+
+    /**
+     * Expand key & iv from the state secret, and cache the AES key schedule.
+     */
+    void expandTrafficKey (trafficState& state, bool encrypt);
+
+    /**
+     * iv of the next record: state iv XOR the record number.
+     */
+    void nextRecordIv (trafficState& state, unsigned char* recordIv) const;
+
+    /**
+     * Account for one record and rotate the state secret once it reaches rekeyRecordLimit or rekeyByteLimit.
+     */
+    void finishRecord (trafficState& state, unsigned int plainSize, bool encrypt);
+
+    /**
+     * Key & iv snapshot of one AEAD record, handed to a crypto worker.
+     */
+    struct recordKey {
+        unsigned char key[32];
+        unsigned char iv[AES_BLOCK_SIZE];
+    };
+
+    /**
+     * EVP cipher of the AEAD records: AES-GCM with aesKeyBitsLength, or ChaCha20-Poly1305.
+     */
+    const EVP_CIPHER* recordCipher (unsigned char cipherId) const;
+
+    /**
+     * Worker pool sealing and opening AEAD records, created on the first large message.
+     */
+    shared_ptr<ThreadPool> getCryptoPool ();
+
+    /**
+     * Split plaintext into records of recordSize, seal them on the crypto pool,
+     *  and send them as reliable messages in sequence order as they finish.
+     */
+    void sendRecords (const vector<messageView>& parts, unsigned int mLength);
+
+    /**
+     * Views of the bytes [offset, offset + size) of the message made of parts.
+     */
+    static vector<messageView> sliceViews (const vector<messageView>& parts, unsigned int offset, unsigned int size);
+
+    /**
+     * Receive the records of a message, open each on the crypto pool while the next one arrives,
+     *  then load the whole plaintext into packetsBuffer.
+     */
+    void receiveRecords (unsigned int mLength, unsigned char cipherId, unsigned int rSize);
+
+    /**
+     * Derive resumptionSecret from the current exchangedKey.
+     */
+    void deriveResumptionSecret ();
+
+    /**
+     * Replace exchangedKey by a fresh key derived from a resumption secret and both nonces,
+     *  then derive the next resumptionSecret from it.
+     */
+    void deriveResumedKey (const unsigned char* secret, const string& clientNonce, const string& serverNonce);
+
+    /**
+     * Server side: encrypt (issue time, resumptionSecret) under the process ticket key.
+     * @return sealed ticket of SESSION_TICKET_SIZE bytes
+     */
+    string sealTicket () const;
+
+    /**
+     * Server side: decrypt and check a ticket from the client.
+     * @param ticket sealed ticket
+     * @param secret destination of the resumption secret
+     * @return false if the ticket is forged, or expired
+     */
+    bool openTicket (const string& ticket, unsigned char* secret) const;
+
+    /**
+     * 0-RTT early data, sealed with AES-256-GCM under a key derived from the resumption secret and client nonce.
+     * @param aad handshake packet bytes before the sealed data, authenticated together with it
+     */
+    string sealEarlyData (const unsigned char* secret, const string& clientNonce, const string& aad) const;
+    bool openEarlyData (const unsigned char* secret, const string& clientNonce, const string& aad,
+            const string& sealed);
+
+    /**
+     * Server side anti-replay of early data: client time must be within earlyDataReplayWindow,
+     *  and the client nonce must not have been seen within the window.
+     */
+    bool checkReplayWindow (const string& clientNonce, long long clientTime) const;
+
+    /**
+     * Client side: send early data as a normal message if the server didn't take it with the handshake.
+     */
+    void sendRejectedEarlyData ();
+
+    /**
+     * Client side ticket store, shared by every socket of the process
+     *  and saved into sessionTicketFile if it is configured.
+     */
+    bool takeTicket (const string& serverName, sessionTicket& ticket);
+    void storeTicket (const string& serverName, const string& ticket);
+    void loadTicketFile ();
+    void saveTicketFile () const;
+
+protected:
+    /**
+     * Server side: try to resume the session with the ticket in the handshake packet.
+     * @param request [RESUME flag][client nonce][ticket]
+     * @return [RESUME flag][server nonce][new ticket] if resumed, empty string otherwise
+     */
+    string acceptHandshake(const string &request) override;
+
+    /**
+     * HKDF-SHA256 (RFC 5869) extract and expand.
+     * @param secret input key material
+     * @param salt optional salt, nullptr for none
+     * @param info context string
+     * @param destBuffer output key material
+     */
+    static void hkdf(const unsigned char* secret, size_t secretLen, const unsigned char* salt, size_t saltLen,
+            const string& info, unsigned char* destBuffer, size_t destSize);
+
+    /**
+     * Cryptographically secure random bytes.
+     */
+    static string randomBytes(size_t size);
+
+    /**
+     * AEAD encryption (AES-GCM, ChaCha20-Poly1305) with a 12 bytes iv.
+     * @return ciphertext followed by the 16 bytes tag
+     */
+    static string aeadSeal(const EVP_CIPHER* cipher, const unsigned char* key, const unsigned char* iv,
+            const string& aad, const unsigned char* plaintext, unsigned int plainSize);
+    static string aeadSeal(const EVP_CIPHER* cipher, const unsigned char* key, const unsigned char* iv,
+            const string& aad, const vector<messageView>& parts, unsigned int plainSize);
+
+    /**
+     * Decrypt ciphertext followed by the 16 bytes tag into plaintext (sealedSize - 16 bytes).
+     * @return false if authentication fails
+     */
+    static bool aeadOpen(const EVP_CIPHER* cipher, const unsigned char* key, const unsigned char* iv,
+            const string& aad, const unsigned char* sealed, unsigned int sealedSize, unsigned char* plaintext);
+
 public:
     /**
      *   Construct a secure socket
@@ -99,12 +313,53 @@ public:
       */
     void sendMessage() override;
 
+    /**
+     * Send the concatenation of parts as one message without joining them first:
+     *  they are encrypted straight from the caller's memory, and the ciphertext is handed
+     *  to the reliable layer as a view. Parts must stay alive until this function returns.
+     * @param parts pieces of the message in order
+     */
+    void sendMessage(const vector<messageView>& parts);
+
     /**
      * Major function of this socket, reliably send message to peer side.
      * program will choice exchangeKey little endian arrangement first bits as AES key.
      */
     void receiveMessage() override;
 
+    /**
+     * Whether the last handshake resumed a session from a ticket and skipped the DH exchange.
+     */
+    bool isResumed() const {return resumedSession;}
+
+    /**
+     * Client side: application data sent with the handshake packet when the session is resumed (0-RTT).
+     *  It must fit in the handshake packet with the ticket and no more than maxEarlyDataSize,
+     *  otherwise or if the server rejects it, it's sent as the first message right after the handshake.
+     *  Early data can be replayed within earlyDataReplayWindow by an attacker, only send idempotent requests.
+     * @param message message char pointer
+     * @param mLength message buffer length
+     */
+    void setEarlyData(const char *message, unsigned int mLength);
+
+    /**
+     * Whether the server took the early data with the handshake.
+     */
+    bool isEarlyDataAccepted() const {return earlyDataAccepted;}
+
+    /**
+     * Latency histograms of the encrypted layer in nanoseconds, next to the reliable ones of getLatency.
+     */
+    struct secureHistograms {
+        // whole key exchange of startListen or connectForeignAddressPort, resumed from a ticket or not
+        LatencyHistogram keyExchange;
+        // whole encrypted sendMessage, and receiveMessage from its length message on
+        LatencyHistogram sendMessage, receiveMessage;
+        // encryption or decryption of one record: a CBC message, or an AEAD record on the crypto pool
+        LatencyHistogram sealRecord, openRecord;
+    };
+
+    const secureHistograms &getSecureLatency() const {return secureLatency;}
 
 protected:
     /**
@@ -121,10 +376,26 @@ protected:
 
     /**
      * Secret random number implement in DH algorithm.
-     * This must be generated when SecureSocket in init, secret=getNumber(1024)
+     * A fresh one is picked for every handshake by prepareEphemeralKey(), secret=getNumber(1024)
      */
     mpz_t privateXNumber;
 
+    /**
+     * Our half of the exchange: g^X mod p, sent in the private packet.
+     */
+    mpz_t publicGXNumber;
+
+    /**
+     * Server side precomputation of (X, g^X mod p) pairs with a fixed-base window table.
+     *  - precomputePoolSize: ready pairs kept in queue, 0 disables the pool;
+     *  - fixedBaseWindowBits: window width of the table, memory grows with 2^fixedBaseWindowBits.
+     * The pool only pays off with a fixed publicPrimeP: a prime generated by each socket is never shared.
+     */
+    unsigned int precomputePoolSize = 16;
+    unsigned int fixedBaseWindowBits = 6;
+    bool generatedPrime = false;
+    shared_ptr<EphemeralKeyPool> keyPool;
+
     /**
      * The exchange result in DH algorithm,
      * Cut the last 256 bits if result is far more than that.
@@ -136,6 +407,63 @@ protected:
      *  program will choice exchangeKey little endian arrangement first bits as AES key.
      */
     unsigned int aesKeyBitsLength = 256;
+
+    /**
+     * Session resumption:
+     *  - sessionTicketLifetime: seconds a ticket stays valid, 0 disables issuing and presenting tickets;
+     *  - sessionTicketFile: optional file where the client keeps its tickets between processes.
+     */
+    unsigned int sessionTicketLifetime = 3600;
+    string sessionTicketFile;
+    unsigned char resumptionSecret[RESUMPTION_SECRET_SIZE] = {0};
+    bool resumedSession = false;
+
+    /**
+     * 0-RTT early data:
+     *  - maxEarlyDataSize: bytes of early data a client may send, and a server accepts;
+     *  - earlyDataReplayWindow: seconds the client time may differ from the server time,
+     *      the server remembers client nonces twice as long to reject replays.
+     */
+    unsigned int maxEarlyDataSize = 1024;
+    unsigned int earlyDataReplayWindow = 10;
+    string earlyData;
+    bool earlyDataAccepted = false;
+
+    /**
+     * Traffic key schedule, keys rotate after rekeyRecordLimit records or rekeyByteLimit bytes.
+     */
+    unsigned long long rekeyRecordLimit = 1u << 24u;
+    unsigned long long rekeyByteLimit = 1u << 30u;
+    trafficState sendTraffic, receiveTraffic;
+    bool isServerSide = false;
+
+    /**
+     * Parallel encryption of large messages:
+     *  - parallelThreshold: messages from this length are sent as AEAD records instead of one CBC message;
+     *  - recordSize: plaintext bytes per record, each record is one reliable message;
+     *  - cryptoThreads: workers of the crypto pool, 0 means one per hardware thread;
+     *  - recordCipherId: aes-gcm or chacha20-poly1305, the receiver reads it from the length message.
+     */
+    unsigned int parallelThreshold = 1u << 20u;
+    unsigned int recordSize = 1u << 18u;
+    unsigned int cryptoThreads = 0;
+    unsigned char recordCipherId = 0x01u;
+    shared_ptr<ThreadPool> cryptoPool;
+
+    secureHistograms secureLatency;
+
+    /**
+     * Collector of the metrics exporter: the encrypted layer's histograms,
+     *  the process wide key pools are collected once for all the secure sockets.
+     */
+    void collectSecureMetrics(MetricsExporter::sample &metrics) const;
+    static void collectKeyPoolMetrics(MetricsExporter::sample &metrics);
+    unsigned long long secureMetricsCollector = 0;
+
+    static map<string, sessionTicket> ticketCache;
+    static mutex ticketMutex;
+    static map<string, long long> earlyDataStrikes;
+    static mutex strikeMutex;
 };
 
 
@@ -0,0 +1,77 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#ifndef TLSUDPPROTOCOL_THREADPOOL_H
+#define TLSUDPPROTOCOL_THREADPOOL_H
+
+#include <vector>               // vector<thread> workers
+#include <queue>                // queue<function<void()>> tasks
+#include <functional>           // function<void()>
+#include <future>               // packaged_task, future
+#include <memory>               // shared_ptr<packaged_task>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+using namespace std;
+
+/**
+ * A fixed number of worker threads running submitted tasks in FIFO order.
+ */
+class ThreadPool {
+public:
+    /**
+     * Start the worker threads.
+     * @param threadCount number of workers, 0 means one per hardware thread
+     */
+    explicit ThreadPool(unsigned int threadCount = 0);
+
+    /**
+     * Run the tasks left in queue, then join every worker.
+     */
+    ~ThreadPool();
+
+    /**
+     * Queue a task for the workers.
+     * @param task callable without parameter
+     * @return future of the task result, exceptions thrown by the task are rethrown by future::get()
+     */
+    template <class F>
+    auto submit(F task) -> future<decltype(task())> {
+        auto packaged = make_shared<packaged_task<decltype(task())()>>(move(task));
+        auto result = packaged->get_future();
+        {
+            lock_guard<mutex> lock(queueMutex);
+            tasks.emplace([packaged]{(*packaged)();});
+        }
+        queueChanged.notify_one();
+        return result;
+    }
+
+    /**
+     * Number of worker threads.
+     */
+    unsigned int size() const {return workers.size();}
+
+    /**
+     * Number of tasks waiting for a worker.
+     */
+    size_t pendingSize();
+
+private:
+    // Prevent copying a pool of running threads
+    ThreadPool(const ThreadPool &pool);
+    void operator=(const ThreadPool &pool);
+
+    void workerLoop();
+
+    vector<thread> workers;
+    queue<function<void()>> tasks;
+    mutex queueMutex;
+    condition_variable queueChanged;
+    bool stopping = false;
+};
+
+
+#endif //TLSUDPPROTOCOL_THREADPOOL_H
@@ -26,6 +26,9 @@
 
 #include <string>            // For string
 #include <exception>         // For exception class
+#include <memory>            // For shared_ptr<PacketCapture>
+#include "PacketCapture.h"   // For datagram capture
+#include "NetworkImpairment.h"   // For emulated lossy links
 
 using namespace std;
 
@@ -158,6 +161,17 @@ public:
      */
     void send(const void *buffer, int bufferLen);
 
+    /**
+     *   Write header and body as one datagram without joining them in
+     *   a new buffer first.  Call connect() before calling send()
+     *   @param header buffer written first
+     *   @param headerLen number of bytes from header to be written
+     *   @param body buffer written right after header
+     *   @param bodyLen number of bytes from body to be written
+     *   @exception SocketException thrown if unable to send data
+     */
+    void send(const void *header, int headerLen, const void *body, int bodyLen);
+
     /**
      *   Read into the given buffer up to bufferLen bytes data from this
      *   socket.  Call connect() before calling recv()
@@ -182,9 +196,35 @@ public:
      */
     virtual unsigned short getForeignPort() const;
 
+    /**
+     *   Copy every datagram sent or received by this socket into a capture,
+     *   the copy is written to the file by the capture's writer thread
+     *   @param packetCapture capture shared with other sockets, nullptr to stop capturing
+     *   @param interfaceName name of this socket in the capture
+     */
+    void setCapture(const shared_ptr<PacketCapture> &packetCapture, const string &interfaceName);
+
+    /**
+     *   Send every datagram of this socket through an emulated lossy link,
+     *   settings that impair nothing remove the link
+     *   @param linkSettings loss, delay, reordering, duplication and bandwidth of the link
+     */
+    void setImpairment(const NetworkImpairment::settings &linkSettings);
+
 protected:
     CommunicatingSocket(int type, int protocol);
     CommunicatingSocket(int newConnSD);
+
+    /**
+     *   Read both ends of the socket again for the capture, after bind() or connect()
+     */
+    void refreshCaptureEndpoints();
+
+    shared_ptr<PacketCapture> capture;
+    unsigned int captureInterface = 0;
+    PacketCapture::endpoints captureEnds;
+
+    unique_ptr<NetworkImpairment> impairment;
 };
 
 /**
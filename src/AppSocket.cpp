@@ -7,14 +7,23 @@
 #include <fstream>
 #include <memory.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <deque>
+#include <zlib.h>
+#include <algorithm>
+#include <cerrno>
 
 #ifdef WIN32
 #include <Windows.h>
 #pragma comment(lib, "libeay32.lib")
 #pragma comment(lib, "ssleay32.lib")
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#include <dirent.h>
 #endif
 
 // HEADER signature bits
@@ -26,6 +35,30 @@
 #define TERMINATE 0x20
 #define REJECT 0x40
 #define DATA_SUC 0x80
+#define RESUME 0x100
+#define LEAVES 0x200
+#define RETRANS 0x400
+#define SIGNATURE 0x800
+#define DELTA 0x1000
+#define DATA_Z 0x2000
+#define MANIFEST 0x4000
+#define BATCH 0x8000
+
+// compression codecs, JOIN_REQ carries the ones the receiver can inflate, PASS_ACCEPT the one chosen
+#define COMPRESS_NONE 0x00
+#define COMPRESS_ZLIB 0x01
+
+// kinds of MANIFEST entries, a file of at most one chunk travels in a BATCH with other small files
+#define ENTRY_DIR 0x00
+#define ENTRY_BATCHED 0x01
+#define ENTRY_FILE 0x02
+
+// RETRANS requests answered before the receiver gives up on chunks failing their leaf
+#define RETRANSMIT_ROUNDS 3
+
+// [8 bytes magic][8 bytes file size][4 bytes chunk size][4 bytes digest nid], then chunk records
+#define CHECKPOINT_MAGIC "TUDPCKPT"
+#define CHECKPOINT_HEADER_SIZE 24
 
 AppSocket::formatPacket AppSocket::parsePacket(const char *pac) {
     formatPacket fpac;
@@ -34,7 +67,7 @@ AppSocket::formatPacket AppSocket::parsePacket(const char *pac) {
     if (fpac.header == DATA)
         fpac.packetID = *(unsigned int*)((unsigned short *)pac + 3);
 
-    if (fpac.header == PASS_RESP || fpac.header == TERMINATE) {
+    if (fpac.header == JOIN_REQ || fpac.header == PASS_RESP || fpac.header == PASS_ACCEPT || fpac.header == TERMINATE || fpac.header == RESUME) {
         fpac.body = new char[fpac.payloadLength];
         memcpy(fpac.body, pac + 6, fpac.payloadLength);
     }
@@ -59,7 +92,7 @@ char* AppSocket::deparsePacket(const AppSocket::formatPacket fpac)
         *(unsigned int *)((unsigned short *)pac + 3) = fpac.packetID;
         memcpy(pac + 10, fpac.body, fpac.payloadLength);
     }
-    else if (fpac.header == PASS_RESP || fpac.header == TERMINATE)
+    else if (fpac.header == JOIN_REQ || fpac.header == PASS_RESP || fpac.header == PASS_ACCEPT || fpac.header == TERMINATE || fpac.header == RESUME)
     {
         pac = new char[6 + fpac.payloadLength];
         *((unsigned short *)pac) = fpac.header;
@@ -114,6 +147,7 @@ char* AppSocket::getCharPacket(unsigned short type, unsigned int length, char* c
 {
     formatPacket fpac = getMediumPacket(type, length, content);
     char* pac = deparsePacket(fpac);
+    delete[]fpac.body;
     return pac;
 }
 
@@ -121,14 +155,51 @@ char* AppSocket::getCharPacket(unsigned short type, unsigned int length, unsigne
 {
     formatPacket fpac = getLongPacket(type, length, pID, content);
     char* pac = deparsePacket(fpac);
+    delete[]fpac.body;
     return pac;
 }
 
-AppSocket::AppSocket(const char *configPath) : SecureSocket(configPath) {}
+AppSocket::AppSocket(const char *configPath) : SecureSocket(configPath)
+{
+    loadAppConfig(configPath);
+}
 
-AppSocket::AppSocket(unsigned short localPort, const char *configPath) : SecureSocket(localPort, configPath) {}
+AppSocket::AppSocket(unsigned short localPort, const char *configPath) : SecureSocket(localPort, configPath)
+{
+    loadAppConfig(configPath);
+}
 
-AppSocket::AppSocket(const string &localAddress, unsigned short localPort, const char *configPath) : SecureSocket(localAddress, localPort, configPath) {}
+AppSocket::AppSocket(const string &localAddress, unsigned short localPort, const char *configPath) : SecureSocket(localAddress, localPort, configPath)
+{
+    loadAppConfig(configPath);
+}
+
+void AppSocket::loadAppConfig(const char *configPath)
+{
+    auto configVal = readConfigFile(configPath);
+    string digestName = configVal.get("digestAlgorithm", "sha1").asString();
+    if (digestName == "sha1") digestType = EVP_sha1();
+    else if (digestName == "sha256") digestType = EVP_sha256();
+    else throw SocketException("Please chose digestAlgorithm from sha1, sha256.");
+    chunkSize = configVal.get("chunkSize", 1u << 16u).asUInt();
+    fileSource = configVal.get("fileSource", "mmap").asString();
+    if (fileSource != "mmap" && fileSource != "stream")
+        throw SocketException("Please chose fileSource from mmap, stream.");
+    if (chunkSize == 0 || chunkSize > (1u << 24u))
+        throw SocketException("Please provide a chunkSize between 1 and 16777216.");
+    hashThreads = configVal.get("hashThreads", 0).asUInt();
+    deltaSync = configVal.get("deltaSync", true).asBool();
+    deltaBlockSize = configVal.get("deltaBlockSize", 2048).asUInt();
+    if (deltaBlockSize == 0)
+        throw SocketException("Please provide a deltaBlockSize larger than 0.");
+    string compression = configVal.get("compression", "zlib").asString();
+    if (compression == "zlib") compressCodec = COMPRESS_ZLIB;
+    else if (compression == "none") compressCodec = COMPRESS_NONE;
+    else throw SocketException("Please chose compression from zlib, none.");
+    compressLevel = configVal.get("compressionLevel", 1).asInt();
+    if (compressLevel < 1 || compressLevel > 9)
+        throw SocketException("Please provide a compressionLevel between 1 and 9.");
+}
 
 AppSocket::~AppSocket() {}
 
@@ -143,10 +214,9 @@ int AppSocket::connectToServer(const char* passCat, int passLen, const char* add
     unsigned int length;
     unsigned int pID;
 
-    //send JOIN_REQ
-    sendContent = getCharPacket(JOIN_REQ);
-    setPackets(sendContent, 6);
-    sendMessage();
+    //send JOIN_REQ, with the codecs this side can inflate
+    unsigned int codecs = compressCodec;
+    sendPacket(JOIN_REQ, string((const char*)&codecs, 4));
 
     //recv PASS_REQ, send PASS_RESP
     receiveMessage();
@@ -155,7 +225,7 @@ int AppSocket::connectToServer(const char* passCat, int passLen, const char* add
     if (type != PASS_REQ)
     {
         cout << "ABORT" << endl;
-        return -1;
+        return CONNECT_ABORTED;
     }
     else
     {
@@ -166,82 +236,50 @@ int AppSocket::connectToServer(const char* passCat, int passLen, const char* add
         sendMessage();
     }
 
-    //recv PASS_ACCEPT, wait for DATA & TERMINATE
-    receiveMessage();
-    readMessage(readbuf, READ_BUF_SIZE);
-    recvPacket(readbuf, type, length, pID, getContent);
-    if (type != PASS_ACCEPT)
+    //recv PASS_ACCEPT or the MANIFEST of a directory, wait for DATA & TERMINATE
+    bool received = false;
+    string accept = receivePacket();
+    type = accept.size() >= 6 ? *(const unsigned short*)accept.data() : 0;
+    if (type != PASS_ACCEPT && type != MANIFEST)
     {
-        if (type == REJECT)
+        // TODO: an empty REJECT answers the password, one with a reason tells the server couldn't send its input
+        bool noInput = type == REJECT && accept.size() > 6;
+        if (noInput)
+            cout << accept.substr(6) << endl;
+        else if (type == REJECT)
             cout << "pw error" << endl;
         cout << "ABORT" << endl;
-        return -1;
+        delete[]readbuf; delete[]getContent;
+        return noInput ? CONNECT_TRANSFER_FAILED : type == REJECT ? CONNECT_REJECTED : CONNECT_ABORTED;
     }
     else
     {
-        char* wbuf = new char[STRING_MAX];
-		memset(wbuf, 0, STRING_MAX);
-		int tempID = 1;
-		bool isError = false;
-        while (true)
+        if (type == MANIFEST)
+            received = receiveTree(add, accept.substr(6));
+        else
         {
-            
-            receiveMessage();
-			delete[]readbuf;
-			readbuf = new char[READ_BUF_SIZE + 1];
-            readMessage(readbuf, READ_BUF_SIZE+1);
-            recvPacket(readbuf, type, length, pID, getContent);
-            if (pID != 0 && tempID != pID)
+            // TODO: PASS_ACCEPT tells the file size & chunk size, so every chunk has a fixed offset in the file
+            receiveState st;
+            if (accept.size() == 6 + 16)
             {
-				isError = true;
+                st.fileSize = *(const unsigned long long*)(accept.data() + 6);
+                st.chunkSize = *(const unsigned int*)(accept.data() + 14);
             }
-            tempID++;
-            if (type == TERMINATE)
-            {
-                char* sha = sha1(wbuf);
-                for (int i = 0; i < 20; i++)
-                {
-                    if (sha[i] != getContent[i])
-                    {
-                        cout << "ABORT" << endl;
-						isError = true;
-                    }
-                }
-                break;
-            }
-            else
-            {
-				memcpy(wbuf + (tempID - 2) * 1000, getContent, 1000);
-			}
+            received = receiveFile(add, st);
         }
-        ofstream outfile;
-        outfile.open(add);
-        outfile << wbuf;
-        outfile.close();
-		
-		if (isError == false)
-		{
-			sendContent = getCharPacket(DATA_SUC);
-			setPackets(sendContent, 6);
-			sendMessage();
-			cout << "OK" << endl;
-		}
-		else
-		{
-			sendContent = getCharPacket(REJECT);
-			setPackets(sendContent, 6);
-			sendMessage();
-			cout << "ABORT" << endl;
-		}
-    }
-    return 0;
+        if (received)
+            cout << "OK" << endl;
+        else
+            cout << "ABORT" << endl;
+    }
+    delete[]readbuf; delete[]getContent;
+    return received ? CONNECT_OK : CONNECT_TRANSFER_FAILED;
 }
 
 int AppSocket::connectToClient(const char* pass, int passLen, const char* add)
 {
     char* sendContent;
     char* getContent = new char[DATA_SIZE];
-    char* sendbuf = new char[DATA_SIZE+1];
     char* readbuf = new char[READ_BUF_SIZE];
     unsigned short type;
     unsigned int length;
@@ -251,6 +289,7 @@ int AppSocket::connectToClient(const char* pass, int passLen, const char* add)
     receiveMessage();
     readMessage(readbuf, READ_BUF_SIZE);
     recvPacket(readbuf, type, length, pID, getContent);
+    unsigned int peerCodecs = length == 4 ? *(unsigned int*)getContent : COMPRESS_NONE;
     if (type != JOIN_REQ)
     {
         cout << "ABORT" << endl;
@@ -270,50 +309,960 @@ int AppSocket::connectToClient(const char* pass, int passLen, const char* add)
     if (type != PASS_RESP || !checkPassword(getContent, length, pass, passLen))
     {
         sendContent = getCharPacket(REJECT);
-        setPackets(sendContent);
+        setPackets(sendContent,6);
         sendMessage();
         cout << "ABORT(wrong pw)" << endl;
         return -1;
     }
     else
     {
-        sendContent= getCharPacket(PASS_ACCEPT);
-        setPackets(sendContent,6);
-        sendMessage();
+        // TODO: a directory is sent as a manifest of its tree over this one session
+        struct stat addStat;
+        bool isDir = stat(add, &addStat) == 0 && S_ISDIR(addStat.st_mode);
+        if (isDir ? transferTree(add, peerCodecs) : transferFile(add, peerCodecs))
+            cout << "OK" << endl;
+        else
+            cout << "ABORT" << endl;
+        delete[]readbuf; delete[]getContent;
+        return 0;
+    }
+}
 
-        ifstream infile;
-        infile.open(add);
-        int data_len;
-        for (int i = 1;; i++)
+bool AppSocket::transferFile(const char* add, unsigned int peerCodecs)
+{
+    // TODO: tell the receiver the file size, chunk size & the codec of DATA_Z, so it can preallocate and place chunks
+    chunkSource src;
+    if (!src.open(add, fileSource == "mmap"))
+    {
+        // TODO: a REJECT with a reason instead of PASS_ACCEPT, the receiver keeps its output as it is
+        sendPacket(REJECT, "can't open " + string(add));
+        return false;
+    }
+    bool compressChunks = (compressCodec & peerCodecs & COMPRESS_ZLIB) != 0;
+    char acceptContent[16];
+    *(unsigned long long*)acceptContent = src.fileSize;
+    *(unsigned int*)(acceptContent + 8) = chunkSize;
+    *(unsigned int*)(acceptContent + 12) = compressChunks ? COMPRESS_ZLIB : COMPRESS_NONE;
+    sendPacket(PASS_ACCEPT, string(acceptContent, 16));
+    unsigned int chunkCount = (src.fileSize + chunkSize - 1) / chunkSize;
+
+    // TODO: leaves of the Merkle tree, hashed on the pool while waiting for the receiver's claim
+    string leaves = hashLeaves(src);
+
+    // TODO: recv the chunks the receiver already has, send back the ones whose leaf matches this file
+    string message = receivePacket();
+    vector<bool> skipChunks = acceptClaim(message, leaves, chunkCount);
+    // TODO: a receiver holding an older copy sends the signatures of its blocks instead of a claim,
+    //  the delta scans the whole file at every offset so it needs the mapping
+    DeltaSync delta(digestType, deltaBlockSize);
+    bool sendDelta = src.mapped != nullptr && message.size() >= 6
+        && *(const unsigned short*)message.data() == SIGNATURE && delta.loadSignature(message.substr(6));
+    sendPacket(RESUME, encodeRanges(skipChunks));
+    sendPacket(LEAVES, leaves);
+
+    // TODO: send the missing chunks then the root, resend the chunks the receiver couldn't verify
+    char* chunkBuf = new char[chunkSize];
+    vector<bool> sendChunks(chunkCount);
+    for (unsigned int i = 0; i < chunkCount; i++)
+        sendChunks[i] = !skipChunks[i];
+    bool success = false;
+    auto pool = getHashPool();
+    deque<future<string>> compressing;
+    try
+    {
+        for (unsigned int round = 0; round <= RETRANSMIT_ROUNDS; round++)
         {
-            infile.get(sendbuf, DATA_SIZE+1, EOF);
-            data_len = strlen(sendbuf);
-            if (data_len == 0)
+            if (round == 0 && sendDelta)
+            {
+                delta.diff(src.mapped, src.fileSize, chunkSize, [this](const string& instructions){
+                    sendPacket(DELTA, instructions);
+                });
+                sendChunks.assign(chunkCount, false);
+            }
+            // TODO: compress the next chunks on the pool while this one is sent,
+            //  after a chunk that doesn't shrink the next ones are sent plain, twice as many each time up to 64
+            unsigned int next = 0, skipCompress = 0, backoff = 1;
+            for (unsigned int i = 0; i < chunkCount; i++)
+            {
+                if (!sendChunks[i])
+                    continue;
+                for (; compressChunks && next < chunkCount && compressing.size() < 2 * pool->size(); next++)
+                {
+                    if (!sendChunks[next])
+                        continue;
+                    if (skipCompress > 0)
+                    {
+                        skipCompress--;
+                        compressing.emplace_back();
+                    }
+                    else
+                        compressing.push_back(pool->submit([this, &src, next]{return compressChunk(src, next);}));
+                }
+                if (compressChunks)
+                {
+                    bool tried = compressing.front().valid();
+                    string compressed = tried ? compressing.front().get() : "";
+                    compressing.pop_front();
+                    if (!compressed.empty())
+                    {
+                        backoff = 1;
+                        sendDataChunk(DATA_Z, i + 1, compressed.data(), compressed.size());
+                        continue;
+                    }
+                    if (tried)
+                    {
+                        skipCompress = backoff;
+                        backoff = min(2 * backoff, 64u);
+                    }
+                }
+                unsigned int length = 0;
+                const char* chunk = src.chunk(i, chunkSize, chunkBuf, length);
+                if (chunk == nullptr)
+                    throw SocketException("Can't read chunk " + to_string(i) + " of " + string(add));
+                sendDataChunk(DATA, i + 1, chunk, length);
+            }
+            sendPacket(TERMINATE, merkleRoot(leaves));
+            message = receivePacket();
+            unsigned short type = message.size() >= 6 ? *(const unsigned short*)message.data() : 0;
+            if (type == DATA_SUC)
+                success = true;
+            if (type != RETRANS)
                 break;
-            sendContent = getCharPacket(DATA, data_len, i, sendbuf);
-            setPackets(sendContent,10+data_len);
-            sendMessage();
-            if (data_len < DATA_SIZE)
+            sendChunks.assign(chunkCount, false);
+            size_t consumed = 0;
+            if (!parseRanges(message, RETRANS, sendChunks, consumed))
                 break;
         }
-        infile.seekg(0,ios::beg);
-        char entire[STRING_MAX];
-        infile.get(entire, STRING_MAX, EOF);
-        char* shaResult = sha1(entire);
-        sendContent = getCharPacket(TERMINATE, 20, shaResult);
-        setPackets(sendContent,6+20);
-        sendMessage();
-		receiveMessage();
-		readMessage(readbuf, READ_BUF_SIZE);
-		recvPacket(readbuf, type, length, pID, getContent);
-		if (type == DATA_SUC)
-			cout << "OK" << endl;
-		else
-			cout << "ABORT" << endl;
-        return 0;
     }
+    catch (...)
+    {
+        // TODO: workers still read the file, wait for them before it is unmapped
+        for (auto& pending: compressing)
+            if (pending.valid())
+                pending.wait();
+        delete[]chunkBuf;
+        throw;
+    }
+    delete[]chunkBuf;
+    return success;
+}
+
+bool AppSocket::receiveFile(const char* add, receiveState& st)
+{
+    unsigned int chunkCount = st.chunkSize == 0 ? 0 : (st.fileSize + st.chunkSize - 1) / st.chunkSize;
+    st.chunksReceived.assign(chunkCount, false);
+    st.digestLen = EVP_MD_size(digestType);
+    string checkpointPath = string(add) + ".ckpt";
+    st.fd = open(add, O_RDWR | O_CREAT, 0644);
+    bool isError = st.fd < 0 || st.chunkSize == 0;
+
+    // TODO: chunks of the checkpoint still intact on disk are claimed, the others are written again
+    string claim;
+    bool resumed = !isError && loadCheckpoint(checkpointPath, st, claim);
+    // TODO: without a checkpoint, an older copy of the file is the basis of a delta written to <output>.delta
+    string deltaPath = string(add) + ".delta";
+    struct stat basisStat;
+    bool useDelta = !isError && !resumed && deltaSync && st.fileSize != 0 && fstat(st.fd, &basisStat) == 0
+        && S_ISREG(basisStat.st_mode) && (unsigned long long)basisStat.st_size >= deltaBlockSize;
+    DeltaSync delta(digestType, deltaBlockSize);
+    if (useDelta)
+    {
+        st.basisFd = st.fd;
+        st.basisSize = basisStat.st_size;
+        st.fd = open(deltaPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (st.fd < 0 || (posix_fallocate(st.fd, 0, st.fileSize) != 0 && ftruncate(st.fd, st.fileSize) != 0))
+            isError = true;
+        claim = delta.signature(st.basisFd, st.basisSize);
+        if (claim.empty())
+            isError = true;
+    }
+    else if (!isError && !resumed)
+    {
+        st.chunksReceived.assign(chunkCount, false);
+        claim = encodeRanges(st.chunksReceived);
+        // TODO: reserve the blocks up front, a sparse file of the right size where fallocate isn't supported
+        if (ftruncate(st.fd, 0) != 0
+            || (st.fileSize != 0 && posix_fallocate(st.fd, 0, st.fileSize) != 0 && ftruncate(st.fd, st.fileSize) != 0))
+            isError = true;
+        st.checkpointFd = startCheckpoint(checkpointPath, st);
+    }
+    if (isError)
+        claim = encodeRanges(vector<bool>());
+    sendPacket(useDelta && !isError ? SIGNATURE : RESUME, claim);
+
+    // TODO: the sender answers with the claimed ranges it verified, then the leaves of its Merkle tree
+    vector<bool> accepted(chunkCount, false);
+    size_t consumed = 0;
+    if (!parseRanges(receivePacket(), RESUME, accepted, consumed))
+        isError = true;
+    st.receivedCount = 0;
+    for (unsigned int i = 0; i < chunkCount; i++)
+    {
+        st.chunksReceived[i] = st.chunksReceived[i] && accepted[i];
+        if (st.chunksReceived[i])
+            st.receivedCount++;
+    }
+    string message = receivePacket();
+    if (message.size() < 6 || *(const unsigned short*)message.data() != LEAVES
+        || message.size() - 6 != (size_t)chunkCount * st.digestLen)
+        isError = true;
+    else
+        st.leaves = message.substr(6);
+
+    auto pool = getHashPool();
+    deque<pair<unsigned int, future<bool>>> verifying;
+    bool deltaWritten = false;
+    for (unsigned int round = 0; ; round++)
+    {
+        string root;
+        while (true)
+        {
+            message = receivePacket();
+            unsigned short type = message.size() >= 6 ? *(const unsigned short*)message.data() : 0;
+            if (type == TERMINATE)
+            {
+                root = message.substr(6);
+                break;
+            }
+            if (type == DELTA && useDelta && !isError)
+            {
+                // TODO: instructions rebuild the file in order, their chunks are checked once TERMINATE arrives
+                if (!delta.patch(message.substr(6), st.basisFd, st.basisSize, st.fd, st.deltaOffset, st.fileSize))
+                    isError = true;
+                deltaWritten = true;
+                continue;
+            }
+            if ((type != DATA && type != DATA_Z) || isError)
+                continue;
+            unsigned int length = *(const unsigned int*)(message.data() + 2);
+            unsigned int pID = message.size() >= 10 ? *(const unsigned int*)(message.data() + 6) : 0;
+            unsigned long long offset = (unsigned long long)(pID - 1) * st.chunkSize;
+            unsigned int plainLength = pID == 0 || pID > chunkCount ? 0 : min((unsigned long long)st.chunkSize, st.fileSize - offset);
+            // TODO: a DATA_Z chunk is only sent when it shrinks
+            if (pID == 0 || pID > chunkCount || message.size() != 10 + length
+                || (type == DATA ? length != plainLength : length == 0 || length >= plainLength))
+            {
+                isError = true;
+                continue;
+            }
+            if (st.chunksReceived[pID - 1])
+                continue;
+            // TODO: inflate the chunk, check it against its leaf & write it on the pool while the next one arrives
+            auto chunk = make_shared<string>(move(message));
+            int fd = st.fd;
+            string leaf = st.leaves.substr((size_t)(pID - 1) * st.digestLen, st.digestLen);
+            auto verify = [this, chunk, fd, leaf, offset, plainLength]{
+                const char* data = chunk->data() + 10;
+                unsigned int length = chunk->size() - 10;
+                string plain;
+                if (*(const unsigned short*)chunk->data() == DATA_Z)
+                {
+                    plain.resize(plainLength);
+                    uLongf inflated = plainLength;
+                    if (uncompress((Bytef*)&plain[0], &inflated, (const Bytef*)data, length) != Z_OK || inflated != plainLength)
+                        return false;
+                    data = plain.data();
+                    length = plainLength;
+                }
+                return leafHash(data, length) == leaf && pwrite(fd, data, length, offset) == (ssize_t)length;
+            };
+            // TODO: a single worker overlaps nothing, it only costs a context switch per chunk
+            if (pool->size() > 1)
+                verifying.emplace_back(pID - 1, pool->submit(verify));
+            else
+            {
+                promise<bool> verified;
+                verified.set_value(verify());
+                verifying.emplace_back(pID - 1, verified.get_future());
+            }
+            while (!verifying.empty() && (verifying.size() > 2 * pool->size()
+                || verifying.front().second.wait_for(chrono::seconds(0)) == future_status::ready))
+                finishChunk(st, verifying);
+        }
+        while (!verifying.empty())
+            finishChunk(st, verifying);
+        if (deltaWritten && !isError)
+            verifyOnDisk(st);
+        deltaWritten = false;
+
+        // TODO: the root authenticates the leaves, a chunk failing its leaf is fetched again, not the whole file
+        if (isError || root != merkleRoot(st.leaves))
+        {
+            if (!isError && root.size() != st.digestLen)
+                cout << "digest length " << root.size() << " mismatch, check digestAlgorithm" << endl;
+            isError = true;
+            break;
+        }
+        if (st.receivedCount == chunkCount)
+            break;
+        if (round == RETRANSMIT_ROUNDS)
+        {
+            isError = true;
+            break;
+        }
+        vector<bool> missing(chunkCount);
+        for (unsigned int i = 0; i < chunkCount; i++)
+            missing[i] = !st.chunksReceived[i];
+        sendPacket(RETRANS, encodeRanges(missing));
+    }
+
+    if (st.fd >= 0)
+        close(st.fd);
+    if (st.checkpointFd >= 0)
+        close(st.checkpointFd);
+    if (st.basisFd >= 0)
+        close(st.basisFd);
+    // TODO: the older copy is replaced only by a verified file
+    if (useDelta && !isError && rename(deltaPath.c_str(), add) != 0)
+        isError = true;
+    if (useDelta && isError)
+        unlink(deltaPath.c_str());
+    // TODO: the checkpoint is only useful until the file is complete & verified
+    if (!isError)
+        unlink(checkpointPath.c_str());
+    sendPacket(isError ? REJECT : DATA_SUC, "");
+    return !isError;
+}
+
+bool AppSocket::transferTree(const char* add, unsigned int peerCodecs)
+{
+    // TODO: directories come before their entries, in name order, so the receiver can create them in turn
+    vector<treeEntry> entries;
+    if (!listTree(add, "", entries))
+    {
+        sendPacket(REJECT, "");
+        return false;
+    }
+    sendPacket(MANIFEST, encodeManifest(entries));
+
+    // TODO: small files first, several per BATCH, then a TERMINATE the receiver answers like the chunks of a file
+    vector<bool> sendBatched(entries.size());
+    for (size_t i = 0; i < entries.size(); i++)
+        sendBatched[i] = entries[i].kind == ENTRY_BATCHED;
+    bool batchesDone = false;
+    for (unsigned int round = 0; round <= RETRANSMIT_ROUNDS; round++)
+    {
+        string batch;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (!sendBatched[i])
+                continue;
+            string content;
+            if (!readSmallFile(string(add) + "/" + entries[i].path, entries[i].size, content))
+                continue;
+            // [4 bytes entry index][4 bytes length][leaf][content]
+            unsigned int record[2] = {(unsigned int)i, (unsigned int)content.size()};
+            batch.append((const char*)record, sizeof(record));
+            batch.append(leafHash(content.data(), content.size()));
+            batch.append(content);
+            if (batch.size() >= chunkSize)
+            {
+                sendPacket(BATCH, batch);
+                batch.clear();
+            }
+        }
+        if (!batch.empty())
+            sendPacket(BATCH, batch);
+        sendPacket(TERMINATE, "");
+        string message = receivePacket();
+        unsigned short type = message.size() >= 6 ? *(const unsigned short*)message.data() : 0;
+        if (type == DATA_SUC)
+            batchesDone = true;
+        if (type != RETRANS)
+            break;
+        sendBatched.assign(entries.size(), false);
+        size_t consumed = 0;
+        if (!parseRanges(message, RETRANS, sendBatched, consumed))
+            break;
+        for (size_t i = 0; i < entries.size(); i++)
+            sendBatched[i] = sendBatched[i] && entries[i].kind == ENTRY_BATCHED;
+    }
+    if (!batchesDone)
+        return false;
+
+    // TODO: larger files one after the other, each only repeats PASS_ACCEPT and not the handshake
+    bool success = true;
+    for (auto& entry: entries)
+        if (entry.kind == ENTRY_FILE && !transferFile((string(add) + "/" + entry.path).c_str(), peerCodecs))
+            success = false;
+    return success;
+}
+
+bool AppSocket::receiveTree(const char* add, const string& manifest)
+{
+    vector<treeEntry> entries;
+    bool isError = !decodeManifest(manifest, entries);
+    auto makeDir = [](const string& path) {
+        struct stat dirStat;
+        return mkdir(path.c_str(), 0755) == 0 || (errno == EEXIST && stat(path.c_str(), &dirStat) == 0 && S_ISDIR(dirStat.st_mode));
+    };
+    if (!isError && !makeDir(add))
+        isError = true;
+    for (size_t i = 0; i < entries.size() && !isError; i++)
+        if (entries[i].kind == ENTRY_DIR && !makeDir(string(add) + "/" + entries[i].path))
+            isError = true;
+
+    vector<bool> missing(entries.size());
+    for (size_t i = 0; i < entries.size(); i++)
+        missing[i] = entries[i].kind == ENTRY_BATCHED;
+    unsigned int digestLen = EVP_MD_size(digestType);
+    for (unsigned int round = 0; ; round++)
+    {
+        while (true)
+        {
+            string message = receivePacket();
+            unsigned short type = message.size() >= 6 ? *(const unsigned short*)message.data() : 0;
+            if (type == TERMINATE)
+                break;
+            if (type != BATCH || isError)
+                continue;
+            // TODO: each file of the batch is checked against its leaf before it is written
+            for (size_t cursor = 6; cursor < message.size(); )
+            {
+                if (cursor + 8 + digestLen > message.size())
+                    break;
+                unsigned int index = *(const unsigned int*)(message.data() + cursor);
+                unsigned int length = *(const unsigned int*)(message.data() + cursor + 4);
+                const char* content = message.data() + cursor + 8 + digestLen;
+                if (cursor + 8 + digestLen + length > message.size())
+                    break;
+                if (index < entries.size() && missing[index] && length == entries[index].size
+                    && leafHash(content, length) == message.substr(cursor + 8, digestLen))
+                {
+                    int fd = open((string(add) + "/" + entries[index].path).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                    if (fd >= 0 && (length == 0 || write(fd, content, length) == (ssize_t)length))
+                        missing[index] = false;
+                    if (fd >= 0)
+                        close(fd);
+                }
+                cursor += 8 + digestLen + length;
+            }
+        }
+        bool complete = find(missing.begin(), missing.end(), true) == missing.end();
+        if (isError || complete || round == RETRANSMIT_ROUNDS)
+        {
+            isError = isError || !complete;
+            sendPacket(isError ? REJECT : DATA_SUC, "");
+            break;
+        }
+        sendPacket(RETRANS, encodeRanges(missing));
+    }
+    if (isError)
+        return false;
+
+    bool success = true;
+    for (auto& entry: entries)
+    {
+        if (entry.kind != ENTRY_FILE)
+            continue;
+        string accept = receivePacket();
+        if (accept.size() >= 6 && *(const unsigned short*)accept.data() == REJECT)
+        {
+            cout << accept.substr(6) << endl;
+            success = false;
+            continue;
+        }
+        receiveState st;
+        if (accept.size() == 6 + 16 && *(const unsigned short*)accept.data() == PASS_ACCEPT)
+        {
+            st.fileSize = *(const unsigned long long*)(accept.data() + 6);
+            st.chunkSize = *(const unsigned int*)(accept.data() + 14);
+        }
+        if (!receiveFile((string(add) + "/" + entry.path).c_str(), st))
+            success = false;
+    }
+    return success;
+}
+
+bool AppSocket::listTree(const string& root, const string& relative, vector<treeEntry>& entries) const
+{
+    string path = relative.empty() ? root : root + "/" + relative;
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr)
+        return false;
+    vector<string> names;
+    while (struct dirent* item = readdir(dir))
+        if (strcmp(item->d_name, ".") != 0 && strcmp(item->d_name, "..") != 0)
+            names.emplace_back(item->d_name);
+    closedir(dir);
+    sort(names.begin(), names.end());
+
+    for (auto& name: names)
+    {
+        treeEntry entry;
+        entry.path = relative.empty() ? name : relative + "/" + name;
+        struct stat entryStat;
+        // TODO: symbolic links & special files are left out
+        if (lstat((root + "/" + entry.path).c_str(), &entryStat) != 0)
+            return false;
+        if (S_ISDIR(entryStat.st_mode))
+        {
+            entry.kind = ENTRY_DIR;
+            entries.push_back(entry);
+            if (!listTree(root, entry.path, entries))
+                return false;
+        }
+        else if (S_ISREG(entryStat.st_mode))
+        {
+            entry.size = entryStat.st_size;
+            entry.kind = entry.size <= chunkSize ? ENTRY_BATCHED : ENTRY_FILE;
+            entries.push_back(entry);
+        }
+    }
+    return true;
+}
+
+string AppSocket::encodeManifest(const vector<treeEntry>& entries)
+{
+    // [4 bytes entry count], then [1 byte kind][8 bytes size][2 bytes path length][path] per entry
+    string body(4, '\0');
+    unsigned int count = entries.size();
+    memcpy(&body[0], &count, 4);
+    for (auto& entry: entries)
+    {
+        char record[11];
+        record[0] = entry.kind;
+        memcpy(record + 1, &entry.size, 8);
+        unsigned short pathLength = entry.path.size();
+        memcpy(record + 9, &pathLength, 2);
+        body.append(record, sizeof(record));
+        body.append(entry.path);
+    }
+    return body;
+}
+
+bool AppSocket::decodeManifest(const string& body, vector<treeEntry>& entries)
+{
+    if (body.size() < 4)
+        return false;
+    unsigned int count = *(const unsigned int*)body.data();
+    size_t cursor = 4;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (cursor + 11 > body.size())
+            return false;
+        treeEntry entry;
+        entry.kind = body[cursor];
+        memcpy(&entry.size, body.data() + cursor + 1, 8);
+        unsigned short pathLength = *(const unsigned short*)(body.data() + cursor + 9);
+        cursor += 11;
+        if (entry.kind > ENTRY_FILE || cursor + pathLength > body.size())
+            return false;
+        entry.path = body.substr(cursor, pathLength);
+        cursor += pathLength;
+        // TODO: only relative paths below the output directory, no empty, "." or ".." component
+        if (entry.path.empty() || entry.path.find('\0') != string::npos)
+            return false;
+        for (size_t begin = 0; begin <= entry.path.size(); )
+        {
+            size_t end = entry.path.find('/', begin);
+            if (end == string::npos)
+                end = entry.path.size();
+            string component = entry.path.substr(begin, end - begin);
+            if (component.empty() || component == "." || component == "..")
+                return false;
+            begin = end + 1;
+        }
+        entries.push_back(entry);
+    }
+    return cursor == body.size();
+}
+
+bool AppSocket::readSmallFile(const string& path, unsigned long long size, string& content)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    content.resize(size);
+    bool success = size == 0 || pread(fd, &content[0], size, 0) == (ssize_t)size;
+    close(fd);
+    return success;
+}
+
+void AppSocket::finishChunk(receiveState& st, deque<pair<unsigned int, future<bool>>>& verifying)
+{
+    unsigned int index = verifying.front().first;
+    bool verified = verifying.front().second.get();
+    verifying.pop_front();
+    if (!verified || st.chunksReceived[index])
+        return;
+    st.chunksReceived[index] = true;
+    st.receivedCount++;
+    appendCheckpoint(st, index);
+}
+
+void AppSocket::verifyOnDisk(receiveState& st)
+{
+    auto pool = getHashPool();
+    unsigned int chunkCount = st.chunksReceived.size(), workers = pool->size();
+    // TODO: one task per worker over an interleaved share of the chunks, each returns the ones matching their leaf
+    vector<future<vector<unsigned int>>> hashing;
+    for (unsigned int w = 0; w < workers; w++)
+    {
+        hashing.push_back(pool->submit([this, &st, w, workers, chunkCount]{
+            vector<unsigned int> verified;
+            char* buffer = new char[st.chunkSize];
+            for (unsigned int i = w; i < chunkCount; i += workers)
+            {
+                if (st.chunksReceived[i])
+                    continue;
+                unsigned long long offset = (unsigned long long)i * st.chunkSize;
+                unsigned int length = min((unsigned long long)st.chunkSize, st.fileSize - offset);
+                if (pread(st.fd, buffer, length, offset) == (ssize_t)length
+                    && leafHash(buffer, length) == st.leaves.substr((size_t)i * st.digestLen, st.digestLen))
+                    verified.push_back(i);
+            }
+            delete[]buffer;
+            return verified;
+        }));
+    }
+    for (auto& pending: hashing)
+        for (unsigned int index: pending.get())
+        {
+            st.chunksReceived[index] = true;
+            st.receivedCount++;
+        }
+}
+
+void AppSocket::sendPacket(unsigned short type, const string& body)
+{
+    // TODO: [2 bytes header][4 bytes payload length][payload], body is encrypted from where it lies
+    unsigned char header[6];
+    *((unsigned short *)header) = type;
+    *(unsigned int *)((unsigned short *)header + 1) = body.size();
+    sendMessage({{header, 6}, {(const unsigned char*)body.data(), (unsigned int)body.size()}});
+}
+
+string AppSocket::receivePacket()
+{
+    receiveMessage();
+    string message(getMessageLength() + 1, '\0');
+    readMessage(&message[0], message.size());
+    message.resize(getMessageLength());
+    unsigned short type = message.size() >= 6 ? *(const unsigned short*)message.data() : 0;
+    if (message.size() < 6 || (size_t)*(const unsigned int*)(message.data() + 2) + (type == DATA || type == DATA_Z ? 10 : 6) != message.size())
+        return "";
+    return message;
+}
+
+void AppSocket::sendDataChunk(unsigned short type, unsigned int pID, const char* chunk, unsigned int length)
+{
+    // TODO: same bytes as getCharPacket(DATA, ...), the chunk is encrypted from where it lies
+    unsigned char header[10];
+    *((unsigned short *)header) = type;
+    *(unsigned int *)((unsigned short *)header + 1) = length;
+    *(unsigned int *)((unsigned short *)header + 3) = pID;
+    sendMessage({{header, 10}, {(const unsigned char*)chunk, length}});
+}
+
+string AppSocket::compressChunk(const chunkSource& src, unsigned int index) const
+{
+    char* buffer = src.mapped == nullptr ? new char[chunkSize] : nullptr;
+    unsigned int length = 0;
+    const char* chunk = src.chunk(index, chunkSize, buffer, length);
+    string compressed;
+    if (chunk != nullptr)
+    {
+        compressed.resize(compressBound(length));
+        uLongf compressedLength = compressed.size();
+        // TODO: a chunk that doesn't shrink, already compressed data mostly, is sent as plain DATA
+        if (compress2((Bytef*)&compressed[0], &compressedLength, (const Bytef*)chunk, length, compressLevel) == Z_OK
+            && compressedLength < length)
+            compressed.resize(compressedLength);
+        else
+            compressed.clear();
+    }
+    delete[]buffer;
+    return compressed;
+}
+
+bool AppSocket::chunkSource::open(const char* add, bool useMmap)
+{
+    fd = ::open(add, O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode))
+        return false;
+    fileSize = fileStat.st_size;
+#ifndef WIN32
+    if (!useMmap || fileSize == 0)
+        return true;
+    void* data = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return true;
+    // TODO: hints only, read ahead aggressively and back the mapping with huge pages where the kernel can
+    madvise(data, fileSize, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(data, fileSize, MADV_HUGEPAGE);
+#endif
+    mapped = (const char*)data;
+#endif
+    return true;
+}
+
+AppSocket::chunkSource::~chunkSource()
+{
+#ifndef WIN32
+    if (mapped != nullptr)
+        munmap((void*)mapped, fileSize);
+#endif
+    if (fd >= 0)
+        close(fd);
+}
+
+const char* AppSocket::chunkSource::chunk(unsigned int index, unsigned int chunkSize, char* buffer, unsigned int& length) const
+{
+    unsigned long long offset = (unsigned long long)index * chunkSize;
+    if (offset >= fileSize)
+        return nullptr;
+    length = min((unsigned long long)chunkSize, fileSize - offset);
+    if (mapped != nullptr)
+        return mapped + offset;
+    if (pread(fd, buffer, length, offset) != (ssize_t)length)
+        return nullptr;
+    return buffer;
+}
+
+string AppSocket::leafHash(const char* chunk, unsigned int length) const
+{
+    // TODO: leaves and inner nodes are hashed with different prefixes, so a leaf can't pass for a node
+    unsigned char digest[EVP_MAX_MD_SIZE], prefix = 0x00;
+    unsigned int digestLen = 0;
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, digestType, nullptr);
+    EVP_DigestUpdate(ctx, &prefix, 1);
+    EVP_DigestUpdate(ctx, chunk, length);
+    EVP_DigestFinal_ex(ctx, digest, &digestLen);
+    EVP_MD_CTX_free(ctx);
+    return string((char*)digest, digestLen);
+}
+
+string AppSocket::merkleRoot(const string& leaves) const
+{
+    unsigned int digestLen = EVP_MD_size(digestType);
+    unsigned char digest[EVP_MAX_MD_SIZE], prefix = 0x01;
+    if (leaves.empty())
+    {
+        EVP_Digest(nullptr, 0, digest, &digestLen, digestType, nullptr);
+        return string((char*)digest, digestLen);
+    }
+    // TODO: hash pairs level by level, the last node of an odd level goes up unchanged
+    string level = leaves;
+    while (level.size() > digestLen)
+    {
+        string next;
+        for (size_t i = 0; i < level.size(); i += 2 * digestLen)
+        {
+            if (i + digestLen == level.size())
+            {
+                next.append(level, i, digestLen);
+                break;
+            }
+            EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+            EVP_DigestInit_ex(ctx, digestType, nullptr);
+            EVP_DigestUpdate(ctx, &prefix, 1);
+            EVP_DigestUpdate(ctx, level.data() + i, 2 * digestLen);
+            EVP_DigestFinal_ex(ctx, digest, &digestLen);
+            EVP_MD_CTX_free(ctx);
+            next.append((char*)digest, digestLen);
+        }
+        level.swap(next);
+    }
+    return level;
+}
+
+string AppSocket::hashLeaves(const chunkSource& src)
+{
+    unsigned int chunkCount = (src.fileSize + chunkSize - 1) / chunkSize;
+    unsigned int digestLen = EVP_MD_size(digestType);
+    string leaves((size_t)chunkCount * digestLen, '\0');
+    auto pool = getHashPool();
+    // TODO: one task per worker, each hashes an interleaved share of the chunks
+    vector<future<bool>> hashing;
+    unsigned int workers = pool->size();
+    for (unsigned int w = 0; w < workers; w++)
+    {
+        hashing.push_back(pool->submit([this, &src, &leaves, w, workers, chunkCount, digestLen]{
+            char* buffer = src.mapped == nullptr ? new char[chunkSize] : nullptr;
+            bool success = true;
+            for (unsigned int i = w; i < chunkCount && success; i += workers)
+            {
+                unsigned int length = 0;
+                const char* chunk = src.chunk(i, chunkSize, buffer, length);
+                if (chunk == nullptr)
+                    success = false;
+                else
+                    memcpy(&leaves[(size_t)i * digestLen], leafHash(chunk, length).data(), digestLen);
+            }
+            delete[]buffer;
+            return success;
+        }));
+    }
+    bool success = true;
+    for (auto& pending: hashing)
+        success = pending.get() && success;
+    if (!success)
+        throw SocketException("Can't read the file to send.");
+    return leaves;
 }
 
+shared_ptr<ThreadPool> AppSocket::getHashPool()
+{
+    if (!hashPool)
+        hashPool = make_shared<ThreadPool>(hashThreads);
+    return hashPool;
+}
+
+string AppSocket::encodeRanges(const vector<bool>& chunks)
+{
+    // [4 bytes range count][4 bytes first chunk][4 bytes end chunk, excluded]...
+    string ranges(4, '\0');
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < chunks.size(); )
+    {
+        if (!chunks[i])
+        {
+            i++;
+            continue;
+        }
+        unsigned int j = i;
+        while (j < chunks.size() && chunks[j])
+            j++;
+        unsigned int range[2] = {i, j};
+        ranges.append((const char*)range, sizeof(range));
+        count++;
+        i = j;
+    }
+    memcpy(&ranges[0], &count, 4);
+    return ranges;
+}
+
+bool AppSocket::decodeRanges(const string& body, vector<bool>& chunks, size_t& consumed)
+{
+    if (body.size() < 4)
+        return false;
+    unsigned int count = *(const unsigned int*)body.data();
+    if (body.size() < 4 + 8ull * count)
+        return false;
+    for (unsigned int r = 0; r < count; r++)
+    {
+        const unsigned int* range = (const unsigned int*)(body.data() + 4 + 8 * r);
+        if (range[0] >= range[1] || range[1] > chunks.size())
+            return false;
+        for (unsigned int i = range[0]; i < range[1]; i++)
+            chunks[i] = true;
+    }
+    consumed = 4 + 8 * count;
+    return true;
+}
+
+bool AppSocket::parseRanges(const string& message, unsigned short type, vector<bool>& chunks, size_t& consumed)
+{
+    if (message.size() < 6 || *(const unsigned short*)message.data() != type)
+        return false;
+    return decodeRanges(message.substr(6), chunks, consumed);
+}
+
+int AppSocket::startCheckpoint(const string& path, const receiveState& st)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (fd < 0)
+        return -1;
+    char header[CHECKPOINT_HEADER_SIZE];
+    memcpy(header, CHECKPOINT_MAGIC, 8);
+    *(unsigned long long*)(header + 8) = st.fileSize;
+    *(unsigned int*)(header + 16) = st.chunkSize;
+    *(int*)(header + 20) = EVP_MD_type(digestType);
+    if (write(fd, header, CHECKPOINT_HEADER_SIZE) != CHECKPOINT_HEADER_SIZE)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void AppSocket::appendCheckpoint(receiveState& st, unsigned int index)
+{
+    if (st.checkpointFd < 0)
+        return;
+    // TODO: one record per verified chunk, [4 bytes chunk index][leaf hash], a later record of a chunk wins
+    char record[4 + EVP_MAX_MD_SIZE];
+    *(unsigned int*)record = index;
+    memcpy(record + 4, st.leaves.data() + (size_t)index * st.digestLen, st.digestLen);
+    if (write(st.checkpointFd, record, 4 + st.digestLen) != (ssize_t)(4 + st.digestLen))
+    {
+        close(st.checkpointFd);
+        st.checkpointFd = -1;
+    }
+}
+
+bool AppSocket::loadCheckpoint(const string& path, receiveState& st, string& claim)
+{
+    ifstream checkpoint(path, ios::in | ios::binary);
+    char header[CHECKPOINT_HEADER_SIZE];
+    if (!checkpoint.read(header, CHECKPOINT_HEADER_SIZE) || memcmp(header, CHECKPOINT_MAGIC, 8) != 0
+        || *(unsigned long long*)(header + 8) != st.fileSize || *(unsigned int*)(header + 16) != st.chunkSize
+        || *(int*)(header + 20) != EVP_MD_type(digestType))
+        return false;
+    struct stat fileStat;
+    if (fstat(st.fd, &fileStat) != 0 || (unsigned long long)fileStat.st_size != st.fileSize)
+        return false;
+
+    vector<string> leaves(st.chunksReceived.size());
+    char record[4 + EVP_MAX_MD_SIZE];
+    while (checkpoint.read(record, 4 + st.digestLen))
+    {
+        unsigned int index = *(unsigned int*)record;
+        if (index < leaves.size())
+            leaves[index] = string(record + 4, st.digestLen);
+    }
+    checkpoint.close();
+
+    // TODO: trust the disk, not the checkpoint: a chunk whose write didn't survive a crash is fetched again
+    char* chunk = new char[st.chunkSize];
+    for (unsigned int i = 0; i < leaves.size(); i++)
+    {
+        if (leaves[i].empty())
+            continue;
+        unsigned long long offset = (unsigned long long)i * st.chunkSize;
+        unsigned int length = min((unsigned long long)st.chunkSize, st.fileSize - offset);
+        if (pread(st.fd, chunk, length, offset) != (ssize_t)length)
+            continue;
+        st.chunksReceived[i] = leafHash(chunk, length) == leaves[i];
+    }
+    delete[]chunk;
+
+    claim = encodeRanges(st.chunksReceived);
+    for (unsigned int i = 0; i < leaves.size(); i++)
+        if (st.chunksReceived[i])
+            claim += leaves[i];
+    st.checkpointFd = open(path.c_str(), O_WRONLY | O_APPEND);
+    return true;
+}
+
+vector<bool> AppSocket::acceptClaim(const string& message, const string& leaves, unsigned int chunkCount)
+{
+    vector<bool> claimed(chunkCount, false), accepted(chunkCount, false);
+    size_t consumed = 0;
+    if (!parseRanges(message, RESUME, claimed, consumed))
+        return accepted;
+    unsigned int digestLen = EVP_MD_size(digestType), claimedCount = 0;
+    for (unsigned int i = 0; i < chunkCount; i++)
+        if (claimed[i])
+            claimedCount++;
+    if (message.size() != 6 + consumed + (size_t)claimedCount * digestLen)
+        return accepted;
+
+    // TODO: only skip a chunk if the receiver's leaf matches this file, it may have changed since
+    const char* claimLeaf = message.data() + 6 + consumed;
+    for (unsigned int i = 0; i < chunkCount; i++)
+    {
+        if (!claimed[i])
+            continue;
+        accepted[i] = memcmp(claimLeaf, leaves.data() + (size_t)i * digestLen, digestLen) == 0;
+        claimLeaf += digestLen;
+    }
+    return accepted;
+}
 
 void AppSocket::recvPacket(char* target, unsigned short& type, unsigned int& length, unsigned int& pID, char* content)
 {
@@ -322,11 +1271,10 @@ void AppSocket::recvPacket(char* target, unsigned short& type, unsigned int& len
     length = fpac.payloadLength;
     if (fpac.header == DATA)
     {
-        memset(content, 0, DATA_SIZE);
         pID = fpac.packetID;
         memcpy(content, fpac.body, fpac.payloadLength);
     }
-    else if (fpac.header == TERMINATE || fpac.header == PASS_RESP)
+    else if (fpac.header == TERMINATE || fpac.header == JOIN_REQ || fpac.header == PASS_RESP || fpac.header == PASS_ACCEPT)
     {
         pID = 0;
         memcpy(content, fpac.body, fpac.payloadLength);
@@ -335,6 +1283,7 @@ void AppSocket::recvPacket(char* target, unsigned short& type, unsigned int& len
     {
         pID = 0;
     }
+    delete[]fpac.body;
 }
 
 bool AppSocket::checkPassword(const char* pw3, int len3, const char* pw, int len)
@@ -366,4 +1315,4 @@ char* AppSocket::sha1(char* src)
     SHA1_Update(&c, src, strlen(src));
     SHA1_Final((unsigned char*)wbuff, &c);
     return wbuff;
-}
\ No newline at end of file
+}
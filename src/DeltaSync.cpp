@@ -0,0 +1,249 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#include "../include/DeltaSync.h"
+
+#include <algorithm>        // stable_sort, lower_bound
+#include <cstring>          // memcmp, memcpy
+#include <unistd.h>         // pread, pwrite
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <tmmintrin.h>      // SSSE3 _mm_maddubs_epi16
+#define DELTA_SSSE3
+#endif
+
+#define DELTA_COPY 0x00
+#define DELTA_LITERAL 0x01
+
+// bytes read from the basis or the file at once
+#define DELTA_IO_SIZE (1u << 20u)
+
+static unsigned int blockChecksumScalar(const unsigned char *block, unsigned int length, unsigned int s1, unsigned int s2) {
+    for (unsigned int i = 0; i < length; ++i) {
+        s1 += block[i];
+        s2 += s1;
+    }
+    return (s1 & 0xffffu) | (s2 << 16u);
+}
+
+#ifdef DELTA_SSSE3
+__attribute__((target("ssse3")))
+static unsigned int blockChecksumSsse3(const unsigned char *block, unsigned int length) {
+    // TODO: per 16 bytes, s2 += 16 * s1 + sum((16 - k) * x_k) and s1 += sum(x_k), in 32 bit lanes wrapping like the scalar sums
+    const __m128i weights = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i ones8 = _mm_set1_epi8(1), ones16 = _mm_set1_epi16(1);
+    __m128i s1v = _mm_setzero_si128(), s2v = _mm_setzero_si128();
+    unsigned int i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(block + i));
+        s2v = _mm_add_epi32(s2v, _mm_slli_epi32(s1v, 4));
+        s1v = _mm_add_epi32(s1v, _mm_madd_epi16(_mm_maddubs_epi16(x, ones8), ones16));
+        s2v = _mm_add_epi32(s2v, _mm_madd_epi16(_mm_maddubs_epi16(x, weights), ones16));
+    }
+    unsigned int s1Lanes[4], s2Lanes[4];
+    _mm_storeu_si128((__m128i *)s1Lanes, s1v);
+    _mm_storeu_si128((__m128i *)s2Lanes, s2v);
+    unsigned int s1 = s1Lanes[0] + s1Lanes[1] + s1Lanes[2] + s1Lanes[3];
+    unsigned int s2 = s2Lanes[0] + s2Lanes[1] + s2Lanes[2] + s2Lanes[3];
+    return blockChecksumScalar(block + i, length - i, s1, s2);
+}
+#endif
+
+DeltaSync::DeltaSync(const EVP_MD *strongType, unsigned int blockSize)
+        : strongType(strongType), blockSize(blockSize) {}
+
+unsigned int DeltaSync::blockChecksum(const unsigned char *block, unsigned int length) {
+#ifdef DELTA_SSSE3
+    static const bool hasSsse3 = __builtin_cpu_supports("ssse3");
+    if (hasSsse3) return blockChecksumSsse3(block, length);
+#endif
+    return blockChecksumScalar(block, length, 0, 0);
+}
+
+unsigned int DeltaSync::rollChecksum(unsigned int checksum, unsigned char out, unsigned char in, unsigned int blockLength) {
+    unsigned int s1 = (checksum & 0xffffu) - out + in;
+    unsigned int s2 = (checksum >> 16u) - blockLength * out + s1;
+    return (s1 & 0xffffu) | (s2 << 16u);
+}
+
+void DeltaSync::strongHash(const char *block, unsigned int length, unsigned char *strong) const {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLen = 0;
+    EVP_Digest(block, length, digest, &digestLen, strongType, nullptr);
+    memcpy(strong, digest, DELTA_STRONG_SIZE);
+}
+
+string DeltaSync::signature(int basisFd, unsigned long long basisSize) const {
+    unsigned int blockCount = basisSize / blockSize;
+    string body(8, '\0');
+    memcpy(&body[0], &blockSize, 4);
+    memcpy(&body[4], &blockCount, 4);
+    body.reserve(8 + (size_t)blockCount * (4 + DELTA_STRONG_SIZE));
+
+    unsigned int blocksPerRead = max(1u, DELTA_IO_SIZE / blockSize);
+    char *buffer = new char[(size_t)blocksPerRead * blockSize];
+    for (unsigned int first = 0; first < blockCount; first += blocksPerRead) {
+        unsigned int count = min(blocksPerRead, blockCount - first);
+        size_t length = (size_t)count * blockSize;
+        if (pread(basisFd, buffer, length, (off_t)first * blockSize) != (ssize_t)length) {
+            delete []buffer;
+            return "";
+        }
+        for (unsigned int i = 0; i < count; ++i) {
+            char record[4 + DELTA_STRONG_SIZE];
+            unsigned int checksum = blockChecksum((const unsigned char *)buffer + (size_t)i * blockSize, blockSize);
+            memcpy(record, &checksum, 4);
+            strongHash(buffer + (size_t)i * blockSize, blockSize, (unsigned char *)record + 4);
+            body.append(record, sizeof(record));
+        }
+    }
+    delete []buffer;
+    return body;
+}
+
+bool DeltaSync::loadSignature(const string &body) {
+    if (body.size() < 8) return false;
+    unsigned int size, blockCount;
+    memcpy(&size, body.data(), 4);
+    memcpy(&blockCount, body.data() + 4, 4);
+    if (size == 0 || body.size() != 8 + (size_t)blockCount * (4 + DELTA_STRONG_SIZE)) return false;
+    blockSize = size;
+
+    blocks.resize(blockCount);
+    checksumFilter.assign(1u << 16u, false);
+    const char *record = body.data() + 8;
+    for (unsigned int i = 0; i < blockCount; ++i, record += 4 + DELTA_STRONG_SIZE) {
+        memcpy(&blocks[i].checksum, record, 4);
+        blocks[i].index = i;
+        memcpy(blocks[i].strong, record + 4, DELTA_STRONG_SIZE);
+        checksumFilter[(blocks[i].checksum ^ (blocks[i].checksum >> 16u)) & 0xffffu] = true;
+    }
+    // TODO: stable, so a block repeated in the basis is copied from its first occurrence
+    stable_sort(blocks.begin(), blocks.end(), [](const blockSignature &a, const blockSignature &b) {
+        return a.checksum < b.checksum;
+    });
+    return true;
+}
+
+void DeltaSync::diff(const char *data, unsigned long long size, unsigned int flushSize,
+        const function<void(const string&)> &emit) const {
+    string pending;
+    unsigned int copyFirst = 0, copyCount = 0;
+    auto flushCopy = [&] {
+        if (copyCount == 0) return;
+        char instruction[9] = {DELTA_COPY};
+        memcpy(instruction + 1, &copyFirst, 4);
+        memcpy(instruction + 5, &copyCount, 4);
+        pending.append(instruction, sizeof(instruction));
+        copyCount = 0;
+    };
+    auto flushLiteral = [&](unsigned long long from, unsigned long long to) {
+        // TODO: literal runs are cut at flushSize, so no batch grows far past it
+        while (from < to) {
+            unsigned int length = (unsigned int)min<unsigned long long>(to - from, flushSize);
+            char instruction[5] = {DELTA_LITERAL};
+            memcpy(instruction + 1, &length, 4);
+            pending.append(instruction, sizeof(instruction));
+            pending.append(data + from, length);
+            from += length;
+            if (pending.size() >= flushSize) {
+                emit(pending);
+                pending.clear();
+            }
+        }
+    };
+
+    unsigned long long position = 0, literalStart = 0;
+    unsigned int checksum = size >= blockSize && !blocks.empty()
+            ? blockChecksum((const unsigned char *)data, blockSize) : 0;
+    while (!blocks.empty() && position + blockSize <= size) {
+        const blockSignature *match = nullptr;
+        if (checksumFilter[(checksum ^ (checksum >> 16u)) & 0xffffu]) {
+            auto candidate = lower_bound(blocks.begin(), blocks.end(), checksum,
+                    [](const blockSignature &block, unsigned int value) {return block.checksum < value;});
+            unsigned char strong[DELTA_STRONG_SIZE];
+            bool hashed = false;
+            for (; candidate != blocks.end() && candidate->checksum == checksum; ++candidate) {
+                if (!hashed) {
+                    strongHash(data + position, blockSize, strong);
+                    hashed = true;
+                }
+                if (memcmp(candidate->strong, strong, DELTA_STRONG_SIZE) == 0) {
+                    match = &*candidate;
+                    break;
+                }
+            }
+        }
+        if (match != nullptr) {
+            if (literalStart < position) {
+                flushCopy();
+                flushLiteral(literalStart, position);
+            }
+            // TODO: consecutive basis blocks are merged into one copy instruction
+            if (copyCount != 0 && copyFirst + copyCount != match->index) flushCopy();
+            if (copyCount == 0) copyFirst = match->index;
+            ++copyCount;
+            position += blockSize;
+            literalStart = position;
+            if (pending.size() >= flushSize) {
+                emit(pending);
+                pending.clear();
+            }
+            // TODO: a fresh block checksum after each match, this is the hot path of similar files
+            if (position + blockSize <= size)
+                checksum = blockChecksum((const unsigned char *)data + position, blockSize);
+        } else {
+            if (position + blockSize < size)
+                checksum = rollChecksum(checksum, data[position], data[position + blockSize], blockSize);
+            ++position;
+        }
+    }
+    flushCopy();
+    flushLiteral(literalStart, size);
+    if (!pending.empty()) emit(pending);
+}
+
+bool DeltaSync::patch(const string &instructions, int basisFd, unsigned long long basisSize,
+        int outFd, unsigned long long &outOffset, unsigned long long outLimit) const {
+    size_t cursor = 0;
+    char *buffer = nullptr;
+    bool success = true;
+    while (success && cursor < instructions.size()) {
+        unsigned char op = instructions[cursor];
+        if (op == DELTA_COPY && cursor + 9 <= instructions.size()) {
+            unsigned int first, count;
+            memcpy(&first, instructions.data() + cursor + 1, 4);
+            memcpy(&count, instructions.data() + cursor + 5, 4);
+            cursor += 9;
+            unsigned long long from = (unsigned long long)first * blockSize, length = (unsigned long long)count * blockSize;
+            if (from + length > basisSize || outOffset + length > outLimit) {
+                success = false;
+                break;
+            }
+            if (buffer == nullptr) buffer = new char[DELTA_IO_SIZE];
+            for (unsigned long long done = 0; done < length && success; ) {
+                size_t piece = min<unsigned long long>(length - done, DELTA_IO_SIZE);
+                success = pread(basisFd, buffer, piece, from + done) == (ssize_t)piece
+                        && pwrite(outFd, buffer, piece, outOffset + done) == (ssize_t)piece;
+                done += piece;
+            }
+            outOffset += length;
+        } else if (op == DELTA_LITERAL && cursor + 5 <= instructions.size()) {
+            unsigned int length;
+            memcpy(&length, instructions.data() + cursor + 1, 4);
+            cursor += 5;
+            if (cursor + length > instructions.size() || outOffset + length > outLimit) {
+                success = false;
+                break;
+            }
+            success = pwrite(outFd, instructions.data() + cursor, length, outOffset) == (ssize_t)length;
+            cursor += length;
+            outOffset += length;
+        } else {
+            success = false;
+        }
+    }
+    delete []buffer;
+    return success;
+}
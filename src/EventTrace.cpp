@@ -0,0 +1,245 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#include "../include/EventTrace.h"
+
+#include <algorithm>        // sort
+#include <chrono>           // steady_clock timestamps
+#include <cstring>          // memcmp
+#include <fstream>          // trace file
+#include <mutex>            // ringsMutex
+#include <sstream>
+#include <iostream>         // For cerr
+#include <cstdlib>          // atexit
+
+#define TRACE_MAGIC "TUDPTRC1"
+// events per ring, a power of two
+#define TRACE_RING_SIZE (1u << 13u)
+
+// TODO: the bits of ReliableSocket's packet flag, to name them when decoding
+#define TRACE_HAN_FLAG 0x80u
+#define TRACE_LEN_FLAG 0x40u
+#define TRACE_FIN_FLAG 0x20u
+#define TRACE_ACK_FLAG 0x10u
+#define TRACE_MSG_FLAG 0x8u
+
+atomic<bool> EventTrace::enabled{false};
+
+/**
+ * Ring of one thread at a time: only its owner writes, head counts every event it appended.
+ */
+struct traceRing {
+    atomic<unsigned long long> head{0};
+    EventTrace::traceEvent events[TRACE_RING_SIZE];
+};
+
+static mutex ringsMutex;
+static vector<traceRing *> allRings, freeRings;
+static atomic<unsigned int> nextThread{1};
+static atomic<unsigned short> nextSocket{1};
+// TODO: set once under ringsMutex, read by the atexit handler
+static string exitDumpPath;
+
+/**
+ * Hands the ring of an exiting thread to the next one, sockets start short lived threads for every message.
+ */
+struct ringOwner {
+    traceRing *ring = nullptr;
+    unsigned int thread = 0;
+
+    ~ringOwner() {
+        if (ring == nullptr) return;
+        lock_guard<mutex> lock(ringsMutex);
+        freeRings.push_back(ring);
+    }
+};
+
+static thread_local ringOwner localRing;
+
+void EventTrace::recordEvent(unsigned short type, unsigned short socket, unsigned short seq, unsigned short flag,
+        unsigned int size, unsigned int value) {
+    if (localRing.ring == nullptr) {
+        lock_guard<mutex> lock(ringsMutex);
+        if (freeRings.empty()) {
+            allRings.push_back(new traceRing);
+            freeRings.push_back(allRings.back());
+        }
+        localRing.ring = freeRings.back();
+        freeRings.pop_back();
+        localRing.thread = nextThread.fetch_add(1, memory_order_relaxed);
+    }
+    auto ring = localRing.ring;
+    auto head = ring->head.load(memory_order_relaxed);
+    traceEvent &event = ring->events[head & (TRACE_RING_SIZE - 1u)];
+    event.timestamp = chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    event.thread = localRing.thread;
+    event.value = value;
+    event.size = size;
+    event.type = type;
+    event.flag = flag;
+    event.seq = seq;
+    event.socket = socket;
+    event.reserved = 0;
+    ring->head.store(head + 1, memory_order_release);
+}
+
+unsigned short EventTrace::newSocketId() {
+    return nextSocket.fetch_add(1, memory_order_relaxed);
+}
+
+void EventTrace::start(const string &path) {
+    enabled.store(true, memory_order_relaxed);
+    if (path.empty()) return;
+    lock_guard<mutex> lock(ringsMutex);
+    if (!exitDumpPath.empty()) return;
+    exitDumpPath = path;
+    atexit(dumpAtExit);
+}
+
+void EventTrace::dumpAtExit() {
+    if (!dump(exitDumpPath)) cerr << "Can't write event trace to " << exitDumpPath << endl;
+}
+
+bool EventTrace::dump(const string &path) {
+    vector<traceEvent> events;
+    {
+        lock_guard<mutex> lock(ringsMutex);
+        for (auto ring: allRings) {
+            auto head = ring->head.load(memory_order_acquire);
+            auto count = min<unsigned long long>(head, TRACE_RING_SIZE);
+            for (auto i = head - count; i < head; ++i)
+                events.push_back(ring->events[i & (TRACE_RING_SIZE - 1u)]);
+        }
+    }
+    stable_sort(events.begin(), events.end(), [](const traceEvent &a, const traceEvent &b) {
+        return a.timestamp < b.timestamp;
+    });
+
+    ofstream file(path, ios::binary | ios::trunc);
+    if (!file.is_open()) return false;
+    unsigned long long count = events.size();
+    file.write(TRACE_MAGIC, 8);
+    file.write(reinterpret_cast<const char *>(&count), 8);
+    file.write(reinterpret_cast<const char *>(events.data()), events.size() * sizeof(traceEvent));
+    return file.good();
+}
+
+bool EventTrace::load(const string &path, vector<traceEvent> &events) {
+    ifstream file(path, ios::binary);
+    char magic[8];
+    unsigned long long count = 0;
+    if (!file.read(magic, 8) || memcmp(magic, TRACE_MAGIC, 8) != 0 || !file.read(reinterpret_cast<char *>(&count), 8))
+        return false;
+    // TODO: a truncated or corrupt count mustn't make us allocate more than the file holds
+    auto eventsStart = file.tellg();
+    file.seekg(0, ios::end);
+    auto available = (unsigned long long)(file.tellg() - eventsStart) / sizeof(traceEvent);
+    if (count > available) return false;
+    file.seekg(eventsStart);
+    events.resize(count);
+    return (bool)file.read(reinterpret_cast<char *>(events.data()), count * sizeof(traceEvent));
+}
+
+string EventTrace::typeName(unsigned short type) {
+    switch (type) {
+        case TRACE_PACKET_SENT: return "packet sent";
+        case TRACE_PACKET_RECEIVED: return "packet received";
+        case TRACE_PACKET_DROPPED: return "packet dropped";
+        case TRACE_ACK_RECEIVED: return "ack received";
+        case TRACE_RETRANSMIT: return "retransmit";
+        case TRACE_STATE: return "state";
+        case TRACE_RECORD_SEALED: return "record sealed";
+        case TRACE_RECORD_OPENED: return "record opened";
+        case TRACE_REKEY: return "rekey";
+        case TRACE_RESUME: return "resume";
+        default: return "type " + to_string(type);
+    }
+}
+
+static string flagNames(unsigned short flag) {
+    string names;
+    if ((flag & TRACE_HAN_FLAG) != 0u) names += "HAN ";
+    if ((flag & TRACE_LEN_FLAG) != 0u) names += "LEN ";
+    if ((flag & TRACE_FIN_FLAG) != 0u) names += "FIN ";
+    if ((flag & TRACE_ACK_FLAG) != 0u) names += "ACK ";
+    if ((flag & TRACE_MSG_FLAG) != 0u) names += "MSG ";
+    if (!names.empty()) names.pop_back();
+    return names;
+}
+
+static string stateName(unsigned int state) {
+    switch (state) {
+        case TRACE_STATE_CONNECTED: return "connected";
+        case TRACE_STATE_SEND_START: return "send start";
+        case TRACE_STATE_LEN_ACKED: return "length acked";
+        case TRACE_STATE_SENT: return "sent";
+        case TRACE_STATE_SEND_FAILED: return "send failed";
+        case TRACE_STATE_LEN_RECEIVED: return "length received";
+        case TRACE_STATE_RECEIVED: return "received";
+        default: return to_string(state);
+    }
+}
+
+string EventTrace::describe(const traceEvent &event) {
+    stringstream ss;
+    switch (event.type) {
+        case TRACE_PACKET_SENT:
+        case TRACE_PACKET_RECEIVED:
+        case TRACE_PACKET_DROPPED:
+        case TRACE_RETRANSMIT:
+            ss << "[" << flagNames(event.flag) << "] seq=" << event.seq << " size=" << event.size;
+            if (event.type != TRACE_PACKET_RECEIVED && event.type != TRACE_PACKET_DROPPED)
+                ss << " attempt=" << event.value;
+            break;
+        case TRACE_ACK_RECEIVED:
+            ss << "seq=" << event.seq << " rtt=" << event.value / 1000.0 << "us";
+            break;
+        case TRACE_STATE:
+            ss << stateName(event.value) << " length=" << event.size;
+            break;
+        case TRACE_RECORD_SEALED:
+        case TRACE_RECORD_OPENED:
+            ss << (event.flag == 0 ? "cbc" : "aead") << " size=" << event.size << " took=" << event.value / 1000.0 << "us";
+            break;
+        case TRACE_REKEY:
+            ss << (event.flag == 0 ? "receive" : "send") << " generation=" << event.value;
+            break;
+        case TRACE_RESUME:
+            ss << (event.value == TRACE_RESUME_REJECTED ? "ticket rejected"
+                    : event.value == TRACE_RESUME_EARLY_DATA ? "resumed with early data" : "resumed");
+            break;
+        default:
+            ss << "seq=" << event.seq << " flag=" << event.flag << " size=" << event.size << " value=" << event.value;
+    }
+    return ss.str();
+}
+
+void EventTrace::writeText(const vector<traceEvent> &events, ostream &out) {
+    unsigned long long start = events.empty() ? 0 : events.front().timestamp;
+    for (auto &event: events) {
+        out << fixed;
+        out.precision(3);
+        out << (event.timestamp - start) / 1000.0 << "us socket=" << event.socket << " thread=" << event.thread
+            << " " << typeName(event.type) << " " << describe(event) << "\n";
+    }
+}
+
+void EventTrace::writeChromeJson(const vector<traceEvent> &events, ostream &out) {
+    // TODO: instant events, "ts" in microseconds as the format wants, the details in args
+    unsigned long long start = events.empty() ? 0 : events.front().timestamp;
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (auto &event: events) {
+        if (!first) out << ",";
+        first = false;
+        out << fixed;
+        out.precision(3);
+        out << "\n{\"name\":\"" << typeName(event.type) << "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":"
+            << (event.timestamp - start) / 1000.0 << ",\"pid\":" << event.socket << ",\"tid\":" << event.thread
+            << ",\"args\":{\"detail\":\"" << describe(event) << "\",\"seq\":" << event.seq << ",\"flag\":" << event.flag
+            << ",\"size\":" << event.size << ",\"value\":" << event.value << "}}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
@@ -0,0 +1,211 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#include "../include/KeyPool.h"
+
+#include <random>           // random_device for seeding
+#include <algorithm>        // max of the scratch sizes
+#include <openssl/crypto.h> // OPENSSL_cleanse
+
+// FixedBaseTable Code
+
+FixedBaseTable::FixedBaseTable(const mpz_t g, const mpz_t p, unsigned int windowBits)
+        : windowBits(windowBits) {
+    mpz_init_set(base, g);
+    mpz_init_set(modulus, p);
+    unsigned int exponentBits = mpz_sizeinbase(p, 2);
+    windowCount = (exponentBits + windowBits - 1) / windowBits;
+
+    // TODO: table[i][j] = g^(j * 2^(windowBits*i)), row i+1 starts from (row i)^(2^windowBits)
+    //  every entry is stored as limbCount limbs, zero padded, so a row can be scanned in constant time
+    unsigned int rowSize = 1u << windowBits;
+    limbCount = mpz_size(modulus);
+    table = new mp_limb_t [(size_t)windowCount * rowSize * limbCount]();
+    mpz_t rowBase, entry; mpz_inits(rowBase, entry, NULL);
+    mpz_mod(rowBase, base, modulus);
+    for (unsigned int i = 0; i < windowCount; ++i) {
+        mpz_set_ui(entry, 1);
+        for (unsigned int j = 0; j < rowSize; ++j) {
+            mp_limb_t *limbs = table + ((size_t)i * rowSize + j) * limbCount;
+            for (size_t k = 0; k < limbCount; ++k) limbs[k] = mpz_getlimbn(entry, k);
+            mpz_mul(entry, entry, rowBase);
+            mpz_mod(entry, entry, modulus);
+        }
+        // entry is now rowBase^(2^windowBits), the base of the next row
+        mpz_swap(rowBase, entry);
+    }
+    mpz_clears(rowBase, entry, NULL);
+}
+
+FixedBaseTable::~FixedBaseTable() {
+    delete []table;
+    mpz_clears(base, modulus, NULL);
+}
+
+void FixedBaseTable::power(mpz_t rop, const mpz_t exponent) const {
+    if (mpz_sgn(exponent) < 0 || mpz_sizeinbase(exponent, 2) > windowCount * windowBits) {
+        mpz_powm(rop, base, exponent, modulus);
+        return;
+    }
+    // TODO: the exponent is secret, every window multiplies (row[0] is 1) by an entry mpn_sec_tabselect
+    //  picks reading the whole row, and the mpn_sec functions take the same time whatever the operands
+    unsigned int rowSize = 1u << windowBits;
+    mp_size_t n = limbCount;
+    mp_size_t scratchSize = std::max(mpn_sec_mul_itch(n, n), mpn_sec_div_r_itch(2 * n, n));
+    mp_limb_t *accumulator = new mp_limb_t [n](), *selected = new mp_limb_t [n];
+    mp_limb_t *product = new mp_limb_t [2 * n], *scratch = new mp_limb_t [scratchSize];
+    accumulator[0] = 1;
+    for (unsigned int i = 0; i < windowCount; ++i) {
+        unsigned int digit = 0;
+        for (unsigned int b = 0; b < windowBits; ++b)
+            digit |= (unsigned int)mpz_tstbit(exponent, i * windowBits + b) << b;
+        mpn_sec_tabselect(selected, table + (size_t)i * rowSize * n, n, rowSize, digit);
+        mpn_sec_mul(product, accumulator, n, selected, n, scratch);
+        mpn_sec_div_r(product, 2 * n, mpz_limbs_read(modulus), n, scratch);
+        mpn_copyi(accumulator, product, n);
+    }
+    mpn_copyi(mpz_limbs_write(rop, n), accumulator, n);
+    mpz_limbs_finish(rop, n);
+    for (auto limbs: {make_pair(accumulator, n), make_pair(selected, n), make_pair(product, 2 * n),
+                      make_pair(scratch, scratchSize)}) {
+        OPENSSL_cleanse(limbs.first, limbs.second * sizeof(mp_limb_t));
+        delete []limbs.first;
+    }
+}
+
+// EphemeralKeyPool Code
+
+mutex EphemeralKeyPool::registryMutex;
+vector<shared_ptr<EphemeralKeyPool>> EphemeralKeyPool::registry;
+
+shared_ptr<EphemeralKeyPool> EphemeralKeyPool::acquire(const mpz_t g, const mpz_t p,
+        unsigned int poolSize, unsigned int windowBits) {
+    lock_guard<mutex> lock(registryMutex);
+    for (auto &pool: registry)
+        if (pool->sameParameters(g, p)) return pool;
+    shared_ptr<EphemeralKeyPool> pool(new EphemeralKeyPool(g, p, poolSize, windowBits));
+    registry.push_back(pool);
+    return pool;
+}
+
+shared_ptr<EphemeralKeyPool> EphemeralKeyPool::find(const mpz_t g, const mpz_t p) {
+    lock_guard<mutex> lock(registryMutex);
+    for (auto &pool: registry)
+        if (pool->sameParameters(g, p)) return pool;
+    return nullptr;
+}
+
+EphemeralKeyPool::poolUsage EphemeralKeyPool::usage() {
+    poolUsage total;
+    lock_guard<mutex> lock(registryMutex);
+    for (auto &pool: registry) {
+        total.pools++;
+        total.ready += pool->readySize();
+        total.capacity += pool->poolSize;
+        total.taken += pool->taken.load(memory_order_relaxed);
+        total.drained += pool->drained.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+EphemeralKeyPool::EphemeralKeyPool(const mpz_t g, const mpz_t p, unsigned int poolSize,
+        unsigned int windowBits) : poolSize(poolSize), windowBits(windowBits) {
+    mpz_init_set(publicG, g);
+    mpz_init_set(publicP, p);
+    gmp_randinit_default(randState);
+    random_device seed;
+    gmp_randseed_ui(randState, ((unsigned long)seed() << 32u) ^ seed());
+    filler = thread([this]{this->fillLoop();});
+}
+
+EphemeralKeyPool::~EphemeralKeyPool() {
+    {
+        lock_guard<mutex> lock(poolMutex);
+        stopping = true;
+    }
+    poolChanged.notify_all();
+    filler.join();
+    for (auto pair: readyPairs) {
+        wipe(pair->x);
+        mpz_clears(pair->x, pair->gx, NULL);
+        delete pair;
+    }
+    gmp_randclear(randState);
+    mpz_clears(publicG, publicP, NULL);
+}
+
+bool EphemeralKeyPool::sameParameters(const mpz_t g, const mpz_t p) const {
+    return mpz_cmp(publicG, g) == 0 && mpz_cmp(publicP, p) == 0;
+}
+
+void EphemeralKeyPool::generatePair(mpz_t x, mpz_t gx) {
+    shared_ptr<FixedBaseTable> currentTable;
+    {
+        lock_guard<mutex> lock(randMutex);
+        mpz_urandomm(x, randState, publicP);
+        currentTable = table;
+    }
+    if (currentTable) currentTable->power(gx, x);
+    else mpz_powm(gx, publicG, x, publicP);
+}
+
+void EphemeralKeyPool::take(mpz_t x, mpz_t gx) {
+    taken.fetch_add(1, memory_order_relaxed);
+    keyPair *pair = nullptr;
+    {
+        lock_guard<mutex> lock(poolMutex);
+        if (!readyPairs.empty()) {
+            pair = readyPairs.front();
+            readyPairs.pop_front();
+        }
+    }
+    if (pair == nullptr) {
+        // TODO: pool drained in a connection storm, pay the exponentiation on this thread.
+        drained.fetch_add(1, memory_order_relaxed);
+        generatePair(x, gx);
+        return;
+    }
+    poolChanged.notify_all();
+    mpz_swap(x, pair->x);
+    mpz_swap(gx, pair->gx);
+    // TODO: the swap left the caller's previous exponent in the pair
+    wipe(pair->x);
+    mpz_clears(pair->x, pair->gx, NULL);
+    delete pair;
+}
+
+void EphemeralKeyPool::wipe(mpz_t secret) {
+    // every allocated limb, a shorter value may have left older ones behind its size
+    size_t limbs = secret->_mp_alloc;
+    OPENSSL_cleanse(mpz_limbs_modify(secret, limbs), limbs * sizeof(mp_limb_t));
+    mpz_limbs_finish(secret, 0);
+}
+
+size_t EphemeralKeyPool::readySize() {
+    lock_guard<mutex> lock(poolMutex);
+    return readyPairs.size();
+}
+
+void EphemeralKeyPool::fillLoop() {
+    auto builtTable = make_shared<FixedBaseTable>(publicG, publicP, windowBits);
+    {
+        lock_guard<mutex> lock(randMutex);
+        table = builtTable;
+    }
+
+    while (true) {
+        {
+            unique_lock<mutex> lock(poolMutex);
+            poolChanged.wait(lock, [this]{return stopping || readyPairs.size() < poolSize;});
+            if (stopping) return;
+        }
+        auto pair = new keyPair;
+        mpz_inits(pair->x, pair->gx, NULL);
+        generatePair(pair->x, pair->gx);
+        {
+            lock_guard<mutex> lock(poolMutex);
+            readyPairs.push_back(pair);
+        }
+    }
+}
@@ -0,0 +1,80 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#include "../include/LatencyHistogram.h"
+
+#include <algorithm>      // min
+#include <cmath>          // ceil
+
+LatencyHistogram::LatencyHistogram() {
+    for (auto &bucket: counts) bucket.store(0, memory_order_relaxed);
+}
+
+LatencyHistogram::LatencyHistogram(const LatencyHistogram &other): LatencyHistogram() {
+    merge(other);
+}
+
+LatencyHistogram &LatencyHistogram::operator=(const LatencyHistogram &other) {
+    if (this != &other) {
+        reset();
+        merge(other);
+    }
+    return *this;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        auto bucket = other.counts[i].load(memory_order_relaxed);
+        if (bucket != 0) counts[i].fetch_add(bucket, memory_order_relaxed);
+    }
+    total.fetch_add(other.total.load(memory_order_relaxed), memory_order_relaxed);
+    sum.fetch_add(other.sum.load(memory_order_relaxed), memory_order_relaxed);
+    unsigned long long otherMax = other.max(), seen = maximum.load(memory_order_relaxed);
+    while (otherMax > seen && !maximum.compare_exchange_weak(seen, otherMax, memory_order_relaxed)) {}
+}
+
+void LatencyHistogram::reset() {
+    for (auto &bucket: counts) bucket.store(0, memory_order_relaxed);
+    total.store(0, memory_order_relaxed);
+    sum.store(0, memory_order_relaxed);
+    maximum.store(0, memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+    auto samples = count();
+    return samples == 0 ? 0 : (double)sum.load(memory_order_relaxed) / samples;
+}
+
+unsigned long long LatencyHistogram::quantile(double fraction) const {
+    // TODO: buckets are read one by one while others record, sum them instead of trusting total
+    unsigned long long samples = 0;
+    for (auto &bucket: counts) samples += bucket.load(memory_order_relaxed);
+    if (samples == 0) return 0;
+    if (fraction < 0) fraction = 0;
+    if (fraction > 1) fraction = 1;
+    // TODO: nearest rank, p99 of 10 samples is the 10th and not the 9th
+    auto rank = (unsigned long long)ceil(fraction * samples);
+    rank = min(std::max(rank, 1ull), samples);
+    unsigned long long seen = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += counts[i].load(memory_order_relaxed);
+        // TODO: the top bucket is wider than the largest sample, report that sample instead
+        if (seen >= rank) return min(bucketUpper(i), max());
+    }
+    return max();
+}
+
+unsigned long long LatencyHistogram::countAtMost(unsigned long long nanoseconds) const {
+    unsigned long long samples = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS && bucketUpper(i) <= nanoseconds; ++i)
+        samples += counts[i].load(memory_order_relaxed);
+    return samples;
+}
+
+unsigned long long LatencyHistogram::bucketUpper(unsigned int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) return index;
+    unsigned int shift = index / HISTOGRAM_SUB_BUCKETS - 1u;
+    unsigned long long mantissa = HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS;
+    return (mantissa << shift) + ((1ull << shift) - 1u);
+}
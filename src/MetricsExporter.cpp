@@ -0,0 +1,184 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#include "../include/MetricsExporter.h"
+
+#include <mutex>
+#include <iostream>         // For cerr
+#include <cstring>          // strerror
+#include <cerrno>
+#include <thread>           // detached HTTP & file threads
+#include <sstream>
+#include <fstream>
+#include <cstdio>           // rename
+#include <climits>          // ULLONG_MAX
+#include <sys/socket.h>     // HTTP listening socket
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>         // close
+
+// upper bounds of the exported histogram buckets, in seconds
+static const double exportBuckets[] = {0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10};
+static const char *exportBucketLabels[] = {"0.0001", "0.0005", "0.001", "0.005", "0.01", "0.05", "0.1", "0.5", "1", "5", "10"};
+
+/**
+ * The exporter threads are detached and run until the process exits,
+ *  so the registry is never destroyed under them by static destructors.
+ */
+struct metricsRegistry {
+    mutex registryMutex;
+    bool started = false, running = false;
+    unsigned long long nextId = 1;
+    map<unsigned long long, MetricsExporter::collector> collectors;
+    MetricsExporter::sample retired;
+};
+
+static metricsRegistry &registry() {
+    static auto instance = new metricsRegistry;
+    return *instance;
+}
+
+void MetricsExporter::sample::counter(const string &name, const string &help, double value) {
+    auto &metric = families[name];
+    metric.type = "counter"; metric.help = help;
+    metric.value += value;
+}
+
+void MetricsExporter::sample::gauge(const string &name, const string &help, double value) {
+    auto &metric = families[name];
+    metric.type = "gauge"; metric.help = help;
+    metric.value += value;
+}
+
+void MetricsExporter::sample::histogram(const string &name, const string &help, const LatencyHistogram &histogram) {
+    auto &metric = families[name];
+    metric.type = "histogram"; metric.help = help;
+    metric.histogram.merge(histogram);
+}
+
+bool MetricsExporter::start(unsigned short port, const string &file, unsigned int interval) {
+    auto &metrics = registry();
+    lock_guard<mutex> lock(metrics.registryMutex);
+    if (metrics.started || (port == 0 && file.empty())) return metrics.running;
+    // TODO: only the first config asking for it starts the exporter, a bound port isn't retried by every socket
+    metrics.started = true;
+
+    if (port != 0) {
+        int listenDescriptor = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        if (listenDescriptor < 0 || setsockopt(listenDescriptor, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0
+                || bind(listenDescriptor, (sockaddr *)&address, sizeof(address)) < 0 || listen(listenDescriptor, 16) < 0) {
+            if (listenDescriptor >= 0) close(listenDescriptor);
+            cerr << "Can't serve metrics on port " << port << ": " << strerror(errno) << endl;
+        } else {
+            thread(serveHttp, listenDescriptor).detach();
+            metrics.running = true;
+        }
+    }
+    if (!file.empty()) {
+        thread(writeFile, file, interval == 0 ? 1 : interval).detach();
+        metrics.running = true;
+    }
+    return metrics.running;
+}
+
+unsigned long long MetricsExporter::addCollector(collector collect) {
+    auto &metrics = registry();
+    lock_guard<mutex> lock(metrics.registryMutex);
+    auto id = metrics.nextId++;
+    metrics.collectors[id] = move(collect);
+    return id;
+}
+
+void MetricsExporter::removeCollector(unsigned long long id) {
+    auto &metrics = registry();
+    lock_guard<mutex> lock(metrics.registryMutex);
+    auto found = metrics.collectors.find(id);
+    if (found == metrics.collectors.end()) return;
+    // TODO: counters and histograms of a closed socket still count, its gauges are gone with it
+    sample last;
+    found->second(last);
+    metrics.collectors.erase(found);
+    for (auto &entry: last.families) {
+        if (entry.second.type == "counter") metrics.retired.counter(entry.first, entry.second.help, entry.second.value);
+        else if (entry.second.type == "histogram")
+            metrics.retired.histogram(entry.first, entry.second.help, entry.second.histogram);
+    }
+}
+
+string MetricsExporter::render() {
+    sample current;
+    {
+        auto &metrics = registry();
+        lock_guard<mutex> lock(metrics.registryMutex);
+        current = metrics.retired;
+        for (auto &entry: metrics.collectors) entry.second(current);
+    }
+
+    stringstream text;
+    text.precision(17);
+    for (auto &entry: current.families) {
+        auto &name = entry.first;
+        auto &metric = entry.second;
+        text << "# HELP " << name << " " << metric.help << "\n" << "# TYPE " << name << " " << metric.type << "\n";
+        if (metric.type != "histogram") {
+            text << name << " " << metric.value << "\n";
+            continue;
+        }
+        // TODO: cumulative buckets in seconds, +Inf is the sum of the buckets so that it can't be below them
+        for (size_t i = 0; i < sizeof(exportBuckets) / sizeof(exportBuckets[0]); ++i)
+            text << name << "_bucket{le=\"" << exportBucketLabels[i] << "\"} "
+                << metric.histogram.countAtMost((unsigned long long)(exportBuckets[i] * 1e9)) << "\n";
+        text << name << "_bucket{le=\"+Inf\"} " << metric.histogram.countAtMost(ULLONG_MAX) << "\n";
+        text << name << "_sum " << metric.histogram.sumOfSamples() / 1e9 << "\n";
+        text << name << "_count " << metric.histogram.countAtMost(ULLONG_MAX) << "\n";
+    }
+    return text.str();
+}
+
+void MetricsExporter::serveHttp(int listenDescriptor) {
+    while (true) {
+        int client = accept(listenDescriptor, nullptr, nullptr);
+        if (client < 0) continue;
+        // TODO: a scraper that doesn't send its request mustn't block the next one
+        timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == string::npos && request.size() < 8192) {
+            auto received = ::recv(client, buffer, sizeof(buffer), 0);
+            if (received <= 0) break;
+            request.append(buffer, received);
+        }
+
+        string status = "200 OK", body;
+        if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0) body = render();
+        else status = "404 Not Found";
+        string response = "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " + to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        for (size_t sent = 0; sent < response.size();) {
+            auto written = ::send(client, response.c_str() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (written <= 0) break;
+            sent += written;
+        }
+        close(client);
+    }
+}
+
+void MetricsExporter::writeFile(string file, unsigned int interval) {
+    while (true) {
+        // TODO: scrapers reading the file (node_exporter textfile) never see half of it
+        string temporary = file + ".tmp";
+        {
+            ofstream output(temporary, ios::trunc);
+            output << render();
+        }
+        rename(temporary.c_str(), file.c_str());
+        this_thread::sleep_for(chrono::seconds(interval));
+    }
+}
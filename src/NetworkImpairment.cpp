@@ -0,0 +1,134 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#include "../include/NetworkImpairment.h"
+
+#include <algorithm>        // max
+
+NetworkImpairment::NetworkImpairment(const settings &linkSettings, function<void(const string &)> transmit):
+        link(linkSettings), transmit(move(transmit)) {
+    if (link.seed != 0) random.seed(link.seed);
+    else random.seed(random_device()());
+    linkFree = chrono::steady_clock::now();
+    scheduler = thread([this]{this->transmitDue();});
+}
+
+NetworkImpairment::~NetworkImpairment() {
+    {
+        lock_guard<mutex> lock(linkMutex);
+        stopping = true;
+    }
+    scheduleChanged.notify_all();
+    scheduler.join();
+}
+
+bool NetworkImpairment::isActive(const settings &linkSettings) {
+    return linkSettings.lossRate > 0 || linkSettings.burstEnterRate > 0 || linkSettings.delay.count() > 0
+        || linkSettings.jitter.count() > 0 || linkSettings.reorderRate > 0 || linkSettings.duplicateRate > 0
+        || linkSettings.bandwidth > 0;
+}
+
+bool NetworkImpairment::lose() {
+    uniform_real_distribution<double> uniform(0, 1);
+    // TODO: Gilbert-Elliott, move between the good and the bad state before drawing the loss
+    if (!burstState && link.burstEnterRate > 0 && uniform(random) < link.burstEnterRate) burstState = true;
+    else if (burstState && uniform(random) < link.burstExitRate) burstState = false;
+    if (uniform(random) >= (burstState ? link.burstLossRate : link.lossRate)) return false;
+    counters.lost.fetch_add(1, memory_order_relaxed);
+    if (burstState) counters.burstLost.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+bool NetworkImpairment::submit(const void *header, int headerLen, const void *body, int bodyLen) {
+    counters.datagrams.fetch_add(1, memory_order_relaxed);
+    uniform_real_distribution<double> uniform(0, 1);
+    bool callerSends = false, queued = false;
+    int duplicatesNow = 0;
+    {
+        lock_guard<mutex> lock(linkMutex);
+        if (lose()) return true;
+        int copies = 1;
+        if (link.duplicateRate > 0 && uniform(random) < link.duplicateRate) {
+            ++copies;
+            counters.duplicated.fetch_add(1, memory_order_relaxed);
+        }
+        auto now = chrono::steady_clock::now();
+        unsigned int size = headerLen + bodyLen;
+        for (int copy = 0; copy < copies; ++copy) {
+            auto due = now;
+            if (link.bandwidth > 0) {
+                // TODO: the link sends one datagram after another, a full queue drops the newcomer
+                auto start = max(now, linkFree);
+                double backlog = chrono::duration<double>(start - now).count() * link.bandwidth;
+                if (link.queueLimit > 0 && backlog + size > link.queueLimit) {
+                    counters.queueDropped.fetch_add(1, memory_order_relaxed);
+                    continue;
+                }
+                linkFree = start + chrono::nanoseconds(size * 1000000000ull / link.bandwidth);
+                due = linkFree;
+            }
+            auto delay = link.delay;
+            if (link.jitter.count() > 0) {
+                uniform_int_distribution<long long> jitter(-link.jitter.count(), link.jitter.count());
+                delay = max(chrono::microseconds(0), delay + chrono::microseconds(jitter(random)));
+            }
+            due += delay;
+            if (link.reorderRate > 0 && uniform(random) < link.reorderRate) {
+                due += link.reorderDelay;
+                counters.reordered.fetch_add(1, memory_order_relaxed);
+            }
+            if (due <= now) {
+                if (copy == 0) callerSends = true;
+                else ++duplicatesNow;
+                continue;
+            }
+            string datagram(static_cast<const char *>(header), headerLen);
+            if (bodyLen > 0) datagram.append(static_cast<const char *>(body), bodyLen);
+            scheduled.push({due, nextOrder++, move(datagram)});
+            counters.delayed.fetch_add(1, memory_order_relaxed);
+            queued = true;
+        }
+    }
+    if (queued) scheduleChanged.notify_one();
+    if (duplicatesNow > 0) {
+        string datagram(static_cast<const char *>(header), headerLen);
+        if (bodyLen > 0) datagram.append(static_cast<const char *>(body), bodyLen);
+        transmit(datagram);
+    }
+    return !callerSends;
+}
+
+void NetworkImpairment::transmitDue() {
+    unique_lock<mutex> lock(linkMutex);
+    // TODO: like a real link, what is in flight still arrives after the socket is closed
+    while (!stopping || !scheduled.empty()) {
+        if (scheduled.empty()) {
+            scheduleChanged.wait(lock);
+            continue;
+        }
+        auto due = scheduled.top().due;
+        if (chrono::steady_clock::now() < due) {
+            scheduleChanged.wait_until(lock, due);
+            continue;
+        }
+        // TODO: priority_queue::top is const, the datagram is copied out before pop
+        string datagram = scheduled.top().datagram;
+        scheduled.pop();
+        lock.unlock();
+        transmit(datagram);
+        lock.lock();
+    }
+}
+
+NetworkImpairment::impairmentCounters NetworkImpairment::getCounters() const {
+    impairmentCounters snapshot;
+    snapshot.datagrams = counters.datagrams.load(memory_order_relaxed);
+    snapshot.lost = counters.lost.load(memory_order_relaxed);
+    snapshot.burstLost = counters.burstLost.load(memory_order_relaxed);
+    snapshot.queueDropped = counters.queueDropped.load(memory_order_relaxed);
+    snapshot.delayed = counters.delayed.load(memory_order_relaxed);
+    snapshot.reordered = counters.reordered.load(memory_order_relaxed);
+    snapshot.duplicated = counters.duplicated.load(memory_order_relaxed);
+    return snapshot;
+}
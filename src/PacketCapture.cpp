@@ -0,0 +1,246 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#include "../include/PacketCapture.h"
+#include "../include/UdpSocket.h"       // SocketException
+
+#include <map>              // captures by path
+#include <chrono>           // system_clock timestamps
+#include <cstring>          // memcpy
+#include <algorithm>        // stable_sort
+
+/**
+ * pcapng blocks, see https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-02.html
+ * Written in host byte order, the byte order magic of the section header tells readers which one.
+ */
+#define PCAPNG_SECTION_HEADER 0x0A0D0D0Au
+#define PCAPNG_INTERFACE_DESCRIPTION 0x00000001u
+#define PCAPNG_ENHANCED_PACKET 0x00000006u
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4Du
+// raw IPv4 packets, without any link layer header
+#define PCAPNG_LINKTYPE_IPV4 228u
+#define PCAPNG_OPTION_END 0u
+#define PCAPNG_IF_NAME 2u
+#define PCAPNG_IF_TSRESOL 9u
+#define PCAPNG_EPB_FLAGS 2u
+#define PCAPNG_INBOUND 0x1u
+#define PCAPNG_OUTBOUND 0x2u
+// synthesized IPv4 & UDP headers
+#define CAPTURE_IP_HEADER 20u
+#define CAPTURE_UDP_HEADER 8u
+
+static void putU16(string &block, unsigned short value) {block.append(reinterpret_cast<char *>(&value), 2);}
+static void putU32(string &block, unsigned int value) {block.append(reinterpret_cast<char *>(&value), 4);}
+static void putBigU16(string &block, unsigned short value) {
+    block.push_back((char)(value >> 8u)); block.push_back((char)(value & 0xffu));
+}
+static void pad4(string &block) {while (block.size() % 4 != 0) block.push_back('\0');}
+
+static unsigned int getU32(const string &block, size_t offset) {
+    unsigned int value; memcpy(&value, block.c_str() + offset, 4); return value;
+}
+static unsigned short getBigU16(const string &block, size_t offset) {
+    return (unsigned short)(((unsigned char)block[offset] << 8u) | (unsigned char)block[offset + 1]);
+}
+
+/**
+ * Blocks are [type][total length][body][total length], the body is appended between openBlock and closeBlock.
+ */
+static string openBlock(unsigned int type, size_t bodySize) {
+    string block;
+    block.reserve(bodySize + 12);
+    putU32(block, type); putU32(block, 0);
+    return block;
+}
+
+static void closeBlock(string &block) {
+    unsigned int length = block.size() + 4;
+    memcpy(&block[4], &length, 4);
+    putU32(block, length);
+}
+
+static map<string, weak_ptr<PacketCapture>> captures;
+static mutex capturesMutex;
+
+shared_ptr<PacketCapture> PacketCapture::open(const string &path, unsigned int queueLimit) {
+    lock_guard<mutex> lock(capturesMutex);
+    auto capture = captures[path].lock();
+    if (!capture) {
+        capture = shared_ptr<PacketCapture>(new PacketCapture(path, queueLimit));
+        captures[path] = capture;
+    }
+    return capture;
+}
+
+PacketCapture::PacketCapture(const string &path, unsigned int queueLimit): queueLimit(queueLimit) {
+    file.open(path, ios::binary | ios::trunc);
+    if (!file.is_open()) throw SocketException("Can't create capture file " + path, true);
+
+    auto block = openBlock(PCAPNG_SECTION_HEADER, 16);
+    putU32(block, PCAPNG_BYTE_ORDER_MAGIC);
+    putU16(block, 1); putU16(block, 0);
+    putU32(block, 0xffffffffu); putU32(block, 0xffffffffu);     // section length unknown
+    closeBlock(block);
+    file.write(block.c_str(), block.size());
+    writer = thread([this]{this->writeBlocks();});
+}
+
+PacketCapture::~PacketCapture() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    writer.join();
+}
+
+unsigned int PacketCapture::addInterface(const string &name) {
+    auto block = openBlock(PCAPNG_INTERFACE_DESCRIPTION, name.size() + 28);
+    putU16(block, PCAPNG_LINKTYPE_IPV4); putU16(block, 0);
+    putU32(block, 0);                   // no snap length
+    putU16(block, PCAPNG_IF_NAME); putU16(block, name.size());
+    block += name; pad4(block);
+    putU16(block, PCAPNG_IF_TSRESOL); putU16(block, 1);
+    block.push_back(9); pad4(block);    // nanoseconds
+    putU16(block, PCAPNG_OPTION_END); putU16(block, 0);
+    closeBlock(block);
+
+    unsigned int id;
+    {
+        // TODO: interface ids are their order in the file, never drop an interface block
+        lock_guard<mutex> lock(queueMutex);
+        id = interfaces++;
+        queuedBytes += block.size();
+        queue.push_back(move(block));
+    }
+    queueChanged.notify_one();
+    return id;
+}
+
+void PacketCapture::record(unsigned int interface, bool outbound, const endpoints &ends,
+        const void *header, int headerLen, const void *body, int bodyLen) {
+    auto now = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    unsigned int payloadSize = headerLen + bodyLen, packetSize = CAPTURE_IP_HEADER + CAPTURE_UDP_HEADER + payloadSize;
+
+    auto block = openBlock(PCAPNG_ENHANCED_PACKET, packetSize + 36);
+    putU32(block, interface);
+    putU32(block, (unsigned int)((unsigned long long)now >> 32u));
+    putU32(block, (unsigned int)((unsigned long long)now & 0xffffffffu));
+    putU32(block, packetSize); putU32(block, packetSize);
+
+    // TODO: IPv4 header, addresses are already in network byte order
+    unsigned int source = outbound ? ends.localAddress : ends.foreignAddress;
+    unsigned int destination = outbound ? ends.foreignAddress : ends.localAddress;
+    size_t ipStart = block.size();
+    block.push_back(0x45); block.push_back(0);
+    putBigU16(block, packetSize);
+    putBigU16(block, 0); putBigU16(block, 0x4000);     // no fragments
+    block.push_back(64); block.push_back(17);           // ttl, UDP
+    putBigU16(block, 0);
+    block.append(reinterpret_cast<const char *>(&source), 4);
+    block.append(reinterpret_cast<const char *>(&destination), 4);
+    unsigned int checksum = 0;
+    for (size_t i = ipStart; i < ipStart + CAPTURE_IP_HEADER; i += 2) checksum += getBigU16(block, i);
+    while ((checksum >> 16u) != 0) checksum = (checksum & 0xffffu) + (checksum >> 16u);
+    checksum = ~checksum & 0xffffu;
+    block[ipStart + 10] = (char)(checksum >> 8u); block[ipStart + 11] = (char)(checksum & 0xffu);
+
+    // UDP header without checksum, allowed over IPv4
+    unsigned short sourcePort = outbound ? ends.localPort : ends.foreignPort;
+    unsigned short destinationPort = outbound ? ends.foreignPort : ends.localPort;
+    block.append(reinterpret_cast<const char *>(&sourcePort), 2);
+    block.append(reinterpret_cast<const char *>(&destinationPort), 2);
+    putBigU16(block, CAPTURE_UDP_HEADER + payloadSize); putBigU16(block, 0);
+
+    block.append(static_cast<const char *>(header), headerLen);
+    if (bodyLen > 0) block.append(static_cast<const char *>(body), bodyLen);
+    pad4(block);
+    putU16(block, PCAPNG_EPB_FLAGS); putU16(block, 4);
+    putU32(block, outbound ? PCAPNG_OUTBOUND : PCAPNG_INBOUND);
+    putU16(block, PCAPNG_OPTION_END); putU16(block, 0);
+    closeBlock(block);
+    if (!push(move(block))) dropped.fetch_add(1, memory_order_relaxed);
+}
+
+bool PacketCapture::push(string &&block) {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (queuedBytes + block.size() > queueLimit) return false;
+        queuedBytes += block.size();
+        queue.push_back(move(block));
+    }
+    queueChanged.notify_one();
+    return true;
+}
+
+void PacketCapture::writeBlocks() {
+    deque<string> writing;
+    unique_lock<mutex> lock(queueMutex);
+    while (true) {
+        queueChanged.wait(lock, [this]{return stopping || !queue.empty();});
+        if (queue.empty()) break;
+        // TODO: take the whole queue, sockets keep queueing while the file is written
+        writing.swap(queue);
+        size_t written = 0;
+        lock.unlock();
+        for (auto &block: writing) {
+            file.write(block.c_str(), block.size());
+            written += block.size();
+        }
+        writing.clear();
+        lock.lock();
+        queuedBytes -= written;
+        if (queue.empty()) file.flush();
+    }
+    file.flush();
+}
+
+bool PacketCapture::load(const string &path, vector<capturedPacket> &packets) {
+    ifstream input(path, ios::binary);
+    string content((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+    if (content.size() < 28 || getU32(content, 0) != PCAPNG_SECTION_HEADER
+        || getU32(content, 8) != PCAPNG_BYTE_ORDER_MAGIC) return false;
+
+    size_t offset = 0;
+    while (offset + 12 <= content.size()) {
+        unsigned int type = getU32(content, offset), length = getU32(content, offset + 4);
+        if (length < 12 || length % 4 != 0 || offset + length > content.size()) return false;
+        if (type == PCAPNG_ENHANCED_PACKET && length >= 32) {
+            unsigned int captured = getU32(content, offset + 20);
+            if (captured > length - 32) return false;
+            string packet = content.substr(offset + 28, captured);
+            // TODO: only datagrams synthesized by record, IPv4 without options then UDP
+            if (packet.size() >= CAPTURE_IP_HEADER + CAPTURE_UDP_HEADER && packet[0] == 0x45 && packet[9] == 17) {
+                capturedPacket cpacket;
+                cpacket.interface = getU32(content, offset + 8);
+                cpacket.timestamp = ((unsigned long long)getU32(content, offset + 12) << 32u) | getU32(content, offset + 16);
+                size_t options = offset + 28 + (captured + 3) / 4 * 4;
+                while (options + 4 <= offset + length - 4) {
+                    unsigned short code = *(const unsigned short *)(content.c_str() + options);
+                    unsigned short size = *(const unsigned short *)(content.c_str() + options + 2);
+                    if (code == PCAPNG_OPTION_END) break;
+                    if (code == PCAPNG_EPB_FLAGS && size == 4)
+                        cpacket.outbound = (getU32(content, options + 4) & 0x3u) == PCAPNG_OUTBOUND;
+                    options += 4 + (size + 3u) / 4 * 4;
+                }
+                unsigned int source, destination;
+                unsigned short sourcePort, destinationPort;
+                memcpy(&source, packet.c_str() + 12, 4); memcpy(&destination, packet.c_str() + 16, 4);
+                memcpy(&sourcePort, packet.c_str() + 20, 2); memcpy(&destinationPort, packet.c_str() + 22, 2);
+                cpacket.ends.localAddress = cpacket.outbound ? source : destination;
+                cpacket.ends.foreignAddress = cpacket.outbound ? destination : source;
+                cpacket.ends.localPort = cpacket.outbound ? sourcePort : destinationPort;
+                cpacket.ends.foreignPort = cpacket.outbound ? destinationPort : sourcePort;
+                cpacket.payload = packet.substr(CAPTURE_IP_HEADER + CAPTURE_UDP_HEADER);
+                packets.push_back(move(cpacket));
+            }
+        }
+        offset += length;
+    }
+    // TODO: sockets timestamp before they queue, blocks of different sockets may be slightly out of order
+    stable_sort(packets.begin(), packets.end(), [](const capturedPacket &a, const capturedPacket &b) {
+        return a.timestamp < b.timestamp;
+    });
+    return true;
+}
@@ -25,8 +25,6 @@
 #define ACK_FLAG 0x10u
 #define MSG_FLAG 0x8u
 
-//#define RELIABLE_DEBUG true
-
 // ReliableSocket Code
 
 ReliableSocket::formatPacket ReliableSocket::parsePacket(const char *packet) {
@@ -50,9 +48,16 @@ char* ReliableSocket::deparsePacket(const ReliableSocket::formatPacket fpacket)
     return packet;
 }
 
-ReliableSocket::formatPacket ReliableSocket::getHanPacket() const {
+ReliableSocket::formatPacket ReliableSocket::getHanPacket(const string &body) const {
+    if (body.size() > packetSize)
+        throw SocketException("Handshake body is bigger than packetSize", false);
     formatPacket hpacket;
     hpacket.flag = HAN_FLAG;
+    if (!body.empty()) {
+        hpacket.bodySize = body.size();
+        hpacket.packetBody = new char [hpacket.bodySize];
+        memcpy(hpacket.packetBody, body.c_str(), body.size());
+    }
     return hpacket;
 }
 
@@ -121,10 +126,12 @@ ReliableSocket::ReliableSocket(const string &localAddress, unsigned short localP
 }
 
 ReliableSocket::~ReliableSocket() {
-    for(auto packet: packetsBuffer) delete []packet;
+    waitAsyncOperations();
+    if (metricsCollector != 0) MetricsExporter::removeCollector(metricsCollector);
+    releasePackets();
 }
 
-Json::Value ReliableSocket::loadConfig(const char *configPath) {
+Json::Value ReliableSocket::readConfigFile(const char *configPath) {
     // TODO: Load all chars into string from file.
     ifstream configFile;
     configFile.open(configPath);
@@ -140,22 +147,53 @@ Json::Value ReliableSocket::loadConfig(const char *configPath) {
         Json::CharReader *configReader = configBuilder.newCharReader();
 
         string parsingErrors;
-        if ( !(configReader->parse(configStr.c_str(),
+        bool parsed = configReader->parse(configStr.c_str(),
                 configStr.c_str() + configStr.size(),
-                &configValue, &parsingErrors)) ) {
+                &configValue, &parsingErrors);
+        delete configReader;
+        if (!parsed)
             throw SocketException("Parsing json file" + string(configPath) + " errors " + parsingErrors);
-        }
-        timeoutInterval = chrono::milliseconds(configValue["timeoutInterval"].asInt());
-        packetSize = configValue["packetSize"].asInt();
-        bufferSize = configValue["bufferSize"].asInt();
-        retryTimes = configValue["retryTimes"].asInt();
         configFile.close();
     } else throw SocketException("Can't open config file.", false);
+    return configValue;
+}
+
+Json::Value ReliableSocket::loadConfig(const char *configPath) {
+    auto configValue = readConfigFile(configPath);
+    timeoutInterval = chrono::milliseconds(configValue["timeoutInterval"].asInt());
+    packetSize = configValue["packetSize"].asInt();
+    bufferSize = configValue["bufferSize"].asInt();
+    retryTimes = configValue["retryTimes"].asInt();
+    sendWindow = configValue.get("sendWindow", 64).asUInt();
+    if (configValue.get("traceEvents", false).asBool()) EventTrace::start(configValue.get("traceFile", "").asString());
+    auto captureFile = configValue.get("captureFile", "").asString();
+    if (!captureFile.empty())
+        setCapture(PacketCapture::open(captureFile, configValue.get("captureQueueLimit", 16777216).asUInt()),
+                "reliable socket " + to_string(traceSocket));
+    // TODO: emulated lossy link under this socket, for measuring the protocol on loopback
+    auto impairmentValue = configValue["impairment"];
+    if (impairmentValue.isObject()) {
+        NetworkImpairment::settings link;
+        link.lossRate = impairmentValue.get("lossRate", 0).asDouble();
+        link.burstEnterRate = impairmentValue.get("burstEnterRate", 0).asDouble();
+        link.burstExitRate = impairmentValue.get("burstExitRate", 0.5).asDouble();
+        link.burstLossRate = impairmentValue.get("burstLossRate", 1).asDouble();
+        link.delay = chrono::microseconds(impairmentValue.get("delay", 0).asUInt64());
+        link.jitter = chrono::microseconds(impairmentValue.get("jitter", 0).asUInt64());
+        link.reorderRate = impairmentValue.get("reorderRate", 0).asDouble();
+        link.reorderDelay = chrono::microseconds(impairmentValue.get("reorderDelay", 1000).asUInt64());
+        link.duplicateRate = impairmentValue.get("duplicateRate", 0).asDouble();
+        link.bandwidth = impairmentValue.get("bandwidth", 0).asUInt64();
+        link.queueLimit = impairmentValue.get("queueLimit", 1048576).asUInt();
+        link.seed = impairmentValue.get("seed", 0).asUInt64();
+        setImpairment(link);
+    }
 
     if (timeoutInterval == 0ms) timeoutInterval = 1s;
     if (packetSize == 0) packetSize = 1024;
     if (bufferSize == 0) bufferSize = 1200;
     if (retryTimes == 0) retryTimes = 3;
+    if (sendWindow == 0) sendWindow = 64;
 
     if (packetSize + 6 > bufferSize)
         throw SocketException("Your received bufferSize should be greater than packetSize.", false);
@@ -169,18 +207,15 @@ Json::Value ReliableSocket::loadConfig(const char *configPath) {
     timeoutStruct.tv_usec = (timeoutInterval.count() % 1000) * 1000;
     setsockopt(sockDesc, SOL_SOCKET, SO_RCVTIMEO, &timeoutStruct, sizeof(timeoutStruct));
 #endif
-#ifdef RELIABLE_DEBUG
-    cout << "Set timeout: " << timeoutInterval.count() << "ms" << endl;
-#endif
+    // TODO: registered last, nothing throws after it so the destructor always unregisters
+    if (MetricsExporter::start(configValue.get("metricsPort", 0).asUInt(), configValue.get("metricsFile", "").asString(),
+            configValue.get("metricsInterval", 15).asUInt()) && metricsCollector == 0)
+        metricsCollector = MetricsExporter::addCollector([this](MetricsExporter::sample &metrics){collectMetrics(metrics);});
     return configValue;
 }
 
 void ReliableSocket::setPackets(const char *message, unsigned int mLength) {
-    if (messageLength != 0) {
-        for(auto packet: packetsBuffer) delete []packet;
-        packetsBuffer.clear(); packetsConfirm.clear();
-        messageLength = 0;
-    }
+    releasePackets();
 
     messageLength = mLength; int i = 0;
     for(i = 0; i < messageLength / packetSize; ++i){
@@ -193,9 +228,6 @@ void ReliableSocket::setPackets(const char *message, unsigned int mLength) {
         memcpy(packet, message + i*packetSize, messageLength % packetSize);
         packetsBuffer.push_back(packet); packetsConfirm.push_back(false);
     }
-#ifdef RELIABLE_DEBUG
-    cout << "Set packet: " << string(message, mLength) << endl;
-#endif
 }
 
 void ReliableSocket::setPackets(const string &messageBody) {
@@ -204,11 +236,7 @@ void ReliableSocket::setPackets(const string &messageBody) {
 }
 
 void ReliableSocket::setPackets(unsigned int mLength) {
-    if (messageLength != 0) {
-        for(auto packet: packetsBuffer) delete []packet;
-        packetsBuffer.clear(); packetsConfirm.clear();
-        messageLength = 0;
-    }
+    releasePackets();
 
     messageLength = mLength;
     for(int i = 0; i < messageLength / packetSize; ++i){
@@ -219,9 +247,21 @@ void ReliableSocket::setPackets(unsigned int mLength) {
         char *packet = new char[packetSize];
         packetsBuffer.push_back(packet); packetsConfirm.push_back(false);
     }
-#ifdef RELIABLE_DEBUG
-    cout << "Set empty packet with length=" << mLength << endl;
-#endif
+}
+
+void ReliableSocket::setPacketsView(const char *message, unsigned int mLength) {
+    releasePackets();
+    // TODO: packets point into the caller's buffer, nothing is copied before send()
+    messageLength = mLength; packetsBorrowed = true;
+    for (unsigned int offset = 0; offset < mLength; offset += packetSize) {
+        packetsBuffer.push_back(const_cast<char *>(message) + offset); packetsConfirm.push_back(false);
+    }
+}
+
+void ReliableSocket::releasePackets() {
+    if (!packetsBorrowed) for(auto packet: packetsBuffer) delete []packet;
+    packetsBuffer.clear(); packetsConfirm.clear();
+    messageLength = 0; packetsBorrowed = false;
 }
 
 unsigned int ReliableSocket::getMessageLength() const {return messageLength;}
@@ -242,51 +282,61 @@ void ReliableSocket::readMessage(char *destBuffer, int destBufferSize) const {
 
 void ReliableSocket::bindLocalAddressPort(const string &address, unsigned short port) {
     this->setLocalAddressAndPort(address, port);
-#ifdef RELIABLE_DEBUG
-    cout << "Bind local: " << address << ":" << port << endl;
-#endif
+    if (capture) refreshCaptureEndpoints();
 }
 
 void ReliableSocket::startListen() {
+    throwIfCancelled();
     char *receiveBuffer = new char [bufferSize];
     unsigned int receiveSize = 0;
     string sourceAddress; unsigned short sourcePort;
 
-#ifdef RELIABLE_DEBUG
-    cout << "Start listening." << flush;
-#endif
     // TODO: receive first handshake packet from peer side.
     while (true) {
         receiveSize = recvFrom(receiveBuffer, bufferSize, sourceAddress, sourcePort);
-        if (receiveSize == -1){
-        #ifdef RELIABLE_DEBUG
-            cout << "." << flush;
-        #endif
-            continue;
+        if (receiveSize == -1) {
+            if (!cancelled) continue;
+            delete []receiveBuffer;
+            throwIfCancelled();
         }
+        countReceived(receiveSize);
         auto fpacket = parsePacket(receiveBuffer);
+        EventTrace::record(TRACE_PACKET_RECEIVED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize, 0);
+        if ( (fpacket.flag ^ HAN_FLAG) == 0u) {
+            handshakeStart = chrono::steady_clock::now();
+            handshakeRequest = string(fpacket.packetBody, fpacket.bodySize);
+            delete []fpacket.packetBody; break;
+        }
+        stats.droppedPackets.fetch_add(1, memory_order_relaxed);
+        EventTrace::record(TRACE_PACKET_DROPPED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize, 0);
         delete []fpacket.packetBody;
-        if ( (fpacket.flag ^ HAN_FLAG) == 0u) break;
     }
     connect(sourceAddress, sourcePort);
     delete []receiveBuffer;
-#ifdef RELIABLE_DEBUG
-    cout << endl << "Connect to " << getForeignAddress() << ":" << getForeignPort() << endl;
-#endif
+    listened = true;
 
     // TODO: send back ack of first handshake packet
-    auto hpacket = getHanPacket();
+    handshakeResponse = acceptHandshake(handshakeRequest);
+    auto hpacket = getHanPacket(handshakeResponse);
     char *packet = deparsePacket(hpacket);
     this->send(packet, hpacket.bodySize + 6);
+    countSent(hpacket.bodySize + 6);
+    EventTrace::record(TRACE_PACKET_SENT, traceSocket, 0, hpacket.flag, hpacket.bodySize + 6, 1);
+    EventTrace::record(TRACE_STATE, traceSocket, 0, 0, 0, TRACE_STATE_CONNECTED);
+    latency.handshake.recordSince(handshakeStart);
     delete []packet;
     delete []hpacket.packetBody;
 }
 
 void ReliableSocket::connectForeignAddressPort(const string &address, unsigned short port) {
     // TODO: set default send target, then send handshake packet
+    throwIfCancelled();
     this->connect(address, port);
-    auto hpacket = getHanPacket();
+    handshakeStart = chrono::steady_clock::now();
+    auto hpacket = getHanPacket(handshakeRequest);
+    handshakeResponse.clear();
     bool connectSuccess = false;
+    singleFailure.clear();
     auto t = thread([this, hpacket, &connectSuccess]{this->sendSinglePacket(hpacket, connectSuccess);});
 
     // TODO: receive first handshake packet ack.
@@ -294,43 +344,71 @@ void ReliableSocket::connectForeignAddressPort(const string &address, unsigned s
     unsigned int receiveSize;
     while (true) {
         receiveSize = this->recv(receiveBuffer, bufferSize);
-        if (receiveSize == -1) continue;
+        if (receiveSize == -1) {
+            if (cancelled) {
+                confirmSinglePacket(connectSuccess); t.join();
+                delete []receiveBuffer; delete []hpacket.packetBody;
+                throwIfCancelled();
+            }
+            if (!singlePacketLost(t)) continue;
+            delete []receiveBuffer; delete []hpacket.packetBody;
+            throw SocketException(singleFailure, false);
+        }
+        countReceived(receiveSize);
         auto fpacket = parsePacket(receiveBuffer);
-        delete []fpacket.packetBody;
-        if ( ((fpacket.flag ^ HAN_FLAG) == 0u) && fpacket.bodySize == 0u ){
-            connectSuccess = true;
+        EventTrace::record(TRACE_PACKET_RECEIVED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize, 0);
+        if ( (fpacket.flag ^ HAN_FLAG) == 0u ){
+            handshakeResponse = string(fpacket.packetBody, fpacket.bodySize);
+            delete []fpacket.packetBody;
+            confirmSinglePacket(connectSuccess);
+            stats.connectDuration.store(chrono::duration_cast<chrono::microseconds>(
+                    chrono::steady_clock::now() - handshakeStart).count(), memory_order_relaxed);
+            latency.handshake.recordSince(handshakeStart);
+            EventTrace::record(TRACE_STATE, traceSocket, 0, 0, 0, TRACE_STATE_CONNECTED);
             break;
         } else {
-        #ifdef RELIABLE_DEBUG
-            cout << "[Receiving Handshake ACK] Drop packets: " << string(fpacket.packetBody, fpacket.bodySize) << endl;
-        #endif
+            stats.droppedPackets.fetch_add(1, memory_order_relaxed);
+            EventTrace::record(TRACE_PACKET_DROPPED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize, 0);
+            delete []fpacket.packetBody;
         }
     }
     t.join();
+    delete []receiveBuffer;
     delete []hpacket.packetBody;
 }
 
+string ReliableSocket::acceptHandshake(const string &/* request */) {
+    return "";
+}
+
 void ReliableSocket::receiveMessage() {
     // TODO: STEP1 -- receive length packet
+    throwIfCancelled();
     char *receiveBuffer = new char [bufferSize];
     int receiveSize = 0;
+    auto messageStart = chrono::steady_clock::now();
     while (true) {
         receiveSize = recv(receiveBuffer, bufferSize);
-        if (receiveSize < 0) continue;
+        if (receiveSize < 0) {
+            // TODO: the peer may stay silent forever, only cancel gets this step out
+            if (!cancelled) continue;
+            delete []receiveBuffer;
+            throwIfCancelled();
+        }
+        countReceived(receiveSize);
         auto fpacket = parsePacket(receiveBuffer);
         if ( (fpacket.flag ^ LEN_FLAG) != 0u ) {
-        #ifdef RELIABLE_DEBUG
-            cout << "[Receiving Length] Drop packets: " << string(fpacket.packetBody, fpacket.bodySize) << endl;
-        #endif
+            dropPacket(fpacket, receiveSize);
             delete []fpacket.packetBody;
             continue;
         } else {
-            char *endBody = fpacket.packetBody + fpacket.bodySize;
-            auto mLength = strtol(fpacket.packetBody, &endBody, 10);
-        #ifdef RELIABLE_DEBUG
-            cout << "[Receiving Length] Ready receive length=" << mLength << endl;
-        #endif
+            // packet body isn't null terminated, don't let strtol run past it
+            auto mLength = strtoul(string(fpacket.packetBody, fpacket.bodySize).c_str(), nullptr, 10);
+            EventTrace::record(TRACE_PACKET_RECEIVED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize, 0);
+            EventTrace::record(TRACE_STATE, traceSocket, 0, 0, mLength, TRACE_STATE_LEN_RECEIVED);
             setPackets(mLength);
+            confirmedCount = 0;
+            messageStart = chrono::steady_clock::now();
             delete []fpacket.packetBody; break;
         }
     }
@@ -338,6 +416,7 @@ void ReliableSocket::receiveMessage() {
     // TODO: STEP2 -- sending length ack packet back
     auto hpacket = getLenAckPacket();
     bool lenAckSuccess = false;
+    singleFailure.clear();
     thread t ([this, hpacket, &lenAckSuccess]{
         this->sendSinglePacket(hpacket, lenAckSuccess);
     });
@@ -345,45 +424,60 @@ void ReliableSocket::receiveMessage() {
     // TODO: STEP3 -- waiting for all packets and sending acks
     while (true) {
         receiveSize = recv(receiveBuffer, bufferSize);
-        if (receiveSize < 0) continue;
+        if (receiveSize < 0) {
+            if (cancelled) {
+                confirmSinglePacket(lenAckSuccess); t.join();
+                delete []receiveBuffer; delete []hpacket.packetBody;
+                throwIfCancelled();
+            }
+            if (!singlePacketLost(t)) continue;
+            delete []receiveBuffer; delete []hpacket.packetBody;
+            throw SocketException(singleFailure, false);
+        }
+        countReceived(receiveSize);
         auto fpacket = parsePacket(receiveBuffer);
-        if ( (fpacket.flag ^ MSG_FLAG) == 0u) {
-        #ifdef RELIABLE_DEBUG
-            cout << "[Receiving Packets] [" << fpacket.seqNumber << "] "
-                << string(fpacket.packetBody, fpacket.bodySize) << endl;
-            cout << "[Send ACK packet] [" << fpacket.seqNumber << "] "
-                << string(fpacket.packetBody, fpacket.bodySize) << endl;
-        #endif
-            packetsConfirm.at(fpacket.seqNumber) = true; lenAckSuccess = true;
-            // TODO: save packet and send ack
-            memcpy(packetsBuffer.at(fpacket.seqNumber), fpacket.packetBody, fpacket.bodySize);
+        if ( (fpacket.flag ^ MSG_FLAG) == 0u && fpacket.seqNumber < packetsConfirm.size()) {
+            EventTrace::record(TRACE_PACKET_RECEIVED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize, 0);
+            confirmSinglePacket(lenAckSuccess);
+            // TODO: save packet and send ack, a retransmitted packet is only acked again
+            if (!packetsConfirm.at(fpacket.seqNumber)) {
+                packetsConfirm.at(fpacket.seqNumber) = true; ++confirmedCount;
+                memcpy(packetsBuffer.at(fpacket.seqNumber), fpacket.packetBody, fpacket.bodySize);
+            } else stats.duplicatePackets.fetch_add(1, memory_order_relaxed);
             auto mapacket = getMsgAckPacket(fpacket.seqNumber);
             auto ackpacket = deparsePacket(mapacket);
             this->send(ackpacket, mapacket.bodySize + 6);
+            countSent(mapacket.bodySize + 6);
+            EventTrace::record(TRACE_PACKET_SENT, traceSocket, mapacket.seqNumber, mapacket.flag, mapacket.bodySize + 6, 1);
             delete []ackpacket; delete []mapacket.packetBody;
         } else {
-        #ifdef RELIABLE_DEBUG
-            cout << "[Receiving Packets] Drop packet " <<
-                string(fpacket.packetBody, fpacket.bodySize) << endl;
-        #endif
+            dropPacket(fpacket, receiveSize);
             delete []fpacket.packetBody; continue;
         }
 
-        bool compeleteFlag = true;
-        for(auto confirm: packetsConfirm) if(!confirm) compeleteFlag = false;
         delete []fpacket.packetBody;
-        if (compeleteFlag) {break;}
+        if (confirmedCount == packetsConfirm.size()) {break;}
     }
 
     delete []receiveBuffer;
     t.join();
     delete []hpacket.packetBody;
+    stats.messagesReceived.fetch_add(1, memory_order_relaxed);
+    latency.receiveMessage.recordSince(messageStart);
+    EventTrace::record(TRACE_STATE, traceSocket, 0, 0, messageLength, TRACE_STATE_RECEIVED);
 }
 
 void ReliableSocket::sendMessage() {
+    throwIfCancelled();
+    // seqNumber is an unsigned short: only what goes on the wire is capped, the secure layer splits records below it
+    if (packetsBuffer.size() > UINT16_MAX + 1u)
+        throw SocketException("Message too long for this packetSize", false);
     // TODO: STEP1 -- send length packet
     auto lpacket = getLenPacket();
+    auto lenStart = chrono::steady_clock::now();
+    EventTrace::record(TRACE_STATE, traceSocket, 0, 0, messageLength, TRACE_STATE_SEND_START);
     bool lenSuccess = false;
+    singleFailure.clear();
     thread t ([this, lpacket, &lenSuccess]{this->sendSinglePacket(lpacket, lenSuccess);});
 
     // TODO: STEP2 -- waiting for handshake ack.
@@ -391,75 +485,151 @@ void ReliableSocket::sendMessage() {
     int receiveSize = 0;
     while (true) {
         receiveSize = recv(receiveBuffer, bufferSize);
-        if (receiveSize < 0) continue;
+        if (receiveSize < 0) {
+            if (cancelled) {
+                confirmSinglePacket(lenSuccess); t.join();
+                delete []receiveBuffer; delete []lpacket.packetBody;
+                throwIfCancelled();
+            }
+            if (!singlePacketLost(t)) continue;
+            delete []receiveBuffer; delete []lpacket.packetBody;
+            throw SocketException(singleFailure, false);
+        }
+        countReceived(receiveSize);
         auto fpacket = parsePacket(receiveBuffer);
         if ((fpacket.flag ^ (LEN_FLAG | ACK_FLAG)) == 0u ){
-        #ifdef RELIABLE_DEBUG
-            cout << "[Receiving LEN ACK] Received!" << endl;
-        #endif
-            lenSuccess = true;
+            confirmSinglePacket(lenSuccess);
+            stats.lenHandshakes.fetch_add(1, memory_order_relaxed);
+            stats.lenHandshakeSum.fetch_add(chrono::duration_cast<chrono::microseconds>(
+                    chrono::steady_clock::now() - lenStart).count(), memory_order_relaxed);
+            EventTrace::record(TRACE_PACKET_RECEIVED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize, 0);
+            EventTrace::record(TRACE_STATE, traceSocket, 0, 0, messageLength, TRACE_STATE_LEN_ACKED);
             delete []fpacket.packetBody; break;
         } else {
-        #ifdef RELIABLE_DEBUG
-            cout << "[Receiving LEN ACK] Drop packet " << string(fpacket.packetBody, fpacket.bodySize) << endl;
-        #endif
+            dropPacket(fpacket, receiveSize);
             delete []fpacket.packetBody;
         }
     }
     delete []lpacket.packetBody;
 
-    // TODO: STEP3 -- sending all packets
-    vector<thread> senderThreads;
-    for(int i = 0; i < packetsBuffer.size(); ++i) {
-        thread tt([this, i]{this->sendSinglePacket(i);});
-        senderThreads.push_back( move(tt) );
+    // TODO: STEP3 -- sending all packets, at most sendWindow of them unacknowledged at once
+    {
+        lock_guard<mutex> lock(packetsAckMutex);
+        confirmedCount = 0; sendFailed = false;
+        packetsAttempts.assign(packetsBuffer.size(), 0);
+        packetsSentAt.assign(packetsBuffer.size(), chrono::steady_clock::time_point());
     }
+    thread sender([this]{this->sendPacketsWindow();});
 
     // TODO: STEP4 -- waiting for all packets' ack
+    bool failed = false, stopped = false;
     while (true) {
+        {
+            lock_guard<mutex> lock(packetsAckMutex);
+            failed = sendFailed;
+        }
+        if (failed) break;
         receiveSize = recv(receiveBuffer, bufferSize);
-        if (receiveSize < 0) continue;
+        if (receiveSize < 0) {
+            if (!cancelled) continue;
+            // TODO: stop the window sender like a packet out of retries, without counting a send failure
+            {
+                lock_guard<mutex> lock(packetsAckMutex);
+                sendFailed = true;
+            }
+            packetsAckChanged.notify_all();
+            stopped = true; break;
+        }
+        countReceived(receiveSize);
         auto fpacket = parsePacket(receiveBuffer);
         delete []fpacket.packetBody;
-        if ( (fpacket.flag ^ (MSG_FLAG | ACK_FLAG)) == 0u) {
-        #ifdef RELIABLE_DEBUG
-            cout << "[Receiving Packets ACK] Received! [" << fpacket.seqNumber << "]" << endl;
-        #endif
-            packetsConfirm.at(fpacket.seqNumber) = true;
-        } else {
-        #ifdef RELIABLE_DEBUG
-            cout << "[Receiving Packets ACK] Drop packets " <<
-                string(fpacket.packetBody, fpacket.bodySize) << endl;
-        #endif
+        if ( (fpacket.flag ^ (MSG_FLAG | ACK_FLAG)) != 0u) {
+            dropPacket(fpacket, receiveSize);
             continue;
         }
 
-        bool completeFlag = true;
-        for(auto confirm: packetsConfirm) if(!confirm) completeFlag = false;
+        bool completeFlag = false;
+        {
+            lock_guard<mutex> lock(packetsAckMutex);
+            if (fpacket.seqNumber < packetsConfirm.size() && !packetsConfirm.at(fpacket.seqNumber)) {
+                packetsConfirm.at(fpacket.seqNumber) = true; ++confirmedCount;
+                auto rtt = chrono::steady_clock::now() - packetsSentAt.at(fpacket.seqNumber);
+                // TODO: Karn's rule, the ack of a resent packet can't tell which send it answers
+                if (packetsAttempts.at(fpacket.seqNumber) == 1) addRttSample(rtt);
+                EventTrace::record(TRACE_ACK_RECEIVED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize,
+                        (unsigned int)min<long long>(chrono::duration_cast<chrono::nanoseconds>(rtt).count(), UINT32_MAX));
+            } else if (fpacket.seqNumber < packetsConfirm.size()) {
+                stats.duplicatePackets.fetch_add(1, memory_order_relaxed);
+                EventTrace::record(TRACE_PACKET_DROPPED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize, 0);
+            } else {
+                stats.droppedPackets.fetch_add(1, memory_order_relaxed);
+                EventTrace::record(TRACE_PACKET_DROPPED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize, 0);
+            }
+            completeFlag = confirmedCount == packetsConfirm.size();
+        }
+        packetsAckChanged.notify_all();
         if (completeFlag) break;
     }
     t.join();
-    for (auto &tt: senderThreads) tt.join();
+    sender.join();
 
     delete []receiveBuffer;
+    if (stopped) throwIfCancelled();
+    if (failed) {
+        stats.sendFailures.fetch_add(1, memory_order_relaxed);
+        EventTrace::record(TRACE_STATE, traceSocket, failedSeqNumber, 0, messageLength, TRACE_STATE_SEND_FAILED);
+    } else {
+        stats.messagesSent.fetch_add(1, memory_order_relaxed);
+        latency.sendMessage.recordSince(lenStart);
+        EventTrace::record(TRACE_STATE, traceSocket, 0, 0, messageLength, TRACE_STATE_SENT);
+    }
+    if (failed) throw SocketException("Lose connection. Message Seq: " + to_string(failedSeqNumber), true);
 }
 
-void ReliableSocket::sendSinglePacket(unsigned short seqNumber) {
-    auto fpk = getMsgPacket(seqNumber);
-    char *packet = deparsePacket(fpk);
-    for (unsigned int i = 0; i < retryTimes; ++i) {
-        this->send(packet, fpk.bodySize + 6);
-    #ifdef RELIABLE_DEBUG
-        cout << "[Sending message packet]: [" << seqNumber << "] "
-            << string(fpk.packetBody, fpk.bodySize) << " [TIMES:" << i+1 << "]" << endl;
-    #endif
-        this_thread::sleep_for(timeoutInterval);
-        if (packetsConfirm.at(seqNumber)){
-            delete []packet; delete []fpk.packetBody; return;
+void ReliableSocket::sendPacketsWindow() {
+    auto total = packetsBuffer.size();
+    vector<unsigned int> &attempts = packetsAttempts;
+    vector<chrono::steady_clock::time_point> &lastSent = packetsSentAt;
+    size_t windowBase = 0;
+
+    unique_lock<mutex> lock(packetsAckMutex);
+    while (confirmedCount < total) {
+        // TODO: acks that arrive while the lock is released for sending must still wake the wait below
+        auto seenConfirmed = confirmedCount;
+        while (windowBase < total && packetsConfirm.at(windowBase)) ++windowBase;
+        auto now = chrono::steady_clock::now();
+        auto nextDeadline = now + timeoutInterval;
+        unsigned int inFlight = 0;
+        for (size_t i = windowBase; i < total && inFlight < sendWindow; ++i) {
+            if (packetsConfirm.at(i)) continue;
+            ++inFlight;
+            if (attempts[i] != 0 && now - lastSent[i] < timeoutInterval) {
+                nextDeadline = min(nextDeadline, lastSent[i] + timeoutInterval);
+                continue;
+            }
+            if (attempts[i] == retryTimes) {
+                sendFailed = true; failedSeqNumber = i;
+                break;
+            }
+            if (attempts[i] != 0) stats.timeoutRetransmits.fetch_add(1, memory_order_relaxed);
+            ++attempts[i]; lastSent[i] = now;
+            lock.unlock();
+            // TODO: gather the 6 bytes header and the packet body into one datagram, no copy of the body
+            unsigned short header[3];
+            header[0] = (i + 1 < total || messageLength % packetSize == 0) ? packetSize : messageLength % packetSize;
+            header[1] = i;
+            header[2] = MSG_FLAG;
+            EventTrace::record(attempts[i] == 1 ? TRACE_PACKET_SENT : TRACE_RETRANSMIT, traceSocket, header[1], header[2],
+                    sizeof(header) + header[0], attempts[i]);
+            this->send(header, sizeof(header), packetsBuffer.at(i), header[0]);
+            countSent(sizeof(header) + header[0]);
+            lock.lock();
         }
+        if (sendFailed) break;
+        packetsAckChanged.wait_until(lock, nextDeadline, [this, seenConfirmed]{
+            return sendFailed || confirmedCount != seenConfirmed;
+        });
     }
-    delete []packet; delete []fpk.packetBody;
-    throw SocketException("Lose connection. Message Seq: " + to_string(fpk.seqNumber), true);
 }
 
 void ReliableSocket::sendSinglePacket(ReliableSocket::formatPacket fpk, bool &successCheck) {
@@ -473,14 +643,258 @@ void ReliableSocket::sendSinglePacket(ReliableSocket::formatPacket fpk, bool &su
     char *packet = deparsePacket(fpk);
     for (unsigned int i = 0; i < retryTimes; ++i) {
         send(packet, fpk.bodySize + 6);
-    #ifdef RELIABLE_DEBUG
-        cout << "[Send "<< ss.str() << "packet]: "
-            << string(fpk.packetBody, fpk.bodySize) << " [" << i+1 << "] " << endl;
-    #endif
-        this_thread::sleep_for(timeoutInterval);
-        if (successCheck) {delete []packet; return;}
+        countSent(fpk.bodySize + 6);
+        if (i != 0) stats.singleRetransmits.fetch_add(1, memory_order_relaxed);
+        EventTrace::record(i == 0 ? TRACE_PACKET_SENT : TRACE_RETRANSMIT, traceSocket, fpk.seqNumber, fpk.flag,
+                fpk.bodySize + 6, i + 1);
+        unique_lock<mutex> lock(singleAckMutex);
+        if (singleAckChanged.wait_for(lock, timeoutInterval, [&successCheck]{return successCheck;})) {
+            delete []packet; return;
+        }
+    }
+    delete []packet;
+
+    lock_guard<mutex> lock(singleAckMutex);
+    singleFailure = "Lose connection. Sender flag: " + ss.str();
+}
+
+bool ReliableSocket::singlePacketLost(thread &sender) {
+    {
+        lock_guard<mutex> lock(singleAckMutex);
+        if (singleFailure.empty()) return false;
+    }
+    sender.join();
+    return true;
+}
+void ReliableSocket::dropPacket(const formatPacket &fpacket, int receiveSize) {
+    formatPacket answer;
+    // TODO: the peer resends what this side already finished because the answer was lost, answer it again
+    if ((fpacket.flag ^ MSG_FLAG) == 0u) {
+        answer.seqNumber = fpacket.seqNumber;
+        answer.flag = (MSG_FLAG | ACK_FLAG);
+    } else if ((fpacket.flag ^ HAN_FLAG) == 0u && listened) {
+        answer = getHanPacket(handshakeResponse);
+    } else {
+        stats.droppedPackets.fetch_add(1, memory_order_relaxed);
+        EventTrace::record(TRACE_PACKET_DROPPED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize, 0);
+        return;
     }
+    stats.duplicatePackets.fetch_add(1, memory_order_relaxed);
+    EventTrace::record(TRACE_PACKET_RECEIVED, traceSocket, fpacket.seqNumber, fpacket.flag, receiveSize, 0);
+    char *packet = deparsePacket(answer);
+    this->send(packet, answer.bodySize + 6);
+    countSent(answer.bodySize + 6);
+    EventTrace::record(TRACE_PACKET_SENT, traceSocket, answer.seqNumber, answer.flag, answer.bodySize + 6, 1);
     delete []packet;
+    delete []answer.packetBody;
+}
+
+void ReliableSocket::confirmSinglePacket(bool &successCheck) {
+    {
+        lock_guard<mutex> lock(singleAckMutex);
+        successCheck = true;
+    }
+    singleAckChanged.notify_all();
+}
+
+void ReliableSocket::countSent(int datagramSize) {
+    stats.packetsSent.fetch_add(1, memory_order_relaxed);
+    stats.bytesSent.fetch_add(datagramSize, memory_order_relaxed);
+}
+
+void ReliableSocket::countReceived(int datagramSize) {
+    stats.packetsReceived.fetch_add(1, memory_order_relaxed);
+    stats.bytesReceived.fetch_add(datagramSize, memory_order_relaxed);
+}
+
+void ReliableSocket::addRttSample(chrono::steady_clock::duration rtt) {
+    unsigned long long sample = chrono::duration_cast<chrono::microseconds>(rtt).count();
+    unsigned long long seen = stats.rttMin.load(memory_order_relaxed);
+    while (sample < seen && !stats.rttMin.compare_exchange_weak(seen, sample, memory_order_relaxed)) {}
+    seen = stats.rttMax.load(memory_order_relaxed);
+    while (sample > seen && !stats.rttMax.compare_exchange_weak(seen, sample, memory_order_relaxed)) {}
+    stats.rttLast.store(sample, memory_order_relaxed);
+    latency.packetAck.record(rtt);
+    stats.rttSum.fetch_add(sample, memory_order_relaxed);
+    stats.rttSamples.fetch_add(1, memory_order_relaxed);
+}
+
+future<void> ReliableSocket::sendMessageAsync(const char *message, unsigned int mLength) {
+    auto completed = make_shared<promise<void>>();
+    sendMessageAsync(message, mLength, [completed](exception_ptr error){
+        if (error) completed->set_exception(error);
+        else completed->set_value();
+    });
+    return completed->get_future();
+}
+
+future<unsigned int> ReliableSocket::receiveMessageAsync(char *destBuffer, unsigned int destBufferSize) {
+    auto completed = make_shared<promise<unsigned int>>();
+    receiveMessageAsync(destBuffer, destBufferSize, [completed](unsigned int mLength, exception_ptr error){
+        if (error) completed->set_exception(error);
+        else completed->set_value(mLength);
+    });
+    return completed->get_future();
+}
+
+void ReliableSocket::sendMessageAsync(const char *message, unsigned int mLength,
+        function<void(exception_ptr)> completion) {
+    runAsync([this, message, mLength, completion]{
+        exception_ptr error;
+        try {
+            // TODO: virtual sendMessage, the secure layer encrypts the caller's buffer where it lies
+            setPacketsView(message, mLength);
+            sendMessage();
+        } catch (...) {
+            error = current_exception();
+        }
+        if (completion) completion(error);
+    });
+}
 
-    throw SocketException("Lose connection. Sender flag: " + ss.str(), true);
-}
\ No newline at end of file
+void ReliableSocket::receiveMessageAsync(char *destBuffer, unsigned int destBufferSize,
+        function<void(unsigned int, exception_ptr)> completion) {
+    runAsync([this, destBuffer, destBufferSize, completion]{
+        exception_ptr error;
+        unsigned int mLength = 0;
+        try {
+            receiveMessage();
+            readMessage(destBuffer, destBufferSize);
+            mLength = getMessageLength();
+        } catch (...) {
+            error = current_exception();
+        }
+        if (completion) completion(mLength, error);
+    });
+}
+
+void ReliableSocket::setExecutor(shared_ptr<ThreadPool> pool) {
+    lock_guard<mutex> lock(asyncMutex);
+    if (asyncRunning) throw SocketException("Can't change the executor while async operations are queued.", false);
+    executor = move(pool);
+}
+
+void ReliableSocket::runAsync(function<void()> operation) {
+    shared_ptr<ThreadPool> pool;
+    {
+        lock_guard<mutex> lock(asyncMutex);
+        asyncOperations.push(move(operation));
+        if (asyncRunning) return;
+        asyncRunning = true;
+        if (!executor) executor = make_shared<ThreadPool>(1);
+        pool = executor;
+    }
+    pool->submit([this]{runNextAsync();});
+}
+
+void ReliableSocket::runNextAsync() {
+    function<void()> operation;
+    shared_ptr<bool> alive;
+    {
+        lock_guard<mutex> lock(asyncMutex);
+        operation = move(asyncOperations.front());
+        asyncOperations.pop();
+        asyncThread = this_thread::get_id();
+        alive = asyncAlive;
+    }
+    operation();
+    // TODO: the completion callback destroyed this socket, nothing of it is left to touch
+    if (!*alive) return;
+    shared_ptr<ThreadPool> pool;
+    {
+        lock_guard<mutex> lock(asyncMutex);
+        asyncThread = thread::id();
+        if (asyncOperations.empty()) {
+            asyncRunning = false;
+            asyncIdle.notify_all();
+            return;
+        }
+        pool = executor;
+    }
+    // TODO: back of the pool queue, the other sockets of a shared executor get their turn
+    pool->submit([this]{runNextAsync();});
+}
+
+void ReliableSocket::cancel() {
+    cancelled = true;
+}
+
+void ReliableSocket::throwIfCancelled() const {
+    if (cancelled) throw SocketException("Socket cancelled, its operations were stopped.", false);
+}
+
+void ReliableSocket::waitAsyncOperations() {
+    // TODO: a receive queued before the send its peer waits for would block forever, stop it within timeoutInterval
+    cancel();
+    unique_lock<mutex> lock(asyncMutex);
+    if (asyncRunning && asyncThread == this_thread::get_id()) {
+        // TODO: destroyed by its own completion callback, waiting for that operation would never end
+        *asyncAlive = false;
+        queue<function<void()>>().swap(asyncOperations);
+        // a pool can't join the worker running this, another thread releases it once the callback returned
+        if (executor) thread([](shared_ptr<ThreadPool> pool){pool.reset();}, move(executor)).detach();
+        return;
+    }
+    asyncIdle.wait(lock, [this]{return !asyncRunning;});
+}
+
+void ReliableSocket::collectMetrics(MetricsExporter::sample &metrics) const {
+    auto snapshot = getStats();
+    metrics.gauge("tlsudp_reliable_sockets", "Open reliable sockets.", 1);
+    metrics.counter("tlsudp_reliable_packets_sent_total", "Datagrams sent.", snapshot.packetsSent);
+    metrics.counter("tlsudp_reliable_sent_bytes_total", "Bytes of the datagrams sent.", snapshot.bytesSent);
+    metrics.counter("tlsudp_reliable_packets_received_total", "Datagrams received.", snapshot.packetsReceived);
+    metrics.counter("tlsudp_reliable_received_bytes_total", "Bytes of the datagrams received.", snapshot.bytesReceived);
+    metrics.counter("tlsudp_reliable_messages_sent_total", "Messages sent.", snapshot.messagesSent);
+    metrics.counter("tlsudp_reliable_messages_received_total", "Messages received.", snapshot.messagesReceived);
+    metrics.counter("tlsudp_reliable_timeout_retransmits_total", "Message packets resent after timeoutInterval.",
+            snapshot.timeoutRetransmits);
+    metrics.counter("tlsudp_reliable_single_retransmits_total", "Handshake and length packets resent.",
+            snapshot.singleRetransmits);
+    metrics.counter("tlsudp_reliable_send_failures_total", "Messages given up after retryTimes.", snapshot.sendFailures);
+    metrics.counter("tlsudp_reliable_duplicate_packets_total", "Packets or acks already confirmed.",
+            snapshot.duplicatePackets);
+    metrics.counter("tlsudp_reliable_dropped_packets_total", "Packets whose flag or sequence number wasn't expected.",
+            snapshot.droppedPackets);
+    metrics.histogram("tlsudp_reliable_handshake_seconds", "Handshake packet exchange.", latency.handshake);
+    metrics.histogram("tlsudp_reliable_send_message_seconds", "Whole sendMessage.", latency.sendMessage);
+    metrics.histogram("tlsudp_reliable_receive_message_seconds", "receiveMessage from its length packet on.",
+            latency.receiveMessage);
+    metrics.histogram("tlsudp_reliable_packet_ack_seconds", "Message packet to its ack, first attempts only.",
+            latency.packetAck);
+    if (!impairment) return;
+    // TODO: what the emulated link did, only sockets with an impairment export these
+    auto link = impairment->getCounters();
+    metrics.counter("tlsudp_impairment_datagrams_total", "Datagrams passed through the emulated link.", link.datagrams);
+    metrics.counter("tlsudp_impairment_lost_total", "Datagrams lost by the link, bursts included.", link.lost);
+    metrics.counter("tlsudp_impairment_burst_lost_total", "Datagrams lost in a loss burst.", link.burstLost);
+    metrics.counter("tlsudp_impairment_queue_dropped_total", "Datagrams dropped by the full link queue.",
+            link.queueDropped);
+    metrics.counter("tlsudp_impairment_delayed_total", "Datagrams held back by delay or bandwidth.", link.delayed);
+    metrics.counter("tlsudp_impairment_reordered_total", "Datagrams held back an extra reorderDelay.", link.reordered);
+    metrics.counter("tlsudp_impairment_duplicated_total", "Datagrams sent twice.", link.duplicated);
+}
+
+ReliableSocket::transportStats ReliableSocket::getStats() const {
+    transportStats snapshot;
+    snapshot.packetsSent = stats.packetsSent.load(memory_order_relaxed);
+    snapshot.bytesSent = stats.bytesSent.load(memory_order_relaxed);
+    snapshot.packetsReceived = stats.packetsReceived.load(memory_order_relaxed);
+    snapshot.bytesReceived = stats.bytesReceived.load(memory_order_relaxed);
+    snapshot.messagesSent = stats.messagesSent.load(memory_order_relaxed);
+    snapshot.messagesReceived = stats.messagesReceived.load(memory_order_relaxed);
+    snapshot.timeoutRetransmits = stats.timeoutRetransmits.load(memory_order_relaxed);
+    snapshot.singleRetransmits = stats.singleRetransmits.load(memory_order_relaxed);
+    snapshot.sendFailures = stats.sendFailures.load(memory_order_relaxed);
+    snapshot.duplicatePackets = stats.duplicatePackets.load(memory_order_relaxed);
+    snapshot.droppedPackets = stats.droppedPackets.load(memory_order_relaxed);
+    snapshot.rttSamples = stats.rttSamples.load(memory_order_relaxed);
+    snapshot.rttSum = stats.rttSum.load(memory_order_relaxed);
+    snapshot.rttMin = snapshot.rttSamples == 0 ? 0 : stats.rttMin.load(memory_order_relaxed);
+    snapshot.rttMax = stats.rttMax.load(memory_order_relaxed);
+    snapshot.rttLast = stats.rttLast.load(memory_order_relaxed);
+    snapshot.connectDuration = stats.connectDuration.load(memory_order_relaxed);
+    snapshot.lenHandshakes = stats.lenHandshakes.load(memory_order_relaxed);
+    snapshot.lenHandshakeSum = stats.lenHandshakeSum.load(memory_order_relaxed);
+    return snapshot;
+}
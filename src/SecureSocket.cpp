@@ -10,13 +10,64 @@
 #include <time.h>
 #include <assert.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>    // HKDF, AES-GCM ticket
+#include <openssl/kdf.h>    // EVP_PKEY_CTX_set_hkdf_md
+#include <openssl/rand.h>   // RAND_bytes
+#include <openssl/crypto.h> // OPENSSL_cleanse
+#include <fstream>          // sessionTicketFile
+#include <sys/stat.h>       // chmod
+#include "json/json.h"      // sessionTicketFile format
 #include <cstring>
 #include <string>
+#include <random>       // random_device
+#include <deque>        // deque<future<string>> sealing
+#include <algorithm>    // min
 
 #define PUB_FLAG 0x80u
 #define SEC_FLAG 0x40u
+#define RESUME_TICKET 0x01u
+#define EARLY_DATA 0x02u
+
+/**
+ * Message mode in the encrypted length message: [length 4 bytes][mode][record cipher][2 unused][record size 4 bytes]
+ */
+#define CBC_MESSAGE 0x00u
+#define AEAD_RECORDS 0x01u
+#define RECORD_AES_GCM 0x01u
+#define RECORD_CHACHA20 0x02u
+// key material only, everything else is traced by EventTrace: never define it in production builds
 //#define SECURE_DEBUG
 
+map<string, SecureSocket::sessionTicket> SecureSocket::ticketCache;
+mutex SecureSocket::ticketMutex;
+map<string, long long> SecureSocket::earlyDataStrikes;
+mutex SecureSocket::strikeMutex;
+
+/**
+ * Process wide key sealing session tickets, tickets die with the server process.
+ */
+static const unsigned char *processTicketKey() {
+    static unsigned char key[32];
+    static once_flag keyFlag;
+    call_once(keyFlag, []{
+        if (RAND_bytes(key, sizeof(key)) != 1) throw SocketException("Can't generate session ticket key.");
+    });
+    return key;
+}
+
+static string toHex(const string &bytes) {
+    static const char *digits = "0123456789abcdef";
+    string hex;
+    for (unsigned char c: bytes) {hex.push_back(digits[c >> 4u]); hex.push_back(digits[c & 0xfu]);}
+    return hex;
+}
+
+static string fromHex(const string &hex) {
+    string bytes;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) bytes.push_back((char)stoi(hex.substr(i, 2), nullptr, 16));
+    return bytes;
+}
+
 void SecureSocket::getPublicPacket(char *destBuffer, unsigned int destSize) const {
     for(unsigned int i = 0; i < destSize; ++i) destBuffer[i] = 0x00;
     assert(destSize >= 2*(primeBitsLength/8) + 4);
@@ -42,24 +93,41 @@ void SecureSocket::parsePublicPacket(const char *srcBuffer){
 
     mpz_import(publicPrimeG, primeBitsLength/8, -1, sizeof(char), -1, 0, srcBuffer + 4);
     mpz_import(publicPrimeP, primeBitsLength/8, -1, sizeof(char), -1, 0, srcBuffer + (primeBitsLength/8) + 4);
+    keyPool.reset();
 #ifdef SECURE_DEBUG
     cout << "[Sync server prime] G:" << publicPrimeG << endl;
     cout << "[Sync server prime] P:" << publicPrimeP << endl;
 #endif
 }
 
+void SecureSocket::prepareEphemeralKey() {
+    // TODO: client side only owns a pool if this process is also serving the same g and p
+    if (!keyPool) keyPool = EphemeralKeyPool::find(publicPrimeG, publicPrimeP);
+    if (keyPool) {
+        keyPool->take(privateXNumber, publicGXNumber);
+    } else {
+        gmp_randstate_t r_state;
+        gmp_randinit_default(r_state);
+        random_device seed;
+        gmp_randseed_ui(r_state, ((unsigned long)seed() << 32u) ^ seed());
+        mpz_urandomm(privateXNumber, r_state, publicPrimeP);
+        mpz_powm(publicGXNumber, publicPrimeG, privateXNumber, publicPrimeP);
+        gmp_randclear(r_state);
+    }
+#ifdef SECURE_DEBUG
+    cout << "[Grab private] X:" << privateXNumber << endl;
+#endif
+}
+
 void SecureSocket::getPrivatePacket(char *destBuffer, unsigned int destSize) const {
     for(unsigned int i = 0; i < destSize; ++i) destBuffer[i] = 0x00;
     assert(destSize >= (primeBitsLength/8) + 4);
     *((unsigned short*)destBuffer) = (primeBitsLength/8);
     *((unsigned short*)destBuffer + 1) = SEC_FLAG;
 
-    mpz_t gxp; mpz_init(gxp);
-    mpz_powm(gxp, publicPrimeG, privateXNumber, publicPrimeP);
     size_t writenSize;
-    mpz_export(destBuffer+4, &writenSize, -1, sizeof(char), -1, 0, gxp);
+    mpz_export(destBuffer+4, &writenSize, -1, sizeof(char), -1, 0, publicGXNumber);
     assert(writenSize <= primeBitsLength/8);
-    mpz_clear(gxp);
 }
 
 void SecureSocket::parsePrivatePacket(const char *srcBuffer) {
@@ -82,6 +150,246 @@ void SecureSocket::parsePrivatePacket(const char *srcBuffer) {
 #endif
 }
 
+void SecureSocket::exportKeyMaterial(unsigned char *destBuffer) const {
+    memset(destBuffer, 0, primeBitsLength/8);
+    size_t writenSize;
+    mpz_export(destBuffer, &writenSize, -1, sizeof(unsigned char), -1, 0, exchangedKey);
+    assert(writenSize <= primeBitsLength/8);
+}
+
+void SecureSocket::deriveResumptionSecret() {
+    auto material = new unsigned char [primeBitsLength/8];
+    exportKeyMaterial(material);
+    hkdf(material, primeBitsLength/8, nullptr, 0, "tlsudp resumption", resumptionSecret, RESUMPTION_SECRET_SIZE);
+    memset(material, 0, primeBitsLength/8);
+    delete []material;
+}
+
+void SecureSocket::deriveResumedKey(const unsigned char *secret, const string &clientNonce,
+        const string &serverNonce) {
+    string salt = clientNonce + serverNonce;
+    auto material = new unsigned char [primeBitsLength/8];
+    hkdf(secret, RESUMPTION_SECRET_SIZE, reinterpret_cast<const unsigned char *>(salt.c_str()), salt.size(),
+            "tlsudp resumed key", material, primeBitsLength/8);
+    mpz_import(exchangedKey, primeBitsLength/8, -1, sizeof(unsigned char), -1, 0, material);
+    memset(material, 0, primeBitsLength/8);
+    delete []material;
+    deriveResumptionSecret();
+#ifdef SECURE_DEBUG
+    cout << "[Resume key] HKDF:" << exchangedKey << endl;
+#endif
+}
+
+string SecureSocket::aeadSeal(const EVP_CIPHER *cipher, const unsigned char *key, const unsigned char *iv,
+        const string &aad, const unsigned char *plaintext, unsigned int plainSize) {
+    return aeadSeal(cipher, key, iv, aad, {{plaintext, plainSize}}, plainSize);
+}
+
+string SecureSocket::aeadSeal(const EVP_CIPHER *cipher, const unsigned char *key, const unsigned char *iv,
+        const string &aad, const vector<messageView> &parts, unsigned int plainSize) {
+    string sealed(plainSize + 16, '\0');
+    auto out = reinterpret_cast<unsigned char *>(&sealed[0]);
+    int outLen = 0, finalLen = 0, sealedLen = 0;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    bool success = ctx != nullptr
+            && EVP_EncryptInit_ex(ctx, cipher, nullptr, key, iv) == 1
+            && (aad.empty() || EVP_EncryptUpdate(ctx, nullptr, &outLen,
+                    reinterpret_cast<const unsigned char *>(aad.c_str()), aad.size()) == 1);
+    for (auto &part: parts) {
+        success = success && EVP_EncryptUpdate(ctx, out + sealedLen, &outLen, part.data, part.size) == 1;
+        sealedLen += outLen;
+    }
+    success = success
+            && EVP_EncryptFinal_ex(ctx, out + sealedLen, &finalLen) == 1
+            && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, 16, out + plainSize) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    if (!success) throw SocketException("AEAD sealing failed.");
+    return sealed;
+}
+
+bool SecureSocket::aeadOpen(const EVP_CIPHER *cipher, const unsigned char *key, const unsigned char *iv,
+        const string &aad, const unsigned char *sealed, unsigned int sealedSize, unsigned char *plaintext) {
+    if (sealedSize < 16) return false;
+    unsigned int plainSize = sealedSize - 16;
+    unsigned char tag[16];
+    memcpy(tag, sealed + plainSize, 16);
+    int outLen = 0, finalLen = 0;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    bool success = ctx != nullptr
+            && EVP_DecryptInit_ex(ctx, cipher, nullptr, key, iv) == 1
+            && (aad.empty() || EVP_DecryptUpdate(ctx, nullptr, &outLen,
+                    reinterpret_cast<const unsigned char *>(aad.c_str()), aad.size()) == 1)
+            && EVP_DecryptUpdate(ctx, plaintext, &outLen, sealed, plainSize) == 1
+            && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, 16, tag) == 1
+            && EVP_DecryptFinal_ex(ctx, plaintext + outLen, &finalLen) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    return success;
+}
+
+string SecureSocket::sealTicket() const {
+    unsigned char plain[8 + RESUMPTION_SECRET_SIZE];
+    *((long long*)plain) = (long long)time(0);
+    memcpy(plain + 8, resumptionSecret, RESUMPTION_SECRET_SIZE);
+    string iv = randomBytes(12);
+    string sealed = aeadSeal(EVP_aes_256_gcm(), processTicketKey(), reinterpret_cast<const unsigned char *>(iv.c_str()), "",
+            plain, sizeof(plain));
+    memset(plain, 0, sizeof(plain));
+    return iv + sealed;
+}
+
+bool SecureSocket::openTicket(const string &ticket, unsigned char *secret) const {
+    if (ticket.size() != SESSION_TICKET_SIZE) return false;
+    auto sealed = reinterpret_cast<const unsigned char *>(ticket.c_str());
+    unsigned char plain[8 + RESUMPTION_SECRET_SIZE];
+    if (!aeadOpen(EVP_aes_256_gcm(), processTicketKey(), sealed, "", sealed + 12, SESSION_TICKET_SIZE - 12, plain)) return false;
+
+    long long issued = *((long long*)plain), now = time(0);
+    if (issued > now + 60 || now - issued > (long long)sessionTicketLifetime) return false;
+    memcpy(secret, plain + 8, RESUMPTION_SECRET_SIZE);
+    memset(plain, 0, sizeof(plain));
+    return true;
+}
+
+string SecureSocket::sealEarlyData(const unsigned char *secret, const string &clientNonce, const string &aad) const {
+    unsigned char keyiv[32 + 12];
+    hkdf(secret, RESUMPTION_SECRET_SIZE, reinterpret_cast<const unsigned char *>(clientNonce.c_str()),
+            clientNonce.size(), "tlsudp early data", keyiv, sizeof(keyiv));
+    string sealed = aeadSeal(EVP_aes_256_gcm(), keyiv, keyiv + 32, aad,
+            reinterpret_cast<const unsigned char *>(earlyData.c_str()), earlyData.size());
+    memset(keyiv, 0, sizeof(keyiv));
+    return sealed;
+}
+
+bool SecureSocket::openEarlyData(const unsigned char *secret, const string &clientNonce, const string &aad,
+        const string &sealed) {
+    unsigned char keyiv[32 + 12];
+    hkdf(secret, RESUMPTION_SECRET_SIZE, reinterpret_cast<const unsigned char *>(clientNonce.c_str()),
+            clientNonce.size(), "tlsudp early data", keyiv, sizeof(keyiv));
+    string plain(sealed.size() - 16, '\0');
+    bool success = aeadOpen(EVP_aes_256_gcm(), keyiv, keyiv + 32, aad, reinterpret_cast<const unsigned char *>(sealed.c_str()),
+            sealed.size(), reinterpret_cast<unsigned char *>(&plain[0]));
+    memset(keyiv, 0, sizeof(keyiv));
+    if (success) earlyData = plain;
+    return success;
+}
+
+bool SecureSocket::checkReplayWindow(const string &clientNonce, long long clientTime) const {
+    long long now = time(0);
+    if (clientTime > now + (long long)earlyDataReplayWindow || now - clientTime > (long long)earlyDataReplayWindow)
+        return false;
+    lock_guard<mutex> lock(strikeMutex);
+    // TODO: forget nonces old enough to be rejected by the time check anyway
+    for (auto it = earlyDataStrikes.begin(); it != earlyDataStrikes.end();) {
+        if (now - it->second > 2 * (long long)earlyDataReplayWindow) it = earlyDataStrikes.erase(it);
+        else ++it;
+    }
+    return earlyDataStrikes.emplace(clientNonce, now).second;
+}
+
+bool SecureSocket::takeTicket(const string &serverName, SecureSocket::sessionTicket &ticket) {
+    lock_guard<mutex> lock(ticketMutex);
+    if (!sessionTicketFile.empty()) loadTicketFile();
+    auto it = ticketCache.find(serverName);
+    if (it == ticketCache.end()) return false;
+    // TODO: tickets are single use, the server hands a new one on every resumption
+    ticket = it->second;
+    ticketCache.erase(it);
+    if (!sessionTicketFile.empty()) saveTicketFile();
+    return time(0) - ticket.received <= (long long)sessionTicketLifetime;
+}
+
+void SecureSocket::storeTicket(const string &serverName, const string &ticket) {
+    lock_guard<mutex> lock(ticketMutex);
+    if (!sessionTicketFile.empty()) loadTicketFile();
+    sessionTicket &entry = ticketCache[serverName];
+    entry.ticket = ticket;
+    entry.secret = string(reinterpret_cast<char *>(resumptionSecret), RESUMPTION_SECRET_SIZE);
+    entry.received = time(0);
+    if (!sessionTicketFile.empty()) saveTicketFile();
+}
+
+void SecureSocket::loadTicketFile() {
+    ifstream ticketFile(sessionTicketFile);
+    if (!ticketFile.is_open()) return;
+    Json::Value ticketsValue;
+    Json::CharReaderBuilder ticketBuilder;
+    string parsingErrors;
+    if (!Json::parseFromStream(ticketBuilder, ticketFile, &ticketsValue, &parsingErrors)) return;
+    for (auto &name: ticketsValue.getMemberNames()) {
+        sessionTicket &entry = ticketCache[name];
+        entry.ticket = fromHex(ticketsValue[name]["ticket"].asString());
+        entry.secret = fromHex(ticketsValue[name]["secret"].asString());
+        entry.received = ticketsValue[name]["received"].asInt64();
+    }
+}
+
+void SecureSocket::saveTicketFile() const {
+    Json::Value ticketsValue(Json::objectValue);
+    for (auto &entry: ticketCache) {
+        ticketsValue[entry.first]["ticket"] = toHex(entry.second.ticket);
+        ticketsValue[entry.first]["secret"] = toHex(entry.second.secret);
+        ticketsValue[entry.first]["received"] = (Json::Int64)entry.second.received;
+    }
+    ofstream ticketFile(sessionTicketFile, ios::trunc);
+    if (!ticketFile.is_open()) return;
+    chmod(sessionTicketFile.c_str(), S_IRUSR | S_IWUSR);
+    Json::StreamWriterBuilder ticketWriter;
+    ticketFile << Json::writeString(ticketWriter, ticketsValue);
+}
+
+void SecureSocket::hkdf(const unsigned char *secret, size_t secretLen, const unsigned char *salt, size_t saltLen,
+        const string &info, unsigned char *destBuffer, size_t destSize) {
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+    bool success = ctx != nullptr
+            && EVP_PKEY_derive_init(ctx) > 0
+            && EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) > 0
+            && (saltLen == 0 || EVP_PKEY_CTX_set1_hkdf_salt(ctx, salt, saltLen) > 0)
+            && EVP_PKEY_CTX_set1_hkdf_key(ctx, secret, secretLen) > 0
+            && EVP_PKEY_CTX_add1_hkdf_info(ctx, reinterpret_cast<const unsigned char *>(info.c_str()), info.size()) > 0
+            && EVP_PKEY_derive(ctx, destBuffer, &destSize) > 0;
+    EVP_PKEY_CTX_free(ctx);
+    if (!success) throw SocketException("HKDF derivation failed: " + info);
+}
+
+string SecureSocket::randomBytes(size_t size) {
+    string bytes(size, '\0');
+    if (RAND_bytes(reinterpret_cast<unsigned char *>(&bytes[0]), size) != 1)
+        throw SocketException("Can't generate random bytes.");
+    return bytes;
+}
+
+string SecureSocket::acceptHandshake(const string &request) {
+    resumedSession = false; earlyDataAccepted = false; earlyData.clear();
+    const unsigned int ticketEnd = 1 + HANDSHAKE_NONCE_SIZE + SESSION_TICKET_SIZE;
+    if (sessionTicketLifetime == 0 || request.size() < ticketEnd
+        || ((unsigned char)request[0] & RESUME_TICKET) == 0u) return "";
+
+    unsigned char secret[RESUMPTION_SECRET_SIZE];
+    if (!openTicket(request.substr(1 + HANDSHAKE_NONCE_SIZE, SESSION_TICKET_SIZE), secret)) {
+        EventTrace::record(TRACE_RESUME, traceSocket, 0, 0, 0, TRACE_RESUME_REJECTED);
+        return "";
+    }
+    string clientNonce = request.substr(1, HANDSHAKE_NONCE_SIZE), serverNonce = randomBytes(HANDSHAKE_NONCE_SIZE);
+
+    // TODO: 0-RTT -- [client time 8 bytes][sealed early data], client time and ticket are authenticated
+    if (((unsigned char)request[0] & EARLY_DATA) != 0u && request.size() >= ticketEnd + 8 + 16) {
+        long long clientTime = *((long long*)(request.c_str() + ticketEnd));
+        if (request.size() - ticketEnd - 8 - 16 <= maxEarlyDataSize
+            && openEarlyData(secret, clientNonce, request.substr(0, ticketEnd + 8), request.substr(ticketEnd + 8))
+            && checkReplayWindow(clientNonce, clientTime)) {
+            earlyDataAccepted = true;
+        } else earlyData.clear();
+    }
+
+    deriveResumedKey(secret, clientNonce, serverNonce);
+    memset(secret, 0, RESUMPTION_SECRET_SIZE);
+    resumedSession = true;
+    EventTrace::record(TRACE_RESUME, traceSocket, 0, 0, earlyData.size(),
+            earlyDataAccepted ? TRACE_RESUME_EARLY_DATA : TRACE_RESUME_ACCEPTED);
+    unsigned char responseFlag = RESUME_TICKET | (earlyDataAccepted ? EARLY_DATA : 0u);
+    return string(1, (char)responseFlag) + serverNonce + sealTicket();
+}
+
 SecureSocket::SecureSocket(const char *configPath) : ReliableSocket(){
     loadConfig(configPath);
 }
@@ -95,14 +403,27 @@ SecureSocket::SecureSocket(const string &localAddress, unsigned short localPort,
 }
 
 SecureSocket::~SecureSocket() {
+    // TODO: queued async operations run the overridden sendMessage & receiveMessage on this layer
+    waitAsyncOperations();
+    if (secureMetricsCollector != 0) MetricsExporter::removeCollector(secureMetricsCollector);
+    // TODO: OPENSSL_cleanse isn't optimised away like a memset of a dying object
+    for (auto state: {&sendTraffic, &receiveTraffic}) {
+        OPENSSL_cleanse(state->secret, sizeof(state->secret));
+        OPENSSL_cleanse(state->key, sizeof(state->key));
+        OPENSSL_cleanse(state->iv, sizeof(state->iv));
+        OPENSSL_cleanse(&state->aesKey, sizeof(state->aesKey));
+    }
+    EphemeralKeyPool::wipe(privateXNumber);
+    EphemeralKeyPool::wipe(exchangedKey);
     mpz_clear(publicPrimeP);
     mpz_clear(publicPrimeG);
     mpz_clear(privateXNumber);
+    mpz_clear(publicGXNumber);
     mpz_clear(exchangedKey);
 }
 
 Json::Value SecureSocket::loadConfig(const char *configPath) {
-    mpz_inits(publicPrimeP, publicPrimeG, privateXNumber, exchangedKey, NULL);
+    mpz_inits(publicPrimeP, publicPrimeG, privateXNumber, publicGXNumber, exchangedKey, NULL);
     // TODO: initialize random requirement
     gmp_randstate_t r_state;
     gmp_randinit_default(r_state);
@@ -118,6 +439,27 @@ Json::Value SecureSocket::loadConfig(const char *configPath) {
     for(auto c: {128, 192, 256}) if(aesKeyBitsLength == c) flag = false;
     if (flag) throw SocketException("Please chose aes key length from 128,192,256.");
 
+    sessionTicketLifetime = configVal.get("sessionTicketLifetime", 3600).asUInt();
+    sessionTicketFile = configVal.get("sessionTicketFile", "").asString();
+    maxEarlyDataSize = configVal.get("maxEarlyDataSize", 1024).asUInt();
+    earlyDataReplayWindow = configVal.get("earlyDataReplayWindow", 10).asUInt();
+    parallelThreshold = configVal.get("parallelThreshold", 1u << 20u).asUInt();
+    recordSize = configVal.get("recordSize", 1u << 18u).asUInt();
+    cryptoThreads = configVal.get("cryptoThreads", 0).asUInt();
+    string cipherName = configVal.get("recordCipher", "aes-gcm").asString();
+    if (cipherName == "aes-gcm") recordCipherId = RECORD_AES_GCM;
+    else if (cipherName == "chacha20-poly1305") recordCipherId = RECORD_CHACHA20;
+    else throw SocketException("Please chose record cipher from aes-gcm, chacha20-poly1305.");
+    if (recordSize == 0) throw SocketException("Please provide a positive recordSize.");
+    rekeyRecordLimit = configVal.get("rekeyRecordLimit", 1u << 24u).asUInt64();
+    rekeyByteLimit = configVal.get("rekeyByteLimit", 1u << 30u).asUInt64();
+    if (rekeyRecordLimit == 0 || rekeyByteLimit == 0)
+        throw SocketException("Please provide positive rekeyRecordLimit and rekeyByteLimit.");
+    precomputePoolSize = configVal.get("precomputePoolSize", 16).asUInt();
+    fixedBaseWindowBits = configVal.get("fixedBaseWindowBits", 6).asUInt();
+    if (fixedBaseWindowBits < 1 || fixedBaseWindowBits > 12)
+        throw SocketException("Please chose fixedBaseWindowBits between 1 and 12.");
+
     mpz_set_str(publicPrimeG, configVal.get("publicPrimeG", "65537").asCString(), 10);
     if(mpz_probab_prime_p(publicPrimeG, 10) == 0){
         stringstream ss;
@@ -128,6 +470,7 @@ Json::Value SecureSocket::loadConfig(const char *configPath) {
     mpz_set_str(publicPrimeP, configVal.get("publicPrimeP", "0").asCString(), 10);
     if (mpz_cmp_ui(publicPrimeP, 0) == 0) {
         // TODO: generate 1024 bits random number as publicPrimeP
+        generatedPrime = true;
         mpz_urandomb(publicPrimeP, r_state, primeBitsLength);
         mpz_nextprime(publicPrimeP, publicPrimeP);
     } else if (mpz_probab_prime_p(publicPrimeP, 10) == 0){
@@ -136,18 +479,58 @@ Json::Value SecureSocket::loadConfig(const char *configPath) {
         throw SocketException(ss.str());
     }
 
-    mpz_urandomm(privateXNumber, r_state, publicPrimeP);
 #ifdef SECURE_DEBUG
     cout << "[Set public prime] G:" << publicPrimeG << endl;
     cout << "[Set public prime] P:" << publicPrimeP << endl;
-    cout << "[Grab private] X:" << privateXNumber << endl;
 #endif
     gmp_randclear(r_state);
+    // TODO: the reliable layer started the exporter if the config asks for it
+    if (MetricsExporter::start(0, "", 0) && secureMetricsCollector == 0) {
+        static once_flag keyPoolCollector;
+        call_once(keyPoolCollector, []{MetricsExporter::addCollector(collectKeyPoolMetrics);});
+        secureMetricsCollector = MetricsExporter::addCollector([this](MetricsExporter::sample &metrics){
+            collectSecureMetrics(metrics);
+        });
+    }
     return configVal;
 }
 
+void SecureSocket::collectSecureMetrics(MetricsExporter::sample &metrics) const {
+    metrics.gauge("tlsudp_secure_sockets", "Open secure sockets.", 1);
+    metrics.histogram("tlsudp_secure_key_exchange_seconds", "Whole key exchange, resumed or not.",
+            secureLatency.keyExchange);
+    metrics.histogram("tlsudp_secure_send_message_seconds", "Whole encrypted sendMessage.", secureLatency.sendMessage);
+    metrics.histogram("tlsudp_secure_receive_message_seconds", "Encrypted receiveMessage from its length message on.",
+            secureLatency.receiveMessage);
+    metrics.histogram("tlsudp_secure_seal_record_seconds", "Encryption of one CBC message or AEAD record.",
+            secureLatency.sealRecord);
+    metrics.histogram("tlsudp_secure_open_record_seconds", "Decryption of one CBC message or AEAD record.",
+            secureLatency.openRecord);
+}
+
+void SecureSocket::collectKeyPoolMetrics(MetricsExporter::sample &metrics) {
+    auto usage = EphemeralKeyPool::usage();
+    metrics.gauge("tlsudp_key_pools", "Live precomputed ephemeral key pools.", usage.pools);
+    metrics.gauge("tlsudp_key_pool_ready", "Precomputed ephemeral key pairs ready to be taken.", usage.ready);
+    metrics.gauge("tlsudp_key_pool_capacity", "Ephemeral key pairs the pools keep ready.", usage.capacity);
+    metrics.gauge("tlsudp_key_pool_taken", "Key pairs taken from the live pools.", usage.taken);
+    metrics.gauge("tlsudp_key_pool_drained", "Takes of the live pools that computed the pair inline.", usage.drained);
+}
+
 void SecureSocket::startListen(){
+    // TODO: STEP0 -- start filling the key pool while waiting for the client
+    // TODO: a table & pool for a prime of this socket only would cost more than the one exponentiation it saves
+    if (!keyPool && precomputePoolSize > 0 && !generatedPrime)
+        keyPool = EphemeralKeyPool::acquire(publicPrimeG, publicPrimeP, precomputePoolSize, fixedBaseWindowBits);
+    isServerSide = true;
     ReliableSocket::startListen();
+    // TODO: the client presented a valid ticket within the handshake packet, skip DH
+    if (resumedSession) {
+        deriveTrafficKeys();
+        secureLatency.keyExchange.recordSince(handshakeStart);
+        return;
+    }
+    prepareEphemeralKey();
     // TODO: STEP1 -- Send public message to client side.
     char* pubpacket = new char [(primeBitsLength/8)*2 + 4];
     getPublicPacket(pubpacket, (primeBitsLength/8)*2 + 4);
@@ -160,22 +543,66 @@ void SecureSocket::startListen(){
     this->readMessage(prvmessage, messageLength + 1);
     parsePrivatePacket(prvmessage);
     delete []prvmessage;
-    // TODO: STEP3 -- Send private back
-    char* prvpacket = new char [(primeBitsLength/8) + 4];
+    // TODO: STEP3 -- Send private back, followed by a session ticket for the next connection
+    string ticket;
+    if (sessionTicketLifetime > 0) {
+        deriveResumptionSecret();
+        ticket = sealTicket();
+    }
+    unsigned int prvSize = (primeBitsLength/8) + 4 + ticket.size();
+    char* prvpacket = new char [prvSize];
     getPrivatePacket(prvpacket, (primeBitsLength/8) + 4);
-    this->setPackets(prvpacket, (primeBitsLength/8) + 4);
+    memcpy(prvpacket + (primeBitsLength/8) + 4, ticket.c_str(), ticket.size());
+    this->setPackets(prvpacket, prvSize);
     ReliableSocket::sendMessage();
     delete []prvpacket;
+    deriveTrafficKeys();
+    secureLatency.keyExchange.recordSince(handshakeStart);
 }
 
 void SecureSocket::connectForeignAddressPort(const string &address, unsigned short port) {
+    // TODO: STEP0 -- present a session ticket in the handshake packet if we have one,
+    //  with the early data sealed under the resumption secret if it fits into the packet
+    string serverName = address + ":" + to_string(port), clientNonce;
+    sessionTicket cached;
+    handshakeRequest.clear(); resumedSession = false; earlyDataAccepted = false;
+    isServerSide = false;
+    if (sessionTicketLifetime > 0 && takeTicket(serverName, cached)
+        && 1 + HANDSHAKE_NONCE_SIZE + cached.ticket.size() <= packetSize) {
+        clientNonce = randomBytes(HANDSHAKE_NONCE_SIZE);
+        handshakeRequest = string(1, (char)RESUME_TICKET) + clientNonce + cached.ticket;
+        unsigned int earlySize = handshakeRequest.size() + 8 + earlyData.size() + 16;
+        if (!earlyData.empty() && earlyData.size() <= maxEarlyDataSize && earlySize <= packetSize) {
+            handshakeRequest[0] = (char)(RESUME_TICKET | EARLY_DATA);
+            long long clientTime = time(0);
+            handshakeRequest += string(reinterpret_cast<char *>(&clientTime), 8);
+            handshakeRequest += sealEarlyData(reinterpret_cast<const unsigned char *>(cached.secret.c_str()),
+                    clientNonce, handshakeRequest);
+        }
+    }
     ReliableSocket::connectForeignAddressPort(address, port);
+    if (!clientNonce.empty() && handshakeResponse.size() == 1 + HANDSHAKE_NONCE_SIZE + SESSION_TICKET_SIZE
+        && ((unsigned char)handshakeResponse[0] & RESUME_TICKET) != 0u) {
+        earlyDataAccepted = ((unsigned char)handshakeRequest[0] & EARLY_DATA) != 0u
+                && ((unsigned char)handshakeResponse[0] & EARLY_DATA) != 0u;
+        deriveResumedKey(reinterpret_cast<const unsigned char *>(cached.secret.c_str()), clientNonce,
+                handshakeResponse.substr(1, HANDSHAKE_NONCE_SIZE));
+        storeTicket(serverName, handshakeResponse.substr(1 + HANDSHAKE_NONCE_SIZE));
+        resumedSession = true;
+        EventTrace::record(TRACE_RESUME, traceSocket, 0, 0, 0,
+                earlyDataAccepted ? TRACE_RESUME_EARLY_DATA : TRACE_RESUME_ACCEPTED);
+        deriveTrafficKeys();
+        secureLatency.keyExchange.recordSince(handshakeStart);
+        sendRejectedEarlyData();
+        return;
+    }
     // TODO: STEP1 -- Receive public message from peer side.
     ReliableSocket::receiveMessage();
     char *pubmessage = new char [messageLength + 1];
     this->readMessage(pubmessage, messageLength + 1);
     parsePublicPacket(pubmessage);
     delete []pubmessage;
+    prepareEphemeralKey();
     // TODO: STEP2 -- Send private message of client side.
     char *prvpacket = new char [(primeBitsLength/8) + 4];
     getPrivatePacket(prvpacket, (primeBitsLength/8) + 4);
@@ -187,85 +614,319 @@ void SecureSocket::connectForeignAddressPort(const string &address, unsigned sho
     char *prvmessage = new char [messageLength + 1];
     this->readMessage(prvmessage, messageLength + 1);
     parsePrivatePacket(prvmessage);
+    // TODO: STEP4 -- keep the session ticket appended to the private packet
+    if (messageLength == (primeBitsLength/8) + 4 + SESSION_TICKET_SIZE) {
+        deriveResumptionSecret();
+        storeTicket(serverName, string(prvmessage + (primeBitsLength/8) + 4, SESSION_TICKET_SIZE));
+    }
     delete []prvmessage;
+    deriveTrafficKeys();
+    secureLatency.keyExchange.recordSince(handshakeStart);
+    sendRejectedEarlyData();
+}
+
+void SecureSocket::setEarlyData(const char *message, unsigned int mLength) {
+    earlyData = string(message, mLength);
+}
+
+void SecureSocket::sendRejectedEarlyData() {
+    if (earlyData.empty()) return;
+    string pending;
+    pending.swap(earlyData);
+    if (earlyDataAccepted) return;
+    // TODO: no ticket, too big, or rejected by the server, send it as the first normal message
+    this->setPackets(pending.c_str(), pending.size());
+    sendMessage();
+}
+
+void SecureSocket::deriveTrafficKeys() {
+    auto material = new unsigned char [primeBitsLength/8];
+    exportKeyMaterial(material);
+    unsigned char master[32];
+    hkdf(material, primeBitsLength/8, nullptr, 0, "tlsudp master", master, sizeof(master));
+    memset(material, 0, primeBitsLength/8);
+    delete []material;
+
+    // TODO: one secret per direction, so that the two sides never encrypt under the same key & iv
+    trafficState &clientState = isServerSide ? receiveTraffic : sendTraffic;
+    trafficState &serverState = isServerSide ? sendTraffic : receiveTraffic;
+    hkdf(master, sizeof(master), nullptr, 0, "tlsudp client traffic", clientState.secret, sizeof(clientState.secret));
+    hkdf(master, sizeof(master), nullptr, 0, "tlsudp server traffic", serverState.secret, sizeof(serverState.secret));
+    memset(master, 0, sizeof(master));
+    sendTraffic.generation = receiveTraffic.generation = 0;
+    expandTrafficKey(sendTraffic, true);
+    expandTrafficKey(receiveTraffic, false);
+}
+
+void SecureSocket::expandTrafficKey(SecureSocket::trafficState &state, bool encrypt) {
+    // TODO: always expand 32 bytes, AES uses the first aesKeyBitsLength bits and ChaCha20 the whole key
+    hkdf(state.secret, sizeof(state.secret), nullptr, 0, "tlsudp key", state.key, sizeof(state.key));
+    hkdf(state.secret, sizeof(state.secret), nullptr, 0, "tlsudp iv", state.iv, AES_BLOCK_SIZE);
+    if (encrypt) AES_set_encrypt_key(state.key, aesKeyBitsLength, &state.aesKey);
+    else AES_set_decrypt_key(state.key, aesKeyBitsLength, &state.aesKey);
+    state.records = 0; state.bytes = 0;
+    state.ready = true;
+}
+
+void SecureSocket::nextRecordIv(SecureSocket::trafficState &state, unsigned char *recordIv) const {
+    if (!state.ready) throw SocketException("Please finish the handshake before sending messages.");
+    // TODO: per-record iv = iv XOR big endian record number, like TLS 1.3 nonces
+    memcpy(recordIv, state.iv, AES_BLOCK_SIZE);
+    for (int i = 0; i < 8; ++i)
+        recordIv[AES_BLOCK_SIZE - 1 - i] ^= (unsigned char)(state.records >> (8u * i));
+}
+
+void SecureSocket::finishRecord(SecureSocket::trafficState &state, unsigned int plainSize, bool encrypt) {
+    state.records += 1;
+    state.bytes += plainSize;
+    if (state.records < rekeyRecordLimit && state.bytes < rekeyByteLimit) return;
+    // TODO: both sides count the same records & bytes, so they rotate at the same record without signaling
+    unsigned char nextSecret[32];
+    hkdf(state.secret, sizeof(state.secret), nullptr, 0, "tlsudp traffic update", nextSecret, sizeof(nextSecret));
+    memcpy(state.secret, nextSecret, sizeof(nextSecret));
+    memset(nextSecret, 0, sizeof(nextSecret));
+    state.generation += 1;
+    expandTrafficKey(state, encrypt);
+    EventTrace::record(TRACE_REKEY, traceSocket, 0, encrypt ? 1 : 0, 0, state.generation);
+}
+
+const EVP_CIPHER *SecureSocket::recordCipher(unsigned char cipherId) const {
+    if (cipherId == RECORD_CHACHA20) return EVP_chacha20_poly1305();
+    if (cipherId != RECORD_AES_GCM) throw SocketException("Unknown record cipher " + to_string(cipherId));
+    if (aesKeyBitsLength == 128) return EVP_aes_128_gcm();
+    if (aesKeyBitsLength == 192) return EVP_aes_192_gcm();
+    return EVP_aes_256_gcm();
+}
+
+shared_ptr<ThreadPool> SecureSocket::getCryptoPool() {
+    if (!cryptoPool) cryptoPool = make_shared<ThreadPool>(cryptoThreads);
+    return cryptoPool;
+}
+
+vector<SecureSocket::messageView> SecureSocket::sliceViews(const vector<messageView> &parts,
+        unsigned int offset, unsigned int size) {
+    vector<messageView> slice;
+    for (auto &part: parts) {
+        if (size == 0) break;
+        if (offset >= part.size) {offset -= part.size; continue;}
+        unsigned int take = min(part.size - offset, size);
+        slice.push_back({part.data + offset, take});
+        offset = 0; size -= take;
+    }
+    return slice;
+}
+
+void SecureSocket::sendRecords(const vector<messageView> &parts, unsigned int mLength) {
+    auto pool = getCryptoPool();
+    const EVP_CIPHER *cipher = recordCipher(recordCipherId);
+    unsigned int recordCount = (mLength + recordSize - 1) / recordSize, nextRecord = 0;
+    deque<future<string>> sealing;
+    try {
+        for (unsigned int sent = 0; sent < recordCount; ++sent) {
+            // TODO: keep the workers busy with the next records while the reliable layer sends this one
+            while (nextRecord < recordCount && sealing.size() < 2 * pool->size()) {
+                unsigned int offset = nextRecord * recordSize, size = min(recordSize, mLength - offset);
+                recordKey rkey;
+                memcpy(rkey.key, sendTraffic.key, sizeof(rkey.key));
+                nextRecordIv(sendTraffic, rkey.iv);
+                finishRecord(sendTraffic, size, true);
+                auto slice = sliceViews(parts, offset, size);
+                auto sealLatency = &secureLatency.sealRecord;
+                unsigned short traceId = traceSocket, traceSeq = nextRecord, traceFlag = recordCipherId;
+                sealing.push_back(pool->submit([cipher, rkey, slice, size, sealLatency, traceId, traceSeq, traceFlag]{
+                    auto sealStart = chrono::steady_clock::now();
+                    auto sealed = aeadSeal(cipher, rkey.key, rkey.iv + AES_BLOCK_SIZE - 12, "", slice, size);
+                    auto took = chrono::steady_clock::now() - sealStart;
+                    sealLatency->record(took);
+                    EventTrace::record(TRACE_RECORD_SEALED, traceId, traceSeq, traceFlag, size,
+                            (unsigned int)chrono::duration_cast<chrono::nanoseconds>(took).count());
+                    return sealed;
+                }));
+                ++nextRecord;
+            }
+            string sealed = sealing.front().get();
+            sealing.pop_front();
+            this->setPacketsView(sealed.c_str(), sealed.size());
+            ReliableSocket::sendMessage();
+            releasePackets();
+        }
+    } catch (...) {
+        // TODO: workers still read the parts, wait for them before the caller releases them
+        releasePackets();
+        for (auto &pending: sealing) pending.wait();
+        throw;
+    }
+}
+
+void SecureSocket::receiveRecords(unsigned int mLength, unsigned char cipherId, unsigned int rSize) {
+    if (rSize == 0) throw SocketException("Record size of the length message is zero");
+    auto pool = getCryptoPool();
+    const EVP_CIPHER *cipher = recordCipher(cipherId);
+    unsigned int recordCount = (mLength + rSize - 1) / rSize;
+    auto plaintext = new unsigned char [mLength + 1];
+    vector<future<bool>> opening;
+    bool authentic = true;
+    try {
+        for (unsigned int i = 0; i < recordCount; ++i) {
+            unsigned int offset = i * rSize, size = min(rSize, mLength - offset);
+            ReliableSocket::receiveMessage();
+            if (messageLength != size + 16) throw SocketException("Record doesn't match its length message");
+            auto sealed = make_shared<vector<unsigned char>>(messageLength + 1);
+            this->readMessage(reinterpret_cast<char *>(sealed->data()), messageLength + 1);
+            recordKey rkey;
+            memcpy(rkey.key, receiveTraffic.key, sizeof(rkey.key));
+            nextRecordIv(receiveTraffic, rkey.iv);
+            finishRecord(receiveTraffic, size, false);
+            // TODO: open this record on the workers while the reliable layer receives the next one
+            auto openLatency = &secureLatency.openRecord;
+            unsigned short traceId = traceSocket, traceSeq = i, traceFlag = cipherId;
+            opening.push_back(pool->submit([cipher, rkey, sealed, plaintext, offset, size, openLatency,
+                    traceId, traceSeq, traceFlag]{
+                auto openStart = chrono::steady_clock::now();
+                bool opened = aeadOpen(cipher, rkey.key, rkey.iv + AES_BLOCK_SIZE - 12, "", sealed->data(), size + 16,
+                        plaintext + offset);
+                auto took = chrono::steady_clock::now() - openStart;
+                openLatency->record(took);
+                EventTrace::record(TRACE_RECORD_OPENED, traceId, traceSeq, traceFlag, size,
+                        (unsigned int)chrono::duration_cast<chrono::nanoseconds>(took).count());
+                return opened;
+            }));
+        }
+        for (auto &pending: opening) authentic = pending.get() && authentic;
+    } catch (...) {
+        for (auto &pending: opening) pending.wait();
+        delete []plaintext; throw;
+    }
+    if (!authentic) {delete []plaintext; throw SocketException("Record authentication failed");}
+    this->setPackets(reinterpret_cast<char *>(plaintext), mLength);
+    delete []plaintext;
 }
 
 void SecureSocket::sendMessage() {
-    // TODO: STEP1 -- get AES key & iv & plaintext
+    // TODO: STEP1 -- get plaintext set by setPackets
     auto mLength = messageLength;
-    auto charkey = new unsigned char [primeBitsLength/8];
-    mpz_export(charkey, nullptr, -1, sizeof(unsigned char), -1, 0, exchangedKey);
-    AES_KEY aeskey;
-    AES_set_encrypt_key(charkey, aesKeyBitsLength, &aeskey);
-
     auto plaintext = new unsigned char [mLength + 1];
     this->readMessage(reinterpret_cast<char *>(plaintext), mLength + 1);
+    try {
+        sendMessage({{plaintext, mLength}});
+    } catch (...) {
+        delete []plaintext; throw;
+    }
+    delete []plaintext;
+}
+
+void SecureSocket::sendMessage(const vector<messageView> &parts) {
+    // TODO: STEP1 -- get cached AES key & message length
+    auto messageStart = chrono::steady_clock::now();
+    unsigned int mLength = 0;
+    for (auto &part: parts) mLength += part.size;
+    unsigned char recordIv[AES_BLOCK_SIZE];
 
     // TODO: STEP2 -- send encrypted plaintext length
     unsigned char plainlen[AES_BLOCK_SIZE * 2] = {0}, cipherlen[AES_BLOCK_SIZE * 3] = {0};
+    bool pipelined = mLength >= parallelThreshold;
     *((unsigned int*)plainlen) = mLength;
-    AES_cbc_encrypt(plainlen, cipherlen, AES_BLOCK_SIZE * 2,
-            &aeskey, (charkey + aesKeyBitsLength/8), AES_ENCRYPT);
+    plainlen[4] = pipelined ? AEAD_RECORDS : CBC_MESSAGE;
+    plainlen[5] = recordCipherId;
+    *((unsigned int*)(plainlen + 8)) = recordSize;
+    nextRecordIv(sendTraffic, recordIv);
+    AES_cbc_encrypt(plainlen, cipherlen, AES_BLOCK_SIZE * 2, &sendTraffic.aesKey, recordIv, AES_ENCRYPT);
+    finishRecord(sendTraffic, AES_BLOCK_SIZE * 2, true);
     this->setPackets(reinterpret_cast<char *>(cipherlen), AES_BLOCK_SIZE * 2);
     ReliableSocket::sendMessage();
-#ifdef SECURE_DEBUG
-//    auto decharkey = new unsigned char [primeBitsLength/8];
-//    mpz_export(decharkey, nullptr, -1, sizeof(unsigned char), -1, 0, exchangedKey);
-//    AES_KEY deaeskey;
-//    AES_set_decrypt_key(decharkey, aesKeyBitsLength/8, &deaeskey);
-//
-//    unsigned char deplainlen [AES_BLOCK_SIZE * 4] = {0};
-//    AES_cbc_encrypt(cipherlen, deplainlen, AES_BLOCK_SIZE * 2,
-//            &deaeskey, (decharkey + aesKeyBitsLength/8), AES_DECRYPT);
-//    delete []decharkey;
-    cout << "[Send encrypt] [Key length:" << aesKeyBitsLength << "] " << mLength << endl;
-#endif
 
-    // TODO: STEP3 -- send encrypted plaintext
-    auto ciphertext = new unsigned char [(mLength/AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE];
-//    for(int i = 0; i < mLength/AES_BLOCK_SIZE; ++i) {
-//        AES_ecb_encrypt(plaintext + i*AES_BLOCK_SIZE, ciphertext + i*AES_BLOCK_SIZE, &aeskey, AES_ENCRYPT);
-//    }
-    AES_cbc_encrypt(plaintext, ciphertext, mLength,
-            &aeskey, (charkey + aesKeyBitsLength/8), AES_ENCRYPT);
-    this->setPackets(reinterpret_cast<char *>(ciphertext), (mLength/AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE);
-    ReliableSocket::sendMessage();
-#ifdef SECURE_DEBUG
-    cout << "[Send encrypt] [Key length:" << aesKeyBitsLength << "] " << plaintext << endl;
-#endif
-    delete []charkey; delete []plaintext; delete []ciphertext;
+    // TODO: STEP3 -- send large plaintext as AEAD records sealed in parallel
+    if (pipelined) {
+        sendRecords(parts, mLength);
+        secureLatency.sendMessage.recordSince(messageStart);
+        return;
+    }
+
+    // TODO: STEP3 -- encrypt the parts in place of reading them into one plaintext buffer,
+    //  AES_cbc_encrypt chains recordIv, only blocks straddling two parts are staged in carry
+    unsigned int cipherSize = (mLength/AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE, written = 0, carrySize = 0;
+    auto ciphertext = new unsigned char [cipherSize];
+    unsigned char carry[AES_BLOCK_SIZE];
+    auto sealStart = chrono::steady_clock::now();
+    nextRecordIv(sendTraffic, recordIv);
+    for (auto &part: parts) {
+        const unsigned char *data = part.data;
+        unsigned int left = part.size;
+        if (carrySize != 0) {
+            unsigned int take = min(left, (unsigned int)AES_BLOCK_SIZE - carrySize);
+            memcpy(carry + carrySize, data, take);
+            carrySize += take; data += take; left -= take;
+            if (carrySize < AES_BLOCK_SIZE) continue;
+            AES_cbc_encrypt(carry, ciphertext + written, AES_BLOCK_SIZE, &sendTraffic.aesKey, recordIv, AES_ENCRYPT);
+            written += AES_BLOCK_SIZE; carrySize = 0;
+        }
+        unsigned int aligned = left - left % AES_BLOCK_SIZE;
+        if (aligned != 0)
+            AES_cbc_encrypt(data, ciphertext + written, aligned, &sendTraffic.aesKey, recordIv, AES_ENCRYPT);
+        written += aligned;
+        memcpy(carry, data + aligned, left - aligned);
+        carrySize = left - aligned;
+    }
+    memset(carry + carrySize, 0, AES_BLOCK_SIZE - carrySize);
+    AES_cbc_encrypt(carry, ciphertext + written, AES_BLOCK_SIZE, &sendTraffic.aesKey, recordIv, AES_ENCRYPT);
+    finishRecord(sendTraffic, mLength, true);
+    auto sealTook = chrono::steady_clock::now() - sealStart;
+    secureLatency.sealRecord.record(sealTook);
+    EventTrace::record(TRACE_RECORD_SEALED, traceSocket, 0, 0, mLength,
+            (unsigned int)chrono::duration_cast<chrono::nanoseconds>(sealTook).count());
+    this->setPacketsView(reinterpret_cast<char *>(ciphertext), cipherSize);
+    try {
+        ReliableSocket::sendMessage();
+    } catch (...) {
+        releasePackets(); delete []ciphertext; throw;
+    }
+    releasePackets();
+    delete []ciphertext;
+    secureLatency.sendMessage.recordSince(messageStart);
 }
 
 void SecureSocket::receiveMessage() {
-    // TODO: STEP1 -- get AES key & iv
-    auto charkey = new unsigned char[primeBitsLength/8];
-    mpz_export(charkey, nullptr, -1, sizeof(unsigned char), -1, 0, exchangedKey);
-    AES_KEY aeskey;
-    AES_set_decrypt_key(charkey, aesKeyBitsLength, &aeskey);
+    // TODO: STEP0 -- early data accepted with the handshake is the first message
+    if (!earlyData.empty()) {
+        this->setPackets(earlyData.c_str(), earlyData.size());
+        earlyData.clear();
+        return;
+    }
+    // TODO: STEP1 -- get cached AES key
+    unsigned char recordIv[AES_BLOCK_SIZE];
 
     // TODO: STEP2 -- receive encrypted length message
     ReliableSocket::receiveMessage();
+    auto messageStart = chrono::steady_clock::now();
     if (messageLength != AES_BLOCK_SIZE * 2) throw SocketException("Please send encrypt length message first");
     unsigned char cipherlen[AES_BLOCK_SIZE * 2 + 1] = {0}, plainlen[AES_BLOCK_SIZE * 2] = {0};
     this->readMessage(reinterpret_cast<char *>(cipherlen), AES_BLOCK_SIZE * 2 + 1);
-    AES_cbc_encrypt(cipherlen, plainlen, AES_BLOCK_SIZE * 2,
-            &aeskey, (charkey + aesKeyBitsLength/8), AES_DECRYPT);
+    nextRecordIv(receiveTraffic, recordIv);
+    AES_cbc_encrypt(cipherlen, plainlen, AES_BLOCK_SIZE * 2, &receiveTraffic.aesKey, recordIv, AES_DECRYPT);
+    finishRecord(receiveTraffic, AES_BLOCK_SIZE * 2, false);
     unsigned int mLength = *((unsigned int*)plainlen);
-#ifdef SECURE_DEBUG
-    cout << "[Received decrypt] [Key length:" << aesKeyBitsLength << "] " << mLength << endl;
-#endif
+    if (plainlen[4] == AEAD_RECORDS) {
+        receiveRecords(mLength, plainlen[5], *((unsigned int*)(plainlen + 8)));
+        secureLatency.receiveMessage.recordSince(messageStart);
+        return;
+    }
 
     // TODO: STEP3 -- receive encrypted message
     ReliableSocket::receiveMessage();
+    if (messageLength != (mLength/AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE)
+        throw SocketException("Encrypted message doesn't match its length message");
     auto ciphertext = new unsigned char [messageLength + 1];
     this->readMessage(reinterpret_cast<char *>(ciphertext), messageLength + 1);
     auto plaintext = new unsigned char [messageLength];
-    AES_cbc_encrypt(ciphertext, plaintext, mLength,
-            &aeskey, (charkey + aesKeyBitsLength/8), AES_DECRYPT);
+    auto openStart = chrono::steady_clock::now();
+    nextRecordIv(receiveTraffic, recordIv);
+    AES_cbc_encrypt(ciphertext, plaintext, mLength, &receiveTraffic.aesKey, recordIv, AES_DECRYPT);
+    finishRecord(receiveTraffic, mLength, false);
+    auto openTook = chrono::steady_clock::now() - openStart;
+    secureLatency.openRecord.record(openTook);
+    EventTrace::record(TRACE_RECORD_OPENED, traceSocket, 0, 0, mLength,
+            (unsigned int)chrono::duration_cast<chrono::nanoseconds>(openTook).count());
     this->setPackets(reinterpret_cast<char *>(plaintext), mLength);
-#ifdef SECURE_DEBUG
-    cout << "[Received decrypt] [Key length:" << aesKeyBitsLength << "] "
-        << string(reinterpret_cast<char *>(plaintext), mLength) << endl;
-#endif
-    delete []charkey; delete []plaintext; delete []ciphertext;
+    delete []plaintext; delete []ciphertext;
+    secureLatency.receiveMessage.recordSince(messageStart);
 }
@@ -0,0 +1,40 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+
+#include "../include/ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned int threadCount) {
+    if (threadCount == 0) threadCount = thread::hardware_concurrency();
+    if (threadCount == 0) threadCount = 1;
+    for (unsigned int i = 0; i < threadCount; ++i)
+        workers.emplace_back([this]{this->workerLoop();});
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    for (auto &worker: workers) worker.join();
+}
+
+size_t ThreadPool::pendingSize() {
+    lock_guard<mutex> lock(queueMutex);
+    return tasks.size();
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            queueChanged.wait(lock, [this]{return stopping || !tasks.empty();});
+            if (tasks.empty()) return;
+            task = move(tasks.front());
+            tasks.pop();
+        }
+        task();
+    }
+}
@@ -29,6 +29,7 @@
 #else
 #include <sys/types.h>       // For data types
 #include <sys/socket.h>      // For socket(), connect(), send(), and recv()
+#include <sys/uio.h>         // For iovec of sendmsg()
 #include <netdb.h>           // For gethostbyname()
 #include <arpa/inet.h>       // For inet_addr()
 #include <unistd.h>          // For close()
@@ -192,18 +193,46 @@ void CommunicatingSocket::connect(const string &foreignAddress,
     if (::connect(sockDesc, (sockaddr *) &destAddr, sizeof(destAddr)) < 0) {
         throw SocketException("Connect failed (connect())", true);
     }
+    if (capture) refreshCaptureEndpoints();
 }
 
 void CommunicatingSocket::send(const void *buffer, int bufferLen) {
+    // EDIT: captured before the datagram leaves, so an answer never shows up before it
+    if (capture) capture->record(captureInterface, true, captureEnds, buffer, bufferLen);
+    if (impairment && impairment->submit(buffer, bufferLen)) return;
     if (::send(sockDesc, (raw_type *) buffer, bufferLen, 0) < 0) {
         throw SocketException("Send failed (send())", true);
     }
 }
 
+void CommunicatingSocket::send(const void *header, int headerLen, const void *body, int bodyLen) {
+    if (capture) capture->record(captureInterface, true, captureEnds, header, headerLen, body, bodyLen);
+    if (impairment && impairment->submit(header, headerLen, body, bodyLen)) return;
+#ifdef WIN32
+    char *datagram = new char [headerLen + bodyLen];
+    memcpy(datagram, header, headerLen);
+    memcpy(datagram + headerLen, body, bodyLen);
+    int rtn = ::send(sockDesc, (raw_type *) datagram, headerLen + bodyLen, 0);
+    delete []datagram;
+#else
+    iovec parts[2];
+    parts[0].iov_base = const_cast<void *>(header); parts[0].iov_len = headerLen;
+    parts[1].iov_base = const_cast<void *>(body); parts[1].iov_len = bodyLen;
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = parts; message.msg_iovlen = 2;
+    int rtn = ::sendmsg(sockDesc, &message, 0);
+#endif
+    if (rtn < 0) {
+        throw SocketException("Send failed (sendmsg())", true);
+    }
+}
+
 int CommunicatingSocket::recv(void *buffer, int bufferLen) {
     int rtn;
     // EDIT: by @shesl-meow, passing exception processing to upper layer
     rtn = ::recv(sockDesc, (raw_type *) buffer, bufferLen, 0);
+    if (rtn > 0 && capture) capture->record(captureInterface, false, captureEnds, buffer, rtn);
     return rtn;
 }
 
@@ -227,6 +256,39 @@ unsigned short CommunicatingSocket::getForeignPort() const {
     return ntohs(addr.sin_port);
 }
 
+void CommunicatingSocket::setCapture(const shared_ptr<PacketCapture> &packetCapture, const string &interfaceName) {
+    capture = packetCapture;
+    if (!capture) return;
+    captureInterface = capture->addInterface(interfaceName);
+    refreshCaptureEndpoints();
+}
+
+void CommunicatingSocket::setImpairment(const NetworkImpairment::settings &linkSettings) {
+    impairment.reset();
+    if (!NetworkImpairment::isActive(linkSettings)) return;
+    int descriptor = sockDesc;
+    // EDIT: a delayed datagram that can't be sent is lost like any other
+    impairment.reset(new NetworkImpairment(linkSettings, [descriptor](const string &datagram) {
+        ::send(descriptor, (const raw_type *) datagram.c_str(), datagram.size(), 0);
+    }));
+}
+
+void CommunicatingSocket::refreshCaptureEndpoints() {
+    sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    // TODO: unbound or unconnected ends stay 0.0.0.0:0 until the next refresh
+    captureEnds = PacketCapture::endpoints();
+    if (getsockname(sockDesc, (sockaddr *) &addr, &addrLen) == 0) {
+        captureEnds.localAddress = addr.sin_addr.s_addr;
+        captureEnds.localPort = addr.sin_port;
+    }
+    addrLen = sizeof(addr);
+    if (getpeername(sockDesc, (sockaddr *) &addr, &addrLen) == 0) {
+        captureEnds.foreignAddress = addr.sin_addr.s_addr;
+        captureEnds.foreignPort = addr.sin_port;
+    }
+}
+
 
 // UDPSocket Code
 
@@ -275,6 +337,11 @@ void UdpSocket::sendTo(const void *buffer, int bufferLen,
                        const string &foreignAddress, unsigned short foreignPort) {
     sockaddr_in destAddr;
     fillAddr(foreignAddress, foreignPort, destAddr);
+    if (capture) {
+        auto ends = captureEnds;
+        ends.foreignAddress = destAddr.sin_addr.s_addr; ends.foreignPort = destAddr.sin_port;
+        capture->record(captureInterface, true, ends, buffer, bufferLen);
+    }
 
     // Write out the whole buffer as a single message.
     if (sendto(sockDesc, (raw_type *) buffer, bufferLen, 0,
@@ -293,6 +360,11 @@ int UdpSocket::recvFrom(void *buffer, int bufferLen, string &sourceAddress,
                         (sockaddr *) &clntAddr, (socklen_t *) &addrLen);
     sourceAddress = inet_ntoa(clntAddr.sin_addr);
     sourcePort = ntohs(clntAddr.sin_port);
+    if (rtn > 0 && capture) {
+        auto ends = captureEnds;
+        ends.foreignAddress = clntAddr.sin_addr.s_addr; ends.foreignPort = clntAddr.sin_port;
+        capture->record(captureInterface, false, ends, buffer, rtn);
+    }
 
     return rtn;
 }
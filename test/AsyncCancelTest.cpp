@@ -0,0 +1,51 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+#include "../include/ReliableSocket.h"
+#include <iostream>             // For cerr
+
+#define TEST_ADDRESS "127.0.0.1"
+#define TEST_PORT 47000
+
+/**
+ * A socket destroyed while its receive waits on a silent peer: the destructor has to cancel the receive
+ *  instead of waiting for it forever, and the receive fails with a SocketException.
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        cerr << "Usage: " << argv[0] << " <Config File>" << endl;
+        return 1;
+    }
+    auto server = new ReliableSocket(argv[1]);
+    server->bindLocalAddressPort(TEST_ADDRESS, TEST_PORT);
+    thread listener([server]{server->startListen();});
+    ReliableSocket client(argv[1]);
+    client.connectForeignAddressPort(TEST_ADDRESS, TEST_PORT);
+    listener.join();
+
+    // TODO: the receive is queued before the send it waits for, which never comes
+    char buffer[64];
+    auto received = server->receiveMessageAsync(buffer, sizeof(buffer));
+    this_thread::sleep_for(chrono::milliseconds(100));
+    auto start = chrono::steady_clock::now();
+    delete server;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    bool failed = false;
+    try {
+        received.get();
+    } catch (SocketException &e) {
+        failed = true;
+    }
+    if (!failed) {
+        cerr << "The pending receive didn't fail" << endl;
+        return 1;
+    }
+    // cancelled within one recv timeout of the config, not after the peer
+    if (seconds > 10) {
+        cerr << "Destroying the socket took " << seconds << " s" << endl;
+        return 1;
+    }
+    cout << "destroyed with a pending receive in " << seconds << " s" << endl;
+    return 0;
+}
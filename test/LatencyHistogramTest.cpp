@@ -0,0 +1,40 @@
+//
+// Created by shesl-meow on 26-10-19.
+//
+#include "../include/LatencyHistogram.h"
+#include <iostream>             // For cerr
+
+static bool expect(const char *name, unsigned long long got, unsigned long long wanted) {
+    if (got == wanted) return true;
+    cerr << name << ": got " << got << ", wanted " << wanted << endl;
+    return false;
+}
+
+/**
+ * Quantiles of a few samples take the nearest rank: with 10 samples p99 is the largest one, not the 9th,
+ *  and a single sample is every quantile.
+ */
+int main() {
+    bool passed = true;
+
+    LatencyHistogram ten;
+    for (unsigned long long value = 1; value <= 10; ++value) ten.record(value);
+    passed &= expect("p99 of 10", ten.quantile(0.99), 10);
+    passed &= expect("p90 of 10", ten.quantile(0.9), 9);
+    passed &= expect("p50 of 10", ten.quantile(0.5), 5);
+    passed &= expect("p0 of 10", ten.quantile(0), 1);
+    passed &= expect("p100 of 10", ten.quantile(1), 10);
+
+    LatencyHistogram one;
+    one.record(1000);
+    passed &= expect("p50 of 1", one.quantile(0.5), 1000);
+    passed &= expect("p0 of 1", one.quantile(0), 1000);
+    passed &= expect("p99 of 1", one.quantile(0.99), 1000);
+
+    LatencyHistogram none;
+    passed &= expect("p50 of 0", none.quantile(0.5), 0);
+
+    if (!passed) return 1;
+    cout << "quantiles of small sample counts" << endl;
+    return 0;
+}